@@ -0,0 +1,372 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "structs.h"
+
+/*
+ * Benchmark driver for the filesystem.
+ *
+ * Every phase starts from a fresh image, pipes a generated command script
+ * into the filesystem binary and collects the per-command latency
+ * histograms it dumps with -s. Results are printed as one JSON object per
+ * line so runs can be diffed against each other.
+ */
+
+#define MAX_PATH 4096
+
+/*  Sizing of the phases, multiplied by the -n scale where it fits the image   */
+#define FANOUT_DIRS 500
+#define CD_DEPTH 200
+#define CD_ROUNDS 5
+#define SEQ_FILES 10
+#define SEQ_FILE_SIZE (64 * 1024)
+#define SEQ_CAT_ROUNDS 5
+#define GET_FILE_SIZE (256 * 1024)
+#define GET_COUNT 2000
+#define GET_LENGTH 64
+#define LS_ENTRIES 600
+#define LS_ROUNDS 50
+#define TREE_DIRS 20
+#define TREE_FILES 20
+#define TREE_ROUNDS 5
+#define FULL_FILE_SIZE (64 * 1024)
+#define FULL_FILES 20
+#define SCANDISK_ROUNDS 10
+
+char * fsBinary;
+char image[MAX_PATH];
+char statsPath[MAX_PATH];
+int scale = 1;
+char * backend = "mmap";
+char * mountOptions = "";
+// Page faults taken by the filesystem over the last phase, setup included
+long minorFaults = 0;
+long majorFaults = 0;
+
+/**
+ * Writes a write command for a file made of amount copies of one byte
+ */
+void emitWrite(FILE * fp, char * filename, int amount, unsigned char byte) {
+	int i;
+	fprintf(fp, "write %s %d ", filename, amount);
+	for(i = 0; i < amount; i++) {
+		fprintf(fp, "%02x", byte);
+	}
+	fprintf(fp, "\n");
+}
+
+/**
+ * Start the filesystem on a fresh image, returns a stream for its stdin
+ */
+FILE * startFilesystem(pid_t * pid) {
+	int fds[2];
+	unlink(image);
+	if(pipe(fds) < 0) {
+		perror("Error creating pipe");
+		exit(-1);
+	}
+
+	*pid = fork();
+	if(*pid < 0) {
+		perror("Error forking");
+		exit(-1);
+	}
+
+	if(*pid == 0) {
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(fds[0], STDIN_FILENO);
+		dup2(devNull, STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		close(devNull);
+
+		if(*mountOptions) {
+			execl(fsBinary, fsBinary, "-s", statsPath, "-b", backend, "-o", mountOptions, image, (char *)NULL);
+		} else {
+			execl(fsBinary, fsBinary, "-s", statsPath, "-b", backend, image, (char *)NULL);
+		}
+		perror("Error starting filesystem");
+		exit(-1);
+	}
+
+	close(fds[0]);
+	return fdopen(fds[1], "w");
+}
+
+/**
+ * Close the command stream and wait for the filesystem to dump its stats
+ */
+void stopFilesystem(FILE * fp, pid_t pid) {
+	int status;
+	struct rusage usage;
+	fprintf(fp, "quit\n");
+	fclose(fp);
+	wait4(pid, &status, 0, &usage);
+	minorFaults = usage.ru_minflt;
+	majorFaults = usage.ru_majflt;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Filesystem exited abnormally (status %d)\n", status);
+	}
+}
+
+/**
+ * Report the latency of one command of a phase from the stats dump
+ */
+void report(char * phase, char * command) {
+	FILE * fp = fopen(statsPath, "r");
+	if(fp == NULL) {
+		perror("Error opening stats file");
+		return;
+	}
+
+	char * line = NULL;
+	size_t size = 0;
+	char needle[64];
+	snprintf(needle, sizeof (needle), "{\"command\": \"%s\",", command);
+
+	BOOL found = FALSE;
+	while(getline(&line, &size, fp) != -1) {
+		char * entry = strstr(line, needle);
+		if(entry == NULL) {
+			continue;
+		}
+
+		unsigned long count = 0;
+		unsigned long long total = 0, p50 = 0, p99 = 0, maxNs = 0;
+		char * fields = entry + strlen(needle);
+		sscanf(fields, " \"count\": %lu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+			&count, &total, &p50, &p99, &maxNs);
+
+		double opsPerSec = total ? count / (total / 1e9) : 0;
+		printf("{\"phase\": \"%s\", \"backend\": \"%s\", \"options\": \"%s\", \"command\": \"%s\", \"ops\": %lu, \"ops_per_sec\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"minor_faults\": %ld, \"major_faults\": %ld}\n",
+			phase, backend, mountOptions, command, count, opsPerSec, p50, p99, maxNs, minorFaults, majorFaults);
+		found = TRUE;
+		break;
+	}
+
+	if(!found) {
+		fprintf(stderr, "Phase %s recorded no %s commands\n", phase, command);
+	}
+
+	free(line);
+	fclose(fp);
+	fflush(stdout);
+}
+
+/*
+ * The phases. Each one sets up inside a scratch directory, resets the
+ * counters and then issues the operation being measured.
+ */
+
+void benchMkdirFanout(FILE * fp) {
+	int i;
+	fprintf(fp, "mkdir bench\ncd bench\nstats reset\n");
+	for(i = 0; i < FANOUT_DIRS; i++) {
+		fprintf(fp, "mkdir d%d\n", i);
+	}
+}
+
+void benchCdChain(FILE * fp) {
+	int i, round;
+	fprintf(fp, "mkdir bench\ncd bench\n");
+	for(i = 0; i < CD_DEPTH; i++) {
+		fprintf(fp, "mkdir x\ncd x\n");
+	}
+	for(i = 0; i < CD_DEPTH; i++) {
+		fprintf(fp, "cd ..\n");
+	}
+
+	fprintf(fp, "stats reset\n");
+	for(round = 0; round < CD_ROUNDS * scale; round++) {
+		for(i = 0; i < CD_DEPTH; i++) {
+			fprintf(fp, "cd x\n");
+		}
+		for(i = 0; i < CD_DEPTH; i++) {
+			fprintf(fp, "cd ..\n");
+		}
+	}
+}
+
+void benchSequential(FILE * fp) {
+	int i, round;
+	char filename[32];
+	fprintf(fp, "mkdir bench\ncd bench\nstats reset\n");
+	for(i = 0; i < SEQ_FILES; i++) {
+		snprintf(filename, sizeof (filename), "f%d", i);
+		emitWrite(fp, filename, SEQ_FILE_SIZE, 'a' + i);
+	}
+	for(round = 0; round < SEQ_CAT_ROUNDS * scale; round++) {
+		for(i = 0; i < SEQ_FILES; i++) {
+			fprintf(fp, "cat f%d\n", i);
+		}
+	}
+}
+
+void benchRandomGet(FILE * fp) {
+	int i;
+	fprintf(fp, "mkdir bench\ncd bench\n");
+	emitWrite(fp, "big", GET_FILE_SIZE, 'g');
+	fprintf(fp, "stats reset\n");
+
+	// Seeded so every run reads the same offsets
+	srand(303);
+	for(i = 0; i < GET_COUNT * scale; i++) {
+		int start = rand() % (GET_FILE_SIZE - GET_LENGTH);
+		fprintf(fp, "get big %d %d\n", start, start + GET_LENGTH);
+	}
+}
+
+void benchLsHuge(FILE * fp) {
+	int i;
+	fprintf(fp, "mkdir bench\ncd bench\n");
+	for(i = 0; i < LS_ENTRIES; i++) {
+		fprintf(fp, "mkdir d%d\n", i);
+	}
+	fprintf(fp, "stats reset\n");
+	for(i = 0; i < LS_ROUNDS * scale; i++) {
+		fprintf(fp, "ls\n");
+	}
+}
+
+void benchRmTree(FILE * fp) {
+	int i, j, round;
+	char filename[32];
+	fprintf(fp, "mkdir bench\ncd bench\nstats reset\n");
+	for(round = 0; round < TREE_ROUNDS * scale; round++) {
+		fprintf(fp, "mkdir tree\ncd tree\n");
+		for(i = 0; i < TREE_DIRS; i++) {
+			fprintf(fp, "mkdir d%d\ncd d%d\n", i, i);
+			for(j = 0; j < TREE_FILES; j++) {
+				snprintf(filename, sizeof (filename), "f%d", j);
+				emitWrite(fp, filename, 1, 'r');
+			}
+			fprintf(fp, "cd ..\n");
+		}
+		fprintf(fp, "cd ..\nrm -rf tree\n");
+	}
+}
+
+void benchScandiskFull(FILE * fp) {
+	int i;
+	char filename[32];
+	fprintf(fp, "mkdir bench\ncd bench\n");
+
+	// More data than the image holds, the tail writes fail once it is full
+	for(i = 0; i < FULL_FILES; i++) {
+		snprintf(filename, sizeof (filename), "f%d", i);
+		emitWrite(fp, filename, FULL_FILE_SIZE, 'z');
+	}
+
+	fprintf(fp, "stats reset\n");
+	for(i = 0; i < SCANDISK_ROUNDS * scale; i++) {
+		fprintf(fp, "scandisk\n");
+	}
+}
+
+struct Phase {
+	char * name;
+	void (*generate)(FILE * fp);
+	char * commands[3];
+};
+
+struct Phase phases[] = {
+	{ "mkdir_fanout", benchMkdirFanout, { "mkdir", NULL } },
+	{ "cd_chain", benchCdChain, { "cd", NULL } },
+	{ "sequential_write_cat", benchSequential, { "write", "cat", NULL } },
+	{ "random_get", benchRandomGet, { "get", NULL } },
+	{ "ls_huge_directory", benchLsHuge, { "ls", NULL } },
+	{ "rm_rf_tree", benchRmTree, { "rm -rf", NULL } },
+	{ "scandisk_full", benchScandiskFull, { "scandisk", NULL } },
+	{ NULL, NULL, { NULL } }
+};
+
+/*
+ * help() - Print a help message.
+ */
+void help(char *progname)
+{
+	printf("Usage: %s [-n SCALE] [-d DIR] [-p PHASE] [-b BACKEND] [-o OPTIONS] FILESYSTEM\n", progname);
+	printf("Times the core operations of the FILESYSTEM binary on fresh images\n");
+	printf("  -n SCALE  Repeat the measured operations SCALE times (default 1)\n");
+	printf("  -d DIR    Directory for the scratch image (default /tmp)\n");
+	printf("  -p PHASE  Only run the named phase\n");
+	printf("  -b BACKEND  Storage backend the filesystem uses (default mmap)\n");
+	printf("  -o OPTIONS  Mount options passed to the filesystem\n");
+	exit(0);
+}
+
+/*
+ * main() - Runs every phase and prints one JSON result per measured command
+ */
+int main(int argc, char **argv)
+{
+	long opt;
+	char * dir = "/tmp";
+	char * only = NULL;
+
+	while((opt = getopt(argc, argv, "hn:d:p:b:o:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'h':
+			help(argv[0]);
+			break;
+		case 'n':
+			scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'p':
+			only = optarg;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'o':
+			mountOptions = optarg;
+			break;
+		}
+	}
+
+	if(argv[optind] == NULL)
+	{
+		fprintf(stderr, "No filesystem binary provided, try -h for help.\n");
+		return 1;
+	}
+	fsBinary = argv[optind];
+
+	// A filesystem that dies mid-phase should not take the driver with it
+	signal(SIGPIPE, SIG_IGN);
+
+	snprintf(image, sizeof (image), "%s/fsbench-%d.img", dir, (int)getpid());
+	snprintf(statsPath, sizeof (statsPath), "%s/fsbench-%d.json", dir, (int)getpid());
+
+	int i, j;
+	for(i = 0; phases[i].name != NULL; i++)
+	{
+		if(only != NULL && strcmp(only, phases[i].name))
+		{
+			continue;
+		}
+
+		pid_t pid;
+		FILE * fp = startFilesystem(&pid);
+		phases[i].generate(fp);
+		stopFilesystem(fp, pid);
+
+		for(j = 0; phases[i].commands[j] != NULL; j++)
+		{
+			report(phases[i].name, phases[i].commands[j]);
+		}
+	}
+
+	unlink(image);
+	unlink(statsPath);
+	return 0;
+}
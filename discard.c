@@ -0,0 +1,36 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "discard.h"
+
+/**
+ * Punches a hole over the host blocks that lie entirely within length bytes
+ * at start, returns FALSE if the host file system cannot
+ */
+BOOL punchHole(int fd, long start, long length, long pageSize) {
+	struct stat info;
+	if(fstat(fd, &info) < 0) {
+		return FALSE;
+	}
+
+	// A partial host block would only be zeroed, which frees nothing
+	off_t block = info.st_blksize > 0 ? info.st_blksize : pageSize;
+	off_t first = (start + block - 1) / block * block;
+	off_t end = (start + length) / block * block;
+	if(end <= first) {
+		return TRUE;
+	}
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, end - first) == 0;
+}
+
+/**
+ * Bytes a file takes on the host, holes excluded
+ */
+long hostBytes(int fd) {
+	struct stat info;
+	if(fstat(fd, &info) < 0) {
+		return 0;
+	}
+	return (long)info.st_blocks * 512;
+}
@@ -0,0 +1,13 @@
+#ifndef DISCARD_H
+#define DISCARD_H
+
+/*
+ * Host file system calls that give an image's free space back. They live
+ * apart from the filesystem's headers, whose mkdir() and readahead() clash
+ * with the system's declarations.
+ */
+
+BOOL punchHole(int fd, long start, long length, long pageSize);
+long hostBytes(int fd);
+
+#endif
@@ -6,133 +6,521 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <time.h>
-#include <sys/mman.h>
 #include "support.h"
 #include "structs.h"
 #include "filesystem.h"
+#include "stats.h"
+#include "storage.h"
+#include "find.h"
+#include "import.h"
 
 unsigned char * allocTable;
-struct RootDir * rootDir;
-char * map;
+
+// Free pages left in each allocation group
+int groupFree[ALLOCATION_GROUPS];
+// Group new pages go to, -1 to follow the current directory
+int allocGroup = -1;
+
+// Generation each data page was last written in, and the one writes go to now
+unsigned int * pageGenerations;
+unsigned int generation = 1;
+// Identifies this image in its backups
+unsigned int imageId = 0;
+// Pages of the generation table changed since the last sync
+BOOL generationDirty[GENERATION_PAGES];
 
 short * currentDirBlockStack;
 short currentDirBlock;
 
+// Store small files inside their directory entry
+BOOL inlineMode = TRUE;
+
+// Depth of the directory stack at which a snapshot was entered, -1 outside of one
+short readOnlyDepth = -1;
+// (directory, name) hash -> entry page index, chained per bucket through
+// nameNext. A directory is indexed on its first lookup, every page of its
+// chain with the next entry it links to and the entry linking to it.
+int nameBuckets[NAME_BUCKETS];
+int nameNext[DATA_BLOCKS];
+int nameDirs[DATA_BLOCKS];
+int nameLinks[DATA_BLOCKS];
+int namePrevious[DATA_BLOCKS];
+unsigned int nameHashes[DATA_BLOCKS];
+// Set on the '.' page of each indexed directory
+BOOL nameIndexed[DATA_BLOCKS];
+
+// Share data pages with identical contents
+BOOL dedupMode = FALSE;
+
+// Store file data as compressed extents
+BOOL compressMode = FALSE;
+
+// Give pages freed by each command back to the host, pending ones are marked here
+BOOL discardMode = FALSE;
+unsigned char * discardPending = NULL;
+// Host bytes given back by discard mode so far
+long discardReclaimed = 0;
+
+// Reused by every read of a compressed file: the stored extent and its inflated data
+__thread unsigned char storedExtent[EXTENT_DATA_SIZE];
+__thread unsigned char extentBuffer[EXTENT_DATA_SIZE];
+
+// Hash -> page index of the data pages, chained per bucket through dedupNext (NULL when off)
+int * dedupBuckets = NULL;
+int * dedupNext = NULL;
+unsigned long long * dedupHashes = NULL;
+
+// Recently read files, for sequential access detection
+struct ReadStream readStreams[READ_STREAMS];
+unsigned long readClock = 0;
+
+// Small appends waiting to be written, flushed before any other command
+struct AppendBuffer appendBuffers[APPEND_BUFFERS];
+unsigned long appendClock = 0;
+
+// Where to dump the instrumentation counters on exit (NULL to skip)
+char * statsFile = NULL;
+
+// Where to record every command with its timing (NULL to skip)
+char * traceFileName = NULL;
+FILE * traceFile = NULL;
+unsigned long long traceEpoch;
+// While tracing, stdout passes through a stream that digests the output of each command
+FILE * traceStdout = NULL;
+// Answers the command being traced read, written after its own line
+char * traceAnswers = NULL;
+size_t traceAnswersLength = 0;
+
 /* Start of helper functions */
-void writeFS(char * filename, int amount, char * data) {
-	printf("Writing: <%s> to <%s> of <%d> bytes\n", data, filename, amount);
+
+/**
+ * Stores amount bytes of data as the contents of filename in the current
+ * directory, creating the file if needed. Returns the page of its entry,
+ * or -1 if no entry could be written.
+ */
+int storeFile(char * filename, int amount, char * data) {
+	// Small files live in the unused tail of their directory entry
+	BOOL small = inlineMode && amount <= MAX_INLINE_DATA_SIZE;
 
 	// First check to see if a file with the specified filename exists
-	struct Metadata * metadata = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	int curr = 0;
-	BOOL found = FALSE;
-	do {
-		metadata = (struct Metadata *)getBlock(next);
+	int previous;
+	int next = findEntry(currentDirBlockStack[currentDirBlock], filename, &previous);
+	int curr = 0, entryBlock = -1;
+	BOOL found = next >= 0;
+	struct Metadata * metadata = found ? getMetadata(next) : NULL;
+
+	// Sparse files are rewritten as a new chain rather than in place, as are files going sparse
+	if(!small && (dedupMode || (found && (metadata->fileAttrib & SPARSE)) || hasHoles(amount, data))) {
+		entryBlock = writeShared(found ? metadata : NULL, found ? next : -1, filename, amount, data);
+		free(found ? metadata : NULL);
+		return entryBlock;
+	}
 
-		// Check to see if the current metadata block has the same filename as the target
-		if(!strncmp(metadata->filename, filename, MAX_FILENAME_SIZE)) {
-			// They match!
-			found = TRUE;
-			break;
+	if(found && small) {
+		// Shrinking into the entry releases any blocks the file had
+		if(!(metadata->fileAttrib & INLINE_DATA)) {
+			freeChain(metadata->blockNumber, FALSE);
 		}
-
-		// Move to the next metadata block
-		next = metadata->nextBlockNumber;
-		curr = metadata->blockNumber;
+		setInlineData(metadata, amount, data);
+		saveBlock(metadata, next);
 		free(metadata);
-	} while(next != -1);
+		return next;
+	}
 
-	// The filename was not found, so we must create a new file
 	if(!found) {
-		/* Create a file */
-		struct Metadata f;
-		strncpy(f.filename, filename, MAX_FILENAME_SIZE);
-		setFile(&f);
+		// The filename was not found, so we must create a new file
+		metadata = (struct Metadata *) malloc(sizeof (struct Metadata));
+		memset(metadata, 0, sizeof (struct Metadata));
+		strncpy(metadata->filename, filename, MAX_FILENAME_SIZE - 1);
+		metadata->nextBlockNumber = -1;
+		if(small) {
+			setInlineData(metadata, amount, data);
+			entryBlock = addEntry(currentDirBlockStack[currentDirBlock], metadata);
+			if(entryBlock < 0) {
+				printf("Not enough space.\n");
+			}
+			free(metadata);
+			return entryBlock;
+		}
+	} else if(metadata->fileAttrib & INLINE_DATA) {
+		// Outgrew the entry, promote it to block storage
+		memset(metadata->inlineData, 0, MAX_INLINE_DATA_SIZE);
+		metadata->fileAttrib &= ~INLINE_DATA;
+		metadata->blockNumber = 0;
+		entryBlock = next;
+	} else {
+		curr = metadata->blockNumber;
+		entryBlock = next;
+	}
 
-		// Save block
-		int blockNumber = createBlock();
-		saveBlock(&f, blockNumber);
-		
-		// Link to block
-		struct Metadata * temp = NULL;
-		int temp2 = currentDirBlockStack[currentDirBlock];
-		do {
-			temp = (struct Metadata *)getBlock(temp2);
-			if(temp->nextBlockNumber == -1) {
+	// Overwrite the chain a whole block at a time, its old contents are never
+	// read. Past its end (or a page shared with a snapshot, whose pages beyond
+	// belong to the snapshot) the blocks come from a new run.
+	struct Block block;
+	int total = amount, offset = 0;
+	int link = curr > 0 ? chainLink(curr) : 0;
+	int written = -1, first = 0, run = -1, needed = 0, added = 0;
+	int hint = 0, shared = 0, fill = 0, pages = 0;
+	while(amount > 0 || written < 0) {
+		int target;
+		if(curr > 0 && allocTable[curr - FIRST_DATA_BLOCK] > 1) {
+			// Replaced by a new page rather than copied, since it is overwritten whole
+			shared = curr;
+			curr = 0;
+			link = 0;
+		}
+
+		if(curr > 0) {
+			target = curr;
+		} else {
+			if(run < 0 && added == 0) {
+				// Take the new blocks as one run when possible, so readers can prefetch it
+				needed = amount > 0 ? BLOCKS_FOR(amount) : 1;
+				run = createBlockRun(needed);
+				hint = run >= 0 ? needed : 0;
+			}
+			target = run >= 0 ? run + added : createBlock();
+			added++;
+			if(target < 0) {
+				printf("Not enough space.\n");
 				break;
 			}
-			temp2 = temp->nextBlockNumber;
-			free(temp);
-		} while(temp != NULL);
+		}
 
-		temp->nextBlockNumber = blockNumber;
-		saveBlock(temp, temp2);
-		free(temp);
+		if(shared > 0) {
+			// Drop our reference, the pages beyond stay with the snapshot
+			invalidateBlock(shared);
+			shared = 0;
+		}
+
+		// Link the previous block now that the page after it is known
+		if(written >= 0) {
+			block.nextBlockNumber = MAKE_NEXT(target, 0, hint < BLOCKS_FOR(amount) ? hint : BLOCKS_FOR(amount));
+			saveBlock(&block, written);
+		} else {
+			first = target;
+		}
+
+		int length = amount < MAX_BLOCK_DATA_SIZE ? amount : MAX_BLOCK_DATA_SIZE;
+		memcpy(block.data, data + offset, length);
+		// Terminate short blocks so cat stops at the end of the data
+		memset(block.data + length, 0, MAX_BLOCK_DATA_SIZE - length);
+		offset += length;
+		amount -= length;
+		written = target;
+		fill = length;
+		pages++;
+
+		if(curr > 0) {
+			// Keep walking the old chain while it lasts
+			hint = RUN_AFTER(link);
+			curr = NEXT_PAGE(link);
+			link = curr > 0 && amount > 0 ? chainLink(curr) : 0;
+		} else {
+			hint = run >= 0 ? needed - added : 0;
+		}
 	}
 
-	// Let's get the first block we can write to
-	struct Block * block = NULL;
-	int nextDataBlock = curr;
+	if(written >= 0) {
+		block.nextBlockNumber = 0;
+		saveBlock(&block, written);
+	}
+	// Whatever is left of the old chain is surplus
+	freeChain(curr, FALSE);
+
+	metadata->blockNumber = first;
+	metadata->fileSize = sizeof(*metadata) + (total - amount);
+	metadata->tail.block = written > 0 ? written : 0;
+	metadata->tail.fill = fill;
+	metadata->tail.pages = pages;
+	setModifyTime(metadata);
+	if(found && first > 0) {
+		saveBlock(metadata, entryBlock);
+	} else if(first > 0) {
+		entryBlock = addEntry(currentDirBlockStack[currentDirBlock], metadata);
+		if(entryBlock < 0) {
+			freeChain(first, FALSE);
+			printf("Not enough space.\n");
+		}
+	}
+	free(metadata);
+	return entryBlock;
+}
+
+/**
+ * Replaces the contents of filename in the current directory, compressing
+ * them in compress mode. Returns the page of its entry or -1.
+ */
+int replaceFile(char * filename, int amount, char * data) {
+	int dirBlock = currentDirBlockStack[currentDirBlock], previous;
+	long oldBytes = 0;
+	int oldPages = 0;
+	int existing = findEntry(dirBlock, filename, &previous);
+	if(existing >= 0) {
+		struct Metadata * old = getMetadata(existing);
+		entryUsage(old, &oldBytes, &oldPages);
+		free(old);
+	}
+	if(!quotaAllows(dirBlock, amount - oldBytes, -1)) {
+		printf("Quota exceeded.\n");
+		return -1;
+	}
+
+	// Files that would take data blocks are compressed when that saves at least a block
+	char * payload = NULL;
+	int stored = amount;
+	if(compressMode && !(inlineMode && amount <= MAX_INLINE_DATA_SIZE)) {
+		payload = (char *) malloc(COMPRESS_BOUND(amount));
+		stored = compressData(data, amount, payload);
+		// A small enough result is kept in the entry like any other small file
+		int blocks = inlineMode && stored <= MAX_INLINE_DATA_SIZE ? 0 : BLOCKS_FOR(stored);
+		if(blocks >= BLOCKS_FOR(amount)) {
+			free(payload);
+			payload = NULL;
+			stored = amount;
+		}
+	}
+
+	int entryBlock = storeFile(filename, stored, payload != NULL ? payload : data);
+	free(payload);
+	if(entryBlock < 0) {
+		return -1;
+	}
+
+	struct Metadata * file = getMetadata(entryBlock);
+	if(existing < 0) {
+		// addEntry counted a new file as storeFile left it
+		entryUsage(file, &oldBytes, &oldPages);
+	}
+	if(payload != NULL) {
+		// ls reports the logical size of a compressed file
+		file->fileAttrib |= COMPRESSED;
+		file->fileSize = sizeof(*file) + amount;
+		saveBlock(file, entryBlock);
+	} else if(file->fileAttrib & COMPRESSED) {
+		file->fileAttrib &= ~COMPRESSED;
+		saveBlock(file, entryBlock);
+	}
+
+	long bytes;
+	int pages;
+	entryUsage(file, &bytes, &pages);
+	accountUsage(dirBlock, bytes - oldBytes, pages - oldPages);
+	free(file);
+	return entryBlock;
+}
+
+void writeFS(char * filename, int amount, char * data) {
+	printf("Writing: <%.*s> to <%s> of <%d> bytes\n", amount, data, filename, amount);
+	replaceFile(filename, amount, data);
+}
+
+/**
+ * Reads the contents of a file into out, which must hold its logical size.
+ * Returns the bytes read.
+ */
+int readFile(struct Metadata * file, char * out) {
+	int size = INLINE_SIZE(file);
+	if((file->fileAttrib & INLINE_DATA) && !(file->fileAttrib & COMPRESSED)) {
+		memcpy(out, file->inlineData, size);
+		return size;
+	}
 
-	// Itterate through every block we have saving data
-	while(amount > 0) {
-		block = (struct Block *)getBlock(nextDataBlock);
+	struct ChainReader reader = {file->blockNumber, 0, NULL, 0, NULL, NULL};
+	if(file->fileAttrib & INLINE_DATA) {
+		reader.inlineData = file->inlineData;
+	}
+	if(!(file->fileAttrib & COMPRESSED)) {
+		int read = chainRead(&reader, out, size);
+		free(reader.block);
+		return read;
+	}
 
-		// Start writing to the file
-		int i, j;
-		for(i = 0, j = strlen(data); i < MAX_BLOCK_DATA_SIZE && i < j && amount; i++) {
-			block->data[i] = data[i];
-			amount--;
+	int offset = 0;
+	while(offset < size) {
+		struct ExtentHeader header;
+		if(chainRead(&reader, (char *)&header, sizeof (header)) < (int)sizeof (header) || header.logicalSize == 0 ||
+				header.logicalSize > size - offset || header.storedSize > EXTENT_DATA_SIZE) {
+			break;
+		}
+		if(header.storedSize == header.logicalSize) {
+			if(chainRead(&reader, out + offset, header.storedSize) < header.storedSize) {
+				break;
+			}
+		} else if(chainRead(&reader, (char *)storedExtent, header.storedSize) < header.storedSize ||
+				lzDecompress(storedExtent, header.storedSize, (unsigned char *)out + offset, header.logicalSize) != header.logicalSize) {
+			break;
 		}
+		offset += header.logicalSize;
+	}
+	free(reader.block);
+	return offset;
+}
 
-		// Save the block
-		saveBlock(block, nextDataBlock);
+/**
+ * Whether data can be added at the recorded tail of a file's chain. The
+ * chain must be plain, and neither its head nor its tail shared: snapshots
+ * share a chain from its head, and deduplicated chains record no tail.
+ */
+BOOL appendable(struct Metadata * file) {
+	int head = file->blockNumber, tail = file->tail.block;
+	if((file->fileAttrib & (INLINE_DATA | COMPRESSED | SPARSE)) || dedupMode) {
+		return FALSE;
+	}
+	if(head < FIRST_DATA_BLOCK || tail < FIRST_DATA_BLOCK || tail >= FIRST_DATA_BLOCK + DATA_BLOCKS ||
+			file->tail.fill < 0 || file->tail.fill > MAX_BLOCK_DATA_SIZE) {
+		return FALSE;
+	}
+	return allocTable[head - FIRST_DATA_BLOCK] == 1 && allocTable[tail - FIRST_DATA_BLOCK] == 1 && chainLink(tail) == 0;
+}
 
-		// Exit the loop if we are out of space
-		if(block->nextBlockNumber <= 0) {
+/**
+ * Adds data at the tail of an appendable file: fills the tail block, then
+ * links new blocks from one run. Saves the entry once, returns the bytes
+ * written.
+ */
+int appendChain(struct Metadata * file, int entryBlock, int amount, char * data) {
+	int tail = file->tail.block, fill = file->tail.fill, offset = 0;
+	struct Block * block = (struct Block *)getBlock(tail);
+
+	int room = MAX_BLOCK_DATA_SIZE - fill < amount ? MAX_BLOCK_DATA_SIZE - fill : amount;
+	memcpy(block->data + fill, data, room);
+	offset = room;
+	fill += room;
+
+	int needed = BLOCKS_FOR(amount - offset), added = 0;
+	int run = needed > 0 ? createBlockRun(needed) : -1;
+	while(offset < amount) {
+		int next = run >= 0 ? run + added : createBlock();
+		if(next < 0) {
+			printf("Not enough space.\n");
 			break;
 		}
+		block->nextBlockNumber = MAKE_NEXT(next, 0, run >= 0 ? needed - added : 0);
+		saveBlock(block, tail);
+		added++;
+
+		memset(block, 0, sizeof (struct Block));
+		fill = amount - offset < MAX_BLOCK_DATA_SIZE ? amount - offset : MAX_BLOCK_DATA_SIZE;
+		memcpy(block->data, data + offset, fill);
+		offset += fill;
+		tail = next;
+	}
+	saveBlock(block, tail);
+	free(block);
 
-		// Move to the next data block
-		nextDataBlock = block->nextBlockNumber;
-		free(block);
+	file->tail.block = tail;
+	file->tail.fill = fill;
+	file->tail.pages += added;
+	file->fileSize += offset;
+	setModifyTime(file);
+	saveBlock(file, entryBlock);
+	// Buffers are flushed before any cd, so the file is in the current directory
+	accountUsage(currentDirBlockStack[currentDirBlock], offset, added);
+	return offset;
+}
+
+/**
+ * Writes out the appends held in a buffer and frees it
+ */
+void appendFlush(struct AppendBuffer * buffer) {
+	if(buffer->entryBlock == 0) {
+		return;
 	}
 
-	// We left the while loop early, so we must add more space
-	if(amount > 0) {
-		// This is nested to allow for the save/free below the while loop
-		while(amount > 0) {
-			// Allocate a new block
-			next = createBlock();
-			
-			// Append its blockNumber to the previous block in the linked list
-			block->nextBlockNumber = next;
-			
-			// Save the previous block
-			saveBlock(block, nextDataBlock);
-			
-			// Free the previous block
-			free(block);
+	struct Metadata * file = getMetadata(buffer->entryBlock);
+	if(buffer->length > 0) {
+		if(appendable(file)) {
+			appendChain(file, buffer->entryBlock, buffer->length, buffer->data);
+		} else {
+			printf("Lost %d buffered bytes appended to %s.\n", buffer->length, file->filename);
+		}
+	}
+	free(file);
+	buffer->entryBlock = 0;
+	buffer->length = 0;
+}
+
+/**
+ * Writes out every buffered append, before a command that could see them
+ */
+void appendFlushAll() {
+	int i;
+	for(i = 0; i < APPEND_BUFFERS; i++) {
+		appendFlush(&appendBuffers[i]);
+	}
+}
+
+/**
+ * Adds amount bytes of data to the end of filename in the current
+ * directory. Appends to a plain file are buffered until they fill its tail
+ * block; anything else is rewritten with the data added.
+ */
+void append(char * filename, int amount, char * data) {
+	int previous;
+	int next = filename[0] != DIRECTORY ? findEntry(currentDirBlockStack[currentDirBlock], filename, &previous) : -1;
+	if(next < 0) {
+		printf("Cannot find file with provided name.\n");
+		return;
+	}
+	struct Metadata * file = getMetadata(next);
 
-			// Get the new block
-			block = (struct Block *)getBlock(next);
+	// Bytes held back count too. Any other command flushes them, so they all
+	// belong to files in the current directory.
+	int held = 0, i;
+	for(i = 0; i < APPEND_BUFFERS; i++) {
+		held += appendBuffers[i].entryBlock != 0 ? appendBuffers[i].length : 0;
+	}
+	if(!quotaAllows(currentDirBlockStack[currentDirBlock], held + amount, -1)) {
+		printf("Quota exceeded.\n");
+		free(file);
+		return;
+	}
 
-			// Write data to the new block
-			int i, j;
-			for(i = 0, j = strlen(data); i < MAX_BLOCK_DATA_SIZE && i < j && amount; i++) {
-				block->data[i] = data[i];
-				amount--;
+	if(appendable(file)) {
+		struct AppendBuffer * buffer = NULL, * oldest = &appendBuffers[0];
+		for(i = 0; i < APPEND_BUFFERS && buffer == NULL; i++) {
+			if(appendBuffers[i].entryBlock == next) {
+				buffer = &appendBuffers[i];
+			} else if(appendBuffers[i].lastUse < oldest->lastUse) {
+				oldest = &appendBuffers[i];
 			}
+		}
 
-			// Save the block number for the just created block
-			nextDataBlock = next;
+		if(buffer == NULL) {
+			for(i = 0; i < APPEND_BUFFERS && appendBuffers[i].entryBlock != 0; i++);
+			buffer = i < APPEND_BUFFERS ? &appendBuffers[i] : oldest;
+			appendFlush(buffer);
+			buffer->entryBlock = next;
 		}
+		buffer->lastUse = ++appendClock;
 
-		// Save the new block
-		saveBlock(block, nextDataBlock);
-		free(block);
+		// Hold the data back while it does not complete the tail block
+		if(buffer->length + amount < MAX_BLOCK_DATA_SIZE - file->tail.fill) {
+			memcpy(buffer->data + buffer->length, data, amount);
+			buffer->length += amount;
+			free(file);
+			return;
+		}
+
+		char * combined = (char *) malloc(buffer->length + amount);
+		memcpy(combined, buffer->data, buffer->length);
+		memcpy(combined + buffer->length, data, amount);
+		appendChain(file, next, buffer->length + amount, combined);
+		free(combined);
+		buffer->length = 0;
+		free(file);
+		return;
 	}
+
+	// Inline, compressed, sparse or shared: read it all and write it back longer
+	int size = INLINE_SIZE(file);
+	char * contents = (char *) malloc(size + amount);
+	size = readFile(file, contents);
+	memcpy(contents + size, data, amount);
+	replaceFile(filename, size + amount, contents);
+	free(contents);
+	free(file);
 }
 
 void dump(FILE * fd, int pageNumber) {
@@ -158,39 +546,27 @@ void dump(FILE * fd, int pageNumber) {
 }
 
 void getpages(char * filename) {
-	// Invalidate all data blocks
+	// A file of that name first, then a directory
 	struct Metadata * metadata = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	BOOL found = FALSE, file = FALSE;
-	do {
-		// Get the next block
-		metadata = (struct Metadata *)getBlock(next);
-
-		if(metadata->filename[0] == DIRECTORY) {
-			if(!strncmp(metadata->filename + 1, filename, MAX_FILENAME_SIZE)) {
-				found = TRUE;
-				break;
-			}
-		} else {
-			if(!strncmp(metadata->filename, filename, MAX_FILENAME_SIZE)) {
-				found = TRUE;
-				file = TRUE;
-				break;
-			}
-		}
-
-		// Move to the next block
-		next = metadata->nextBlockNumber;
-		free(metadata);
-	} while(next != -1);
+	int previous;
+	int next = filename[0] != DIRECTORY ? findEntry(currentDirBlockStack[currentDirBlock], filename, &previous) : -1;
+	BOOL file = next >= 0;
+	if(!file) {
+		next = findSubdirectory(currentDirBlockStack[currentDirBlock], filename, &previous);
+	}
+	BOOL found = next >= 0;
 
 	if(found) {
+		metadata = getMetadata(next);
 		// Print the found file's block number
 		printf("%d", next);
+		BOOL small = (metadata->fileAttrib & INLINE_DATA) != 0;
 		next = metadata->blockNumber;
 		free(metadata);
 
-		if(file) {
+		if(file && small) {
+			// Inline files have no data pages
+		} else if(file) {
 			// The target is a file
 			struct Block * block = NULL;
 			do {
@@ -198,16 +574,19 @@ void getpages(char * filename) {
 				block = (struct Block *)getBlock(next);
 
 				printf(", %d", next);
+				if(HOLES_AFTER(block->nextBlockNumber)) {
+					printf(", (%d hole blocks)", HOLES_AFTER(block->nextBlockNumber));
+				}
 
 				// Move to the next block
-				next = block->nextBlockNumber;
+				next = NEXT_PAGE(block->nextBlockNumber);
 				free(block);
 			} while(next > 0);
 		} else {
 			// The target is a directory
 			do {
 				// Get the next block
-				metadata = (struct Metadata *)getBlock(next);
+				metadata = getMetadata(next);
 
 				printf(", %d", next);
 
@@ -227,24 +606,14 @@ void usage() {
 	printf("File System\t\tSize\tUsed\tAvailable\n");
 
 	int i, used, fsUsed, available;
-	char c;
 
 	// Init variables
 	used = 0;
-	fsUsed = ALLOCATION_BITMAP_PAGES;
+	fsUsed = ALLOCATION_BITMAP_PAGES * PAGE_SIZE;
 	available = 0;
-	
-	// Get files used in root sector
-	for(i = 0; i < ROOT_SECTOR_ENTRIES; i++) {
-		c = rootDir->metadata[i].filename[0];
-		if(c != 0 && c != FILE_DELETED) {
-			++fsUsed;
-		}
-	}
-	fsUsed *= PAGE_SIZE;
 
-	available = (ALLOCATION_BITMAP_PAGES + ROOT_SECTOR_ENTRIES) * PAGE_SIZE;
-	printf("%s\t\t%d\t%d\t%d\n", "Root Sector", available, fsUsed, available - fsUsed);
+	// The allocation table is the only fixed structure, the root is ordinary pages
+	printf("%s\t%d\t%d\t%d\n", "Allocation Table", fsUsed, fsUsed, 0);
 
 	// Get files used in storage
 	for(i = 0; i < ALLOCATION_BITMAP_PAGES * PAGE_SIZE; i++) {
@@ -256,6 +625,16 @@ void usage() {
 
 	available = FILESIZE - fsUsed - used;
 	printf("%s\t\t\t%d\t%d\t%d\n", "Files", FILESIZE - fsUsed, used, available);
+
+	// Snapshots and deduplication let several files refer to the same pages
+	long logical = logicalPages(ROOT_BLOCK, 0) * PAGE_SIZE;
+	printf("Logical %ld bytes stored in %d bytes, %ld bytes saved by sharing\n", logical, used, logical - used);
+
+	printf("Host takes %ld bytes for the image", storageHostBytes());
+	if(discardMode) {
+		printf(", %ld bytes reclaimed by discard", discardReclaimed);
+	}
+	printf("\n");
 }
 
 void pwd() {
@@ -271,9 +650,11 @@ void pwd() {
 	for(i = currentDirBlock; i > 0; i--) {
 		// Itterate through the directory above current to find the handle pointing here
 		next = currentDirBlockStack[i - 1];
+		STAT_INC(STAT_LOOKUPS);
 		do {
 			// And get the next one
-			data = (struct Metadata *)getBlock(next);
+			data = getMetadata(next);
+			STAT_INC(STAT_DIRENTS_SCANNED);
 
 			// If the matching block is found save its name
 			if(data->blockNumber == currentDirBlockStack[i]) {
@@ -294,551 +675,3713 @@ void pwd() {
 }
 
 void cd(char * path) {
-	// Itterate through linked list array to find a matching directory name
-	int block = currentDirBlockStack[currentDirBlock];
-	char * temp = (char*) malloc(MAX_FILENAME_SIZE + 1);
-	struct Metadata * data = NULL;
-	BOOL found = FALSE;
-	do {
-		data = (struct Metadata *)getBlock(block);
-		
-		memset(temp, 0, MAX_FILENAME_SIZE);
-		strncpy(temp, data->filename, MAX_FILENAME_SIZE - 1);
-
-		if (temp[0] == DIRECTORY) {
-			if(!strcmp(temp + 1, path)) {
-
-				/* Modify the current directory stack*/
-				if(*(temp + 1) == '.') {
-					if(*(temp + 2) == '.') {
-						// Go back a directory
-						if(currentDirBlock > 0) {
-							currentDirBlockStack[currentDirBlock--] = -1;
-						}
-					}
-				} else if(currentDirBlock + 1 < MAX_DIRECTORY_DEPTH) {
-					currentDirBlockStack[++currentDirBlock] = data->blockNumber;
-				}
+	// Find the directory entry with a matching name
+	int previous;
+	int block = findSubdirectory(currentDirBlockStack[currentDirBlock], path, &previous);
+	if(block < 0) {
+		printf("No such directory\n");
+		return;
+	}
 
-				block = data->blockNumber;
-				found = TRUE;
+	struct Metadata * data = getMetadata(block);
+
+	/* Modify the current directory stack*/
+	if(path[0] == '.') {
+		if(path[1] == '.') {
+			// Go back a directory
+			if(currentDirBlock > 0) {
+				currentDirBlockStack[currentDirBlock--] = -1;
+			}
+			if(currentDirBlock < readOnlyDepth) {
+				readOnlyDepth = -1;
 			}
 		}
+	} else if(currentDirBlock + 1 < MAX_DIRECTORY_DEPTH) {
+		currentDirBlockStack[++currentDirBlock] = data->blockNumber;
 
-		if(!found) {
-			block = data->nextBlockNumber;
+		// Everything below a snapshot is read-only
+		if((data->fileAttrib & SNAPSHOT) && readOnlyDepth < 0) {
+			readOnlyDepth = currentDirBlock;
 		}
+	}
 
-		free(data);
-	} while(block != -1 && !found);	
-	free(temp);
+	free(data);
+}
 
-	if(!found) {
-		printf("No such directory\n");
-	}
+/**
+ * Starts a listing of the directory whose '.' entry is at dirBlock
+ */
+void openDir(struct DirCursor * cursor, int dirBlock) {
+	cursor->dirBlock = dirBlock;
+	cursor->position = dirBlock;
 }
 
-void ls() {
-	// Get the root for the current directory
-	int next = currentDirBlockStack[currentDirBlock];
+/**
+ * Resumes a listing at a position an earlier cursor reported, returns FALSE
+ * if the entry there is gone
+ */
+BOOL seekDir(struct DirCursor * cursor, int dirBlock, int position) {
+	openDir(cursor, dirBlock);
+	if(position == -1) {
+		cursor->position = -1;
+		return TRUE;
+	}
+	if(position < FIRST_DATA_BLOCK || position >= FIRST_DATA_BLOCK + DATA_BLOCKS || !allocTable[position - FIRST_DATA_BLOCK]) {
+		return FALSE;
+	}
 
-	struct Metadata * data = NULL;
-	do {
-		data = (struct Metadata *)getBlock(next);
-		if(data->filename[0] != FILE_DELETED) {
-			// Print if its a directory or not
-			if(data->filename[0] == DIRECTORY) {
-				printf("d %d %s\n", data->fileSize, data->filename + 1);
-			} else {
-				printf("f %d %s\n", data->fileSize - PAGE_SIZE, data->filename);
-			}
+	struct Metadata * entry = getMetadata(position);
+	BOOL live = entry->filename[0] != FILE_DELETED && (entry->nextBlockNumber == -1 ||
+		(entry->nextBlockNumber >= FIRST_DATA_BLOCK && entry->nextBlockNumber < FIRST_DATA_BLOCK + DATA_BLOCKS));
+	free(entry);
+	if(live) {
+		cursor->position = position;
+	}
+	return live;
+}
+
+/**
+ * Next entry of a listing, returns NULL at the end. The caller frees it.
+ */
+struct Metadata * readDir(struct DirCursor * cursor) {
+	while(cursor->position != -1) {
+		struct Metadata * entry = getMetadata(cursor->position);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		cursor->position = entry->nextBlockNumber;
+		if(entry->filename[0] != FILE_DELETED) {
+			return entry;
 		}
+		free(entry);
+	}
+	return NULL;
+}
 
-		next = data->nextBlockNumber;
-		free(data);
-	} while(next != -1);
+/**
+ * The fields of an entry that ls prints and sorts by
+ */
+static void listEntry(struct ListEntry * item, struct Metadata * entry) {
+	if(entry->fileAttrib & SNAPSHOT) {
+		item->type = 's';
+	} else if(entry->filename[0] == DIRECTORY) {
+		item->type = 'd';
+	} else {
+		item->type = 'f';
+	}
+	// Files leave out their entry page, directories report the data below them
+	if(item->type == 'f') {
+		item->size = entry->fileSize - PAGE_SIZE;
+	} else {
+		struct Metadata * dot = getMetadata(entry->blockNumber);
+		item->size = dot->dir.bytes;
+		free(dot);
+	}
+	item->stamp = (unsigned long)entry->lastDateUpdate << 32 | entry->lastTimeUpdate;
+	strcpy(item->name, item->type == 'f' ? entry->filename : entry->filename + 1);
 }
 
-void mkdir(char * dirname) {
-	// Check to see if the current directory name already exists here
-	struct Metadata * temp = NULL;
-	struct Metadata * previous = NULL;
-	int prevBlockNumber = -1;
-	int next = currentDirBlockStack[currentDirBlock];
-	do {
-		temp = (struct Metadata *)getBlock(next);
+static int compareByName(const void * a, const void * b) {
+	const struct ListEntry * x = a, * y = b;
+	// A file and a directory may share a name
+	int order = strcmp(x->name, y->name);
+	return order ? order : x->type - y->type;
+}
 
-		if(!strcmp(temp->filename + 1, dirname)) {
-			printf("Directory already exists.\n");
-			free(temp);
-			return;
-		}
+static int compareBySize(const void * a, const void * b) {
+	const struct ListEntry * x = a, * y = b;
+	// Largest first
+	if(x->size != y->size) {
+		return x->size < y->size ? 1 : -1;
+	}
+	return compareByName(a, b);
+}
 
-		next = temp->nextBlockNumber;
-		if(previous != NULL) {
-			prevBlockNumber = previous->nextBlockNumber;
-		}
-		free(previous);
-		previous = temp;
-	} while(next != -1);
+static int compareByTime(const void * a, const void * b) {
+	const struct ListEntry * x = a, * y = b;
+	// Newest first
+	if(x->stamp != y->stamp) {
+		return x->stamp < y->stamp ? 1 : -1;
+	}
+	return compareByName(a, b);
+}
 
-	// Create directory
-	struct Metadata * dir = (struct Metadata *)malloc(PAGE_SIZE + 1);
-	memset(dir, 0, PAGE_SIZE);
-	strncpy(dir->filename, dirname, MAX_FILENAME_SIZE - 1);
-	setDirectory(dir);
-	
-	// Get the current directory '.' file
-	dir->blockNumber = currentDirBlockStack[currentDirBlock];
+// Order of the sorted listing in progress, with -r applied
+static int (*listOrder)(const void *, const void *);
+static BOOL listReverse;
 
-	/* Create internal directory structure and write to disk */
-	createDirectoryStruct(dir);
-	
-	if(currentDirBlock) {
-		/* Must save outside of the root block */
-		int blockSpace = createBlock();
-
-		if(blockSpace >= 0) {
-			dir->nextBlockNumber = previous->nextBlockNumber;
-			saveBlock(dir, blockSpace);
-			
-			/* Correct linked list */
-			previous->nextBlockNumber = blockSpace;
-			saveBlock(previous, prevBlockNumber);
-		} else {
-			printf("Could not create new directory. Not enough space.\n");
+static int compareListed(const void * a, const void * b) {
+	int order = listOrder(a, b);
+	return listReverse ? -order : order;
+}
+
+/**
+ * Keeps the count entries that come first in the listing in a heap whose
+ * root is the last of them. Returns the new number of entries kept.
+ */
+static int listKeep(struct ListEntry * kept, int used, int count, struct ListEntry * item) {
+	int i, child;
+	if(used < count) {
+		// Sift the new entry up from the bottom
+		for(i = used; i > 0 && compareListed(&kept[(i - 1) / 2], item) < 0; i = (i - 1) / 2) {
+			kept[i] = kept[(i - 1) / 2];
 		}
-	} else {
-		/* Add directory to root directory listing */
-		saveMetadataToRootBlock(*dir);
+		kept[i] = *item;
+		return used + 1;
+	}
+	if(compareListed(item, &kept[0]) >= 0) {
+		return used;
 	}
-	free(dir);
-	free(previous);
-}
 
-void cat(char * filename) {
-	// Do not let the user cat a directory
-	if(filename[0] == DIRECTORY) {
-		printf("Cannot cat a directory.\n");
-		return;
+	// Replace the root and sift it down
+	for(i = 0; (child = 2 * i + 1) < used; i = child) {
+		if(child + 1 < used && compareListed(&kept[child + 1], &kept[child]) > 0) {
+			child++;
+		}
+		if(compareListed(&kept[child], item) <= 0) {
+			break;
+		}
+		kept[i] = kept[child];
 	}
+	kept[i] = *item;
+	return used;
+}
 
-	struct Metadata * file = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	BOOL found = FALSE;
-	do {
-		file = (struct Metadata *)getBlock(next);
+/**
+ * Appends one line of ls output, writing the buffer out when it fills up
+ */
+static void listLine(char * out, int * used, struct ListEntry * item) {
+	if(*used > LS_BUFFER_SIZE - MAX_FILENAME_SIZE - 32) {
+		fwrite(out, 1, *used, stdout);
+		*used = 0;
+	}
+	*used += sprintf(out + *used, "%c %12u %s\n", item->type, item->size, item->name);
+}
 
-		if(!strcmp(file->filename, filename)) {
-			found = TRUE;
-			break;
+/**
+ * Lists the current directory. sortKey orders it (LS_UNSORTED keeps chain
+ * order) and count > 0 stops after that many entries. An unsorted listing
+ * resumes at the cursor position, a sorted one after the entry described
+ * by after, "TYPE:KEY:NAME" with KEY its size or time. A sorted page reads
+ * the directory once and sorts only the entries it shows.
+ */
+void ls(int sortKey, BOOL reverse, int count, int position, char * after) {
+	int dirBlock = currentDirBlockStack[currentDirBlock];
+	char * out = (char *)malloc(LS_BUFFER_SIZE);
+	int used = 0, shown = 0;
+	struct ListEntry item;
+	struct Metadata * entry = NULL;
+	struct DirCursor cursor;
+
+	if(sortKey == LS_UNSORTED) {
+		if(position > 0 && !seekDir(&cursor, dirBlock, position)) {
+			printf("The listing changed, start it again.\n");
+			free(out);
+			return;
+		} else if(position <= 0) {
+			openDir(&cursor, dirBlock);
 		}
 
-		next = file->nextBlockNumber;
-		free(file);
-	} while(next != -1);
+		while((count <= 0 || shown < count) && (entry = readDir(&cursor)) != NULL) {
+			listEntry(&item, entry);
+			listLine(out, &used, &item);
+			shown++;
+			free(entry);
+		}
+		fwrite(out, 1, used, stdout);
+		if(cursor.position != -1) {
+			printf("More: ls -n %d -c %d\n", count, cursor.position);
+		}
+		free(out);
+		return;
+	}
 
-	if(found) {
-		// Get the file contents' first block number
-		int blockNumber = file->blockNumber;
-		free(file);
+	// Only entries after the last one shown take part, resumed by sort key
+	struct ListEntry last;
+	BOOL resume = FALSE;
+	char * name = after != NULL ? strchr(after, ':') : NULL;
+	if(name != NULL && (name = strchr(name + 1, ':')) != NULL) {
+		memset(&last, 0, sizeof (last));
+		last.type = after[0];
+		last.size = last.stamp = strtoul(after + 2, NULL, 10);
+		strncpy(last.name, name + 1, MAX_FILENAME_SIZE - 1);
+		resume = TRUE;
+	} else if(after != NULL) {
+		printf("Cannot resume from %s.\n", after);
+		free(out);
+		return;
+	}
 
-		// Itterate and output each block until no more to be printed
-		struct Block * block = NULL;
-		do {
-			block = (struct Block *)getBlock(blockNumber);
+	listOrder = sortKey == LS_BY_SIZE ? compareBySize : sortKey == LS_BY_TIME ? compareByTime : compareByName;
+	listReverse = reverse;
 
-			printf("%s", block->data);
+	// With a count only that many entries are kept, otherwise all of them
+	int capacity = count > 0 ? count : 64, kept = 0, remaining = 0;
+	struct ListEntry * items = (struct ListEntry *)malloc(sizeof (struct ListEntry) * capacity);
 
-			blockNumber = block->nextBlockNumber;
-			free(block);
-		} while(blockNumber != 0);
-	}
-}
-
-/*
-Had to rename due to conflicting function defintions
-*/
-void rmdir2(char * dirName) {
-	// Do not allow the user to remove the '.' and '..' files
-	if(!strcmp(".", dirName) || !strcmp("..", dirName)) {
-		printf("No directory found with the given name\n");
-		return;
-	}
-
-	struct Metadata * dir = NULL;
-	struct Metadata * previous = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	int previousBlockNumber = -1;
-	BOOL found = FALSE;
-	do {
-		dir = (struct Metadata *)getBlock(next);
-		if(dir->filename[0] == DIRECTORY && !strcmp(dir->filename + 1, dirName)) {
-			found = TRUE;
-			break;
+	openDir(&cursor, dirBlock);
+	while((entry = readDir(&cursor)) != NULL) {
+		listEntry(&item, entry);
+		free(entry);
+		if(resume && compareListed(&item, &last) <= 0) {
+			continue;
 		}
-
-		next = dir->nextBlockNumber;
-		if(previous != NULL) {
-			previousBlockNumber = previous->nextBlockNumber;
+		remaining++;
+		if(count > 0) {
+			kept = listKeep(items, kept, count, &item);
+		} else {
+			if(kept == capacity) {
+				capacity *= 2;
+				items = (struct ListEntry *)realloc(items, sizeof (struct ListEntry) * capacity);
+			}
+			items[kept++] = item;
 		}
-		free(previous);
-
-		previous = dir;
-	} while(next != -1);
+	}
 
-	if(found) {
-		// Check to see if the directory is empty
-		struct Metadata * temp = NULL;
-		int temp2 = dir->blockNumber;
-		int counter = 0;
-		do {
-			temp = (struct Metadata *)getBlock(temp2);
-			temp2 = temp->nextBlockNumber;
-			free(temp);
-			counter++;
-		} while(temp2 != -1 && counter < 3); // Short circuit if loop counter finds too many files
-											 //    (Anything besides '.' and '..')
-		
-		if(counter <= 2) {
-			// Set the file to be deleted
-			dir->filename[0] = FILE_DELETED;
+	qsort(items, kept, sizeof (struct ListEntry), compareListed);
 
-			// Invalidate the '.' and '..' blocks
-			temp = (struct Metadata *)getBlock(dir->blockNumber);
-			temp2 = temp->nextBlockNumber;
-			
-			invalidateBlock(dir->blockNumber);
-			invalidateBlock(temp2);
-			free(temp);
+	int i;
+	for(i = 0; i < kept; i++) {
+		listLine(out, &used, &items[i]);
+	}
+	fwrite(out, 1, used, stdout);
+	if(remaining > kept) {
+		last = items[kept - 1];
+		printf("More: ls %s%s-n %d -a %c:%lu:%s\n", sortKey == LS_BY_SIZE ? "-S " : sortKey == LS_BY_TIME ? "-t " : "-N ",
+			reverse ? "-r " : "", count, last.type, sortKey == LS_BY_SIZE ? (unsigned long)last.size :
+			sortKey == LS_BY_TIME ? last.stamp : 0UL, last.name);
+	}
+	free(items);
+	free(out);
+}
 
-			// For removing a file not in the root sector
-			if(previous->nextBlockNumber >= ALLOCATION_BITMAP_PAGES + ROOT_SECTOR_ENTRIES) {
-				saveBlock(dir, previous->nextBlockNumber);
-				invalidateBlock(previous->nextBlockNumber);
+void mkdir(char * dirname) {
+	// Check to see if the current directory name already exists here
+	int previous;
+	if(findSubdirectory(currentDirBlockStack[currentDirBlock], dirname, &previous) >= 0) {
+		printf("Directory already exists.\n");
+		return;
+	}
 
-				// Remove the deleted block from the linked list
-				previous->nextBlockNumber = dir->nextBlockNumber;
-				saveBlock(previous, previousBlockNumber);
-			} else {
-				// If the file we are deleting belongs to the root sector,
-				//  we must handle it slightly differently
-				int blockNumber = previous->nextBlockNumber - ALLOCATION_BITMAP_PAGES;
+	if(createDirectory(currentDirBlockStack[currentDirBlock], dirname) < 0) {
+		printf("Could not create new directory. Not enough space.\n");
+	}
+}
 
-				/* Correct linked list */
-				previous->nextBlockNumber = dir->nextBlockNumber;
-				rootDir->metadata[blockNumber] = *dir;
-				rootDir->metadata[blockNumber - 1] = *previous;
+/**
+ * Creates a directory named dirname in the directory whose '.' entry is at
+ * dirBlock, without checking for an existing one. Returns the new
+ * directory's '.' page or -1 when the image is full.
+ */
+int createDirectory(int dirBlock, char * dirname) {
+	struct Metadata * dir = (struct Metadata *)malloc(PAGE_SIZE + 1);
+	memset(dir, 0, PAGE_SIZE);
+	strncpy(dir->filename, dirname, MAX_FILENAME_SIZE - 1);
+	setDirectory(dir);
 
-				syncFilesystem();
-			}
-		} else {
-			printf("Directory not empty.\n");
-		}
+	// Get the parent directory '.' file
+	dir->blockNumber = dirBlock;
 
-		free(dir);
-	} else {
-		printf("Cannot find directory with provided name.\n");
+	/* Create internal directory structure and link it into the parent directory */
+	int dotBlock = createDirectoryStruct(dir);
+	if(dotBlock >= 0 && addEntry(dirBlock, dir) < 0) {
+		freeChain(dir->blockNumber, TRUE);
+		dotBlock = -1;
 	}
-
-	free(previous);
+	free(dir);
+	return dotBlock;
 }
 
-void rm(char * filename) {
-	struct Metadata * file = NULL;
-	struct Metadata * previous = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	int previousBlockNumber = -1;
-	BOOL found = FALSE;
-	do {
-		file = (struct Metadata *)getBlock(next);
-
-		if(file->filename[0] != DIRECTORY && !strcmp(file->filename, filename)) {
-			found = TRUE;
-			break;
-		}
-
-		next = file->nextBlockNumber;
-		if(previous != NULL) {
-			previousBlockNumber = previous->nextBlockNumber;
-		}
-		free(previous);
+void cat(char * filename) {
+	// Do not let the user cat a directory
+	if(filename[0] == DIRECTORY) {
+		printf("Cannot cat a directory.\n");
+		return;
+	}
 
-		previous = file;
-	} while(next != -1);
+	int previous;
+	int next = findEntry(currentDirBlockStack[currentDirBlock], filename, &previous);
+	BOOL found = next >= 0;
+	struct Metadata * file = found ? getMetadata(next) : NULL;
 
 	if(found) {
-		// Invalidate all data blocks
-		struct Block * temp = NULL;
-		int nextDataBlock = file->blockNumber;
-		do {
-			// Get the next block
-			temp = (struct Block *)getBlock(nextDataBlock);
-
-			// Invalidate the data block
-			invalidateBlock(nextDataBlock);
-
-			// Move to the next block
-			nextDataBlock = temp->nextBlockNumber;
-			free(temp);
-		} while(nextDataBlock > 0);
-
-		// Delete file handle
-		if(previous->nextBlockNumber >= ALLOCATION_BITMAP_PAGES + ROOT_SECTOR_ENTRIES) {
-			saveBlock(file, previous->nextBlockNumber);
-			invalidateBlock(previous->nextBlockNumber);
-
-			// Remove the deleted block from the linked list
-			previous->nextBlockNumber = file->nextBlockNumber;
-			saveBlock(previous, previousBlockNumber);
-		} else {
-			// Must delete it differently because this file is in the root block
-			int blockNumber = previous->nextBlockNumber - ALLOCATION_BITMAP_PAGES;
+		struct ReadStream * stream = readStream(next, 0);
+		stream->nextOffset = -1;
 
-			/* Correct linked list */
-			previous->nextBlockNumber = file->nextBlockNumber;
-			memcpy(&(rootDir->metadata[blockNumber]), file, sizeof(struct Metadata));
-			memcpy(&(rootDir->metadata[blockNumber - 1]), previous, sizeof(struct Metadata));
+		if(file->fileAttrib & COMPRESSED) {
+			readCompressed(file, stream, 0, INLINE_SIZE(file), TRUE);
+			free(file);
+			return;
 		}
-		free(file);
-	} else {
-		printf("Cannot find file with provided name.\n");
-	}
-
-	free(previous);
-}
-
-void rmForce(char * filename) {
-	// We have no idea if we are deleting a file or a directory
-	struct Metadata * file = NULL;
-	struct Metadata * previous = NULL;
-	int next = currentDirBlockStack[currentDirBlock];
-	BOOL found = FALSE;
-	do {
-		file = (struct Metadata *)getBlock(next);
 
-		if(file->filename[0] == DIRECTORY) {
-			// If the target is a directory, we must do other stuff to remove it
-			if(!strcmp(file->filename + 1, filename)) {
-				found = TRUE;
-				break;
-			}
-		} else if(!strcmp(file->filename, filename)) {
-			// If the target is a file, just delete it and be done
-			rm(filename);
+		if(file->fileAttrib & INLINE_DATA) {
+			printf("%.*s", INLINE_SIZE(file), file->inlineData);
 			free(file);
-			free(previous);
 			return;
 		}
 
-		next = file->nextBlockNumber;
-		free(previous);
+		// Get the file contents' first block number
+		int blockNumber = file->blockNumber;
+		free(file);
 
-		previous = file;
-	} while(next != -1);
+		// Itterate and output each block until no more to be printed
+		struct Block * block = NULL;
+		do {
+			block = (struct Block *)getBlock(blockNumber);
 
-	if(found) {
-		// To remove a directory, remove every file and directory inside of it nested
-		clearDirectory(previous);
-	}
+			printf("%.*s", MAX_BLOCK_DATA_SIZE, block->data);
+			readahead(stream, block->nextBlockNumber);
 
-	free(previous);
+			// Holes are zeros, which print nothing
+			blockNumber = NEXT_PAGE(block->nextBlockNumber);
+			free(block);
+		} while(blockNumber != 0);
+	}
 }
 
-void clearDirectory(struct Metadata * metadata) {
-	// Itterate through every block inside the directory
-	struct Metadata * meta = NULL;
-	int next = metadata->blockNumber;
-	do {
-		meta = (struct Metadata *)getBlock(next);
-		
-		if(meta->filename[0] == DIRECTORY) {
-			// Used to prevent including the '.' and '..' directories
-			if(!(meta->fileAttrib & SUBDIRECTORY)) {
-				//printf("Directory: %s\n", meta->filename);
-
-				// In order to correctly do this, we must add to the currentDirBlockStack
-				if(currentDirBlock + 1 < MAX_DIRECTORY_DEPTH) {
-					currentDirBlockStack[++currentDirBlock] = meta->blockNumber;
-
-					// Remove that directory recursively
-					struct Metadata * temp = (struct Metadata *)getBlock(meta->blockNumber);
-					clearDirectory(temp);
-					free(temp);
-
-					// Pop the top off of the currentDirBlockStack now that we returned
-					currentDirBlockStack[currentDirBlock--] = -1;
-				} else {
-					printf("Max depth achieved.\n");
-				}
+void get(char * filename, int start, int end) {
+	// Do not let the user read a directory
+	if(filename[0] == DIRECTORY) {
+		printf("Cannot get a directory.\n");
+		return;
+	}
 
-				// Delete the directory
-				rmdir2(meta->filename + 1);
-			}
-		} else {
-			//printf("File: %s\n", meta->filename);
-			rm(meta->filename);
-		}
+	int previous;
+	int next = findEntry(currentDirBlockStack[currentDirBlock], filename, &previous);
+	if(next < 0) {
+		printf("Cannot find file with provided name.\n");
+		return;
+	}
+	struct Metadata * file = getMetadata(next);
 
-		next = meta->nextBlockNumber;
-		free(meta);
-	} while(next != -1);
-}
+	// Never read past the end of the file, whatever it is stored as
+	if(end > INLINE_SIZE(file)) {
+		end = INLINE_SIZE(file);
+	}
+	if(start > end) {
+		start = end;
+	}
 
-void scandisk() {
-	unsigned char * allocTable2 = (unsigned char *) malloc(ALLOCATION_BITMAP_PAGES * PAGE_SIZE + 1);
-	memcpy(allocTable2, allocTable, ALLOCATION_BITMAP_PAGES * PAGE_SIZE);
+	struct ReadStream * stream = readStream(next, start);
+	stream->nextOffset = end;
 
-	struct Metadata * metadata = NULL;
-	int i, j;
-	for(i = ALLOCATION_BITMAP_PAGES, j = FILESIZE / PAGE_SIZE - ALLOCATION_BITMAP_PAGES; i < j; i++) {
-		metadata = (struct Metadata *)getBlock(i);
+	if(file->fileAttrib & COMPRESSED) {
+		readCompressed(file, stream, start, end, FALSE);
+		printf("\n");
+		free(file);
+		return;
+	}
 
-		if(metadata->fileAttrib == FILE_ATTRIB || metadata->fileAttrib == DIRECTORY_ATTRIB) {
-			// We have metadata
-			int k = metadata->nextBlockNumber;
-			int l = metadata->blockNumber;
-			
-			if(k >= 0) {
-				allocTable2[i]++;
-			}
-			if(l >= 0) {
-				allocTable2[i]++;
-			}
+	if(file->fileAttrib & INLINE_DATA) {
+		if(start < end) {
+			fwrite(file->inlineData + start, 1, end - start, stdout);
 		}
-
-		free(metadata);
+		printf("\n");
+		free(file);
+		return;
 	}
 
-	for(i = ALLOCATION_BITMAP_PAGES; i < j; i++) {
-		if(allocTable2[i] <= 1) {
-			invalidateBlock(i);
+	// Get the file contents' first block number
+	int blockNumber = file->blockNumber;
+	int offset = 0;
+	free(file);
+
+	// Skip the blocks that lie entirely before the range and print the rest
+	struct Block * block = NULL;
+	while(blockNumber > 0 && offset < end) {
+		block = (struct Block *)getBlock(blockNumber);
+		if(offset + MAX_BLOCK_DATA_SIZE > start) {
+			int from = start > offset ? start - offset : 0;
+			int to = end - offset < MAX_BLOCK_DATA_SIZE ? end - offset : MAX_BLOCK_DATA_SIZE;
+			fwrite(block->data + from, 1, to - from, stdout);
+		}
+		offset += MAX_BLOCK_DATA_SIZE;
+		if(offset < end) {
+			readahead(stream, block->nextBlockNumber);
 		}
-	}
-}
-/* End of helper functions */
 
-/* Start of Debugging code*/
-#ifdef DEBUG_MODE
-// Print metadata information
-void printMetadata(struct Metadata meta) {
-	printf("Filename:\t%s\n", meta.filename);
-	printf("Block Number:\t%d\n", meta.blockNumber);
-	printf("Next Block:\t%d\n", meta.nextBlockNumber);
-	printf("Time:\t\t%d\n", meta.lastTimeUpdate);
-	printf("Date:\t\t%d\n", meta.lastDateUpdate);
-	printf("File Attrib:\t%d\n", meta.fileAttrib);
-	printf("File Size:\t%d\n", meta.fileSize);
-	
-	printf("Hour: %d\n", GET_HOUR(meta.lastTimeUpdate));
-	printf("Minute: %d\n", GET_MINUTE(meta.lastTimeUpdate));
-	printf("Second: %d\n", GET_SECOND(meta.lastTimeUpdate));
-	printf("Year: %d\n", GET_YEAR(meta.lastDateUpdate));
-	printf("Month: %d\n", GET_MONTH(meta.lastDateUpdate));
-	printf("Day: %d\n", GET_DAY(meta.lastDateUpdate));
-	printf("\n------\n");
-}
+		// Holes read back as zeros
+		int holeEnd = offset + HOLES_AFTER(block->nextBlockNumber) * MAX_BLOCK_DATA_SIZE;
+		int from = start > offset ? start : offset;
+		int to = end < holeEnd ? end : holeEnd;
+		for(; from < to; from++) {
+			putchar(0);
+		}
+		offset = holeEnd;
 
-// Print all files in a directory
-void treePrint(struct Metadata metadata) {
-	printMetadata(metadata);
-	struct Metadata * temp = (struct Metadata *)getBlock(metadata.nextBlockNumber);
-	if(temp != NULL) {
-		treePrint(*temp);
+		blockNumber = NEXT_PAGE(block->nextBlockNumber);
+		free(block);
 	}
-	free(temp);
+	printf("\n");
+}
 
+/**
+ * Empties the name index, every directory is indexed again on its next lookup
+ */
+void nameIndexReset() {
+	memset(nameBuckets, -1, sizeof (nameBuckets));
+	memset(nameDirs, NAME_UNINDEXED, sizeof (nameDirs));
+	memset(nameIndexed, 0, sizeof (nameIndexed));
 }
-#endif
-/* End of Debugging code */
 
-int saveMetadataToRootBlock(struct Metadata metadata) {
+/**
+ * FNV-1a of an entry's filename, mixed with its directory
+ */
+static unsigned int nameHash(int dirBlock, char * filename) {
+	unsigned int hash = 2166136261u;
 	int i;
-	BOOL found = FALSE, ret = FALSE;
-	for(i = 0; i < ROOT_SECTOR_ENTRIES; i++) {
-		struct Metadata meta = rootDir->metadata[i];
-
-		if (meta.filename[0] == 0 || meta.filename[0] == FILE_DELETED) {
-			found = TRUE;
-			break;
-		}
+	for(i = 0; i < MAX_FILENAME_SIZE && filename[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char)filename[i]) * 16777619u;
 	}
-	
-	if(found) {
-		// Found an open space
-		metadata.nextBlockNumber = (rootDir->metadata[i - 1]).nextBlockNumber;
-		rootDir->metadata[i] = metadata;
-		/* Correct linked list */
-		(rootDir->metadata[i - 1]).nextBlockNumber = ALLOCATION_BITMAP_PAGES + i;
+	return hash ^ (unsigned int)dirBlock * 2654435761u;
+}
 
-		ret = TRUE;
-	}
-#ifdef DEBUG_MODE
-	else {
-		printf("ERROR: saveMetadataToRootBlock block not found.\n");
-	}
-#endif
-	return ret;
+/**
+ * Adds an entry page of a directory to the name index
+ */
+static void nameInsert(int dirBlock, int blockNumber, int previous, struct Metadata * entry) {
+	int index = blockNumber - FIRST_DATA_BLOCK;
+	int bucket;
+	nameHashes[index] = nameHash(dirBlock, entry->filename);
+	nameDirs[index] = dirBlock;
+	nameLinks[index] = entry->nextBlockNumber;
+	namePrevious[index] = previous;
+	bucket = nameHashes[index] & (NAME_BUCKETS - 1);
+	nameNext[index] = nameBuckets[bucket];
+	nameBuckets[bucket] = index;
 }
 
 /**
- * Get a pointer to block, can be cast to either metadata or block structures
+ * Drops one page from the name index
  */
-void * getBlock(int blockNumber) {
-	if (blockNumber <= 0) {
-		return NULL;
+static void nameForget(int index) {
+	int * link = &nameBuckets[nameHashes[index] & (NAME_BUCKETS - 1)];
+	while(*link != -1 && *link != index) {
+		link = &nameNext[*link];
 	}
-
-	char * block = (char *) malloc(PAGE_SIZE);
-	memcpy(block, map + blockNumber * PAGE_SIZE, PAGE_SIZE);
-	return (void*)block;
+	if(*link == index) {
+		*link = nameNext[index];
+	}
+	nameDirs[index] = NAME_UNINDEXED;
 }
 
 /**
- * Get the next valid block number
+ * Drops every page of a directory from the name index
  */
-int createBlock() {
+void nameIndexDrop(int dirBlock) {
 	int i;
-	for(i = 0; i < ALLOCATION_BITMAP_PAGES * PAGE_SIZE; i++) {
-		if (!allocTable[i]) {
-			allocTable[i] = 1;
-			return i + ALLOCATION_BITMAP_PAGES + ROOT_SECTOR_ENTRIES;
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(nameDirs[i] == dirBlock) {
+			nameForget(i);
 		}
 	}
-	return -1;
+	if(dirBlock >= FIRST_DATA_BLOCK && dirBlock < FIRST_DATA_BLOCK + DATA_BLOCKS) {
+		nameIndexed[dirBlock - FIRST_DATA_BLOCK] = FALSE;
+	}
 }
 
 /**
- * Saves a block back to the file system
+ * Indexes a directory unless it already is, reading its entries in place.
+ * Returns FALSE if its chain is damaged, scandisk repairs it.
  */
-void saveBlock(void * b, int blockNumber) {
-	if(blockNumber > 0) {
-		memcpy(map + blockNumber * PAGE_SIZE, b, PAGE_SIZE);
+BOOL nameIndexDirectory(int dirBlock) {
+	if(dirBlock < FIRST_DATA_BLOCK || dirBlock >= FIRST_DATA_BLOCK + DATA_BLOCKS) {
+		return FALSE;
+	}
+	if(nameIndexed[dirBlock - FIRST_DATA_BLOCK]) {
+		return TRUE;
+	}
+
+	int next = dirBlock, previous = -1;
+	while(next != -1) {
+		int index = next - FIRST_DATA_BLOCK;
+		if(index < 0 || index >= DATA_BLOCKS || nameDirs[index] == dirBlock) {
+			// Out of the image or looping
+			nameIndexDrop(dirBlock);
+			return FALSE;
+		}
+		if(nameDirs[index] != NAME_UNINDEXED) {
+			// A page a snapshot still shares with another directory, one index at a time
+			nameIndexDrop(nameDirs[index]);
+		}
+
+		STAT_INC(STAT_PAGES_READ);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		struct Metadata * entry = (struct Metadata *)storagePin(next, TRUE);
+		nameInsert(dirBlock, next, previous, entry);
+		previous = next;
+		next = entry->nextBlockNumber;
+		storageUnpin(previous, FALSE);
 	}
+	nameIndexed[dirBlock - FIRST_DATA_BLOCK] = TRUE;
+	return TRUE;
 }
 
 /**
- * Invalidates a block to allow it to be overwritten
+ * Called for every page written, and with NULL for every page freed. A
+ * directory whose entries change name or links is indexed again on its
+ * next lookup, unless addEntries or removeEntry already updated it.
  */
-BOOL invalidateBlock(int blockNumber) {
-	blockNumber -= (ALLOCATION_BITMAP_PAGES + ROOT_SECTOR_ENTRIES);
-	if (blockNumber >= 0 && blockNumber < ALLOCATION_BITMAP_PAGES * PAGE_SIZE) {
-		allocTable[blockNumber] = 0;
-		return TRUE;
+void nameIndexWrite(int blockNumber, struct Metadata * entry) {
+	int index = blockNumber - FIRST_DATA_BLOCK;
+	if(index < 0 || index >= DATA_BLOCKS || nameDirs[index] == NAME_UNINDEXED) {
+		return;
+	}
+	int dirBlock = nameDirs[index];
+	if(entry == NULL || entry->nextBlockNumber != nameLinks[index] || nameHash(dirBlock, entry->filename) != nameHashes[index]) {
+		nameIndexDrop(dirBlock);
 	}
-	return FALSE;
 }
 
 /**
- * Write all changes to the file system to disk
+ * Records entries addEntries is about to link after tail
+ */
+void nameIndexAppend(int dirBlock, int tail, int * blocks, struct Metadata * entries, int count) {
+	if(!nameIndexed[dirBlock - FIRST_DATA_BLOCK]) {
+		return;
+	}
+	int i;
+	nameLinks[tail - FIRST_DATA_BLOCK] = blocks[0];
+	for(i = 0; i < count; i++) {
+		nameInsert(dirBlock, blocks[i], i > 0 ? blocks[i - 1] : tail, &entries[i]);
+	}
+}
+
+/**
+ * Records that removeEntry is about to unlink an entry, following is the
+ * entry after it
+ */
+void nameIndexUnlink(int previousBlock, int entryBlock, int following) {
+	int index = entryBlock - FIRST_DATA_BLOCK;
+	if(index < 0 || index >= DATA_BLOCKS || nameDirs[index] == NAME_UNINDEXED) {
+		return;
+	}
+	nameForget(index);
+	nameLinks[previousBlock - FIRST_DATA_BLOCK] = following;
+	if(following != -1) {
+		namePrevious[following - FIRST_DATA_BLOCK] = previousBlock;
+	}
+}
+
+/**
+ * Entry of a directory with exactly this filename, returns its page or -1.
+ * previous gets the entry linking to it. Goes through the name index and
+ * only walks the chain of a directory that cannot be indexed.
+ */
+int findEntry(int dirBlock, char * filename, int * previous) {
+	int next = dirBlock;
+	*previous = -1;
+	STAT_INC(STAT_LOOKUPS);
+	if(nameIndexDirectory(dirBlock)) {
+		unsigned int hash = nameHash(dirBlock, filename);
+		int index = nameBuckets[hash & (NAME_BUCKETS - 1)];
+		while(index != -1) {
+			if(nameDirs[index] == dirBlock && nameHashes[index] == hash) {
+				// Hashes can collide, compare the name in place
+				next = index + FIRST_DATA_BLOCK;
+				STAT_INC(STAT_PAGES_READ);
+				STAT_INC(STAT_DIRENTS_SCANNED);
+				struct Metadata * entry = (struct Metadata *)storagePin(next, TRUE);
+				BOOL match = entry->filename[0] != FILE_DELETED && !strncmp(entry->filename, filename, MAX_FILENAME_SIZE);
+				storageUnpin(next, FALSE);
+				if(match) {
+					*previous = namePrevious[index];
+					return next;
+				}
+			}
+			index = nameNext[index];
+		}
+		return -1;
+	}
+
+	while(next != -1) {
+		struct Metadata * entry = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		BOOL match = entry->filename[0] != FILE_DELETED && !strncmp(entry->filename, filename, MAX_FILENAME_SIZE);
+		int following = entry->nextBlockNumber;
+		free(entry);
+
+		if(match) {
+			return next;
+		}
+		*previous = next;
+		next = following;
+	}
+	return -1;
+}
+
+/**
+ * findEntry for the subdirectory dirname, which is stored as ".dirname"
+ */
+int findSubdirectory(int dirBlock, char * dirname, int * previous) {
+	char name[MAX_FILENAME_SIZE];
+	*previous = -1;
+	if(strlen(dirname) >= MAX_FILENAME_SIZE - 1) {
+		return -1;
+	}
+	name[0] = DIRECTORY;
+	strcpy(name + 1, dirname);
+	return findEntry(dirBlock, name, previous);
+}
+
+/**
+ * '.' page of the directory a path names, -1 if there is none. Paths start
+ * at the current directory unless they begin with '/'. readOnly is set if
+ * the directory is inside a snapshot.
+ */
+int resolveDirectory(char * path, BOOL * readOnly) {
+	char name[MAX_FILENAME_SIZE];
+	BOOL absolute = path[0] == '/';
+	int dirBlock = absolute ? ROOT_BLOCK : currentDirBlockStack[currentDirBlock];
+	// Depth below the root, and the depth of the snapshot we are in as for cd
+	int depth = absolute ? 0 : currentDirBlock;
+	int snapshotDepth = absolute ? -1 : readOnlyDepth;
+	int previous;
+
+	while(*path != '\0') {
+		int length = strcspn(path, "/");
+		if(length == 0 || (length == 1 && path[0] == '.')) {
+			path += length + (path[length] == '/');
+			continue;
+		}
+		if(length >= MAX_FILENAME_SIZE - 1) {
+			return -1;
+		}
+
+		// Directories are stored as ".name", which makes '..' "..."
+		name[0] = DIRECTORY;
+		memcpy(name + 1, path, length);
+		name[length + 1] = '\0';
+		BOOL up = length == 2 && !strncmp(path, "..", 2);
+
+		int entryBlock = findEntry(dirBlock, name, &previous);
+		if(entryBlock < 0) {
+			return -1;
+		}
+		struct Metadata * entry = getMetadata(entryBlock);
+		if(up) {
+			depth -= depth > 0;
+			if(depth < snapshotDepth) {
+				snapshotDepth = -1;
+			}
+		} else {
+			depth++;
+			if((entry->fileAttrib & SNAPSHOT) && snapshotDepth < 0) {
+				snapshotDepth = depth;
+			}
+		}
+		dirBlock = entry->blockNumber;
+		free(entry);
+
+		path += length + (path[length] == '/');
+	}
+
+	*readOnly = snapshotDepth >= 0;
+	return dirBlock;
+}
+
+/**
+ * Directory holding the last component of a path, returns its '.' page or
+ * -1. base gets the last component.
+ */
+int resolveParent(char * path, char ** base, BOOL * readOnly) {
+	char * slash = strrchr(path, '/');
+	if(slash == NULL) {
+		*base = path;
+		*readOnly = readOnlyDepth >= 0;
+		return currentDirBlockStack[currentDirBlock];
+	}
+
+	*base = slash + 1;
+	if(slash == path) {
+		*readOnly = FALSE;
+		return ROOT_BLOCK;
+	}
+	*slash = '\0';
+	return resolveDirectory(path, readOnly);
+}
+
+/**
+ * Where an entry goes for a target path: into the directory the target
+ * names, keeping name, or else under the target's last component. Returns
+ * the '.' page or -1, base gets the name to use.
+ */
+int resolveTarget(char * target, char * name, char ** base, BOOL * readOnly) {
+	int dirBlock = resolveDirectory(target, readOnly);
+	if(dirBlock >= 0) {
+		*base = name;
+		return dirBlock;
+	}
+	return resolveParent(target, base, readOnly);
+}
+
+/**
+ * Copy of a page in a journaled update, read on first use so a page that
+ * plays several parts is changed in one place
+ */
+struct Metadata * journalPage(struct Journal * journal, int blockNumber) {
+	int i;
+	for(i = 0; i < journal->count; i++) {
+		if(journal->pages[i] == blockNumber) {
+			return (struct Metadata *)journal->images[i];
+		}
+	}
+
+	if(journal->count == JOURNAL_MAX_PAGES) {
+		printf("Too many pages for one journaled update.\n");
+		exit(-1);
+	}
+	STAT_INC(STAT_PAGES_READ);
+	journal->pages[journal->count] = blockNumber;
+	storageRead(blockNumber, journal->images[journal->count], TRUE);
+	return (struct Metadata *)journal->images[journal->count++];
+}
+
+/**
+ * Writes the pages of an update so that either all of them or none reach
+ * the image: they go to the journal first and are written in place only
+ * once the journal is durable
+ */
+void journalCommit(struct Journal * journal) {
+	char page[PAGE_SIZE];
+	struct JournalHeader * header = (struct JournalHeader *)page;
+	int i;
+
+	memset(page, 0, PAGE_SIZE);
+	header->magic = JOURNAL_MAGIC;
+	header->count = journal->count;
+	for(i = 0; i < journal->count; i++) {
+		header->pages[i] = journal->pages[i];
+		header->hashes[i] = hashPage(journal->images[i]);
+		STAT_INC(STAT_PAGES_WRITTEN);
+		storageWrite(JOURNAL_BLOCK + 1 + i, journal->images[i]);
+	}
+	STAT_INC(STAT_PAGES_WRITTEN);
+	storageWrite(JOURNAL_BLOCK, page);
+	storageBarrier();
+
+	for(i = 0; i < journal->count; i++) {
+		saveBlock(journal->images[i], journal->pages[i]);
+	}
+	storageBarrier();
+
+	// A stale journal would undo later changes to these pages on replay
+	memset(page, 0, PAGE_SIZE);
+	STAT_INC(STAT_PAGES_WRITTEN);
+	storageWrite(JOURNAL_BLOCK, page);
+	storageBarrier();
+}
+
+/**
+ * Finishes an update that was interrupted after its journal became durable.
+ * A journal whose pages do not match their hashes never reached the image.
+ */
+void journalReplay() {
+	char page[PAGE_SIZE];
+	char image[PAGE_SIZE];
+	struct JournalHeader * header = (struct JournalHeader *)page;
+	int i;
+
+	storageRead(JOURNAL_BLOCK, page, TRUE);
+	if(header->magic != JOURNAL_MAGIC) {
+		return;
+	}
+
+	BOOL intact = header->count > 0 && header->count <= JOURNAL_MAX_PAGES;
+	for(i = 0; intact && i < header->count; i++) {
+		storageRead(JOURNAL_BLOCK + 1 + i, image, TRUE);
+		intact = header->pages[i] >= FIRST_DATA_BLOCK && header->pages[i] < FIRST_DATA_BLOCK + DATA_BLOCKS &&
+			hashPage(image) == header->hashes[i];
+	}
+
+	if(intact) {
+		for(i = 0; i < header->count; i++) {
+			storageRead(JOURNAL_BLOCK + 1 + i, image, TRUE);
+			saveBlock(image, header->pages[i]);
+		}
+		storageBarrier();
+		printf("Finished an interrupted update of %d pages from the journal.\n", header->count);
+	}
+
+	memset(page, 0, PAGE_SIZE);
+	storageWrite(JOURNAL_BLOCK, page);
+	storageBarrier();
+}
+
+/**
+ * Renames an entry or moves it to another directory. Only the entries around it are relinked, through the journal,
+ * so the cost does not depend on the size of what is moved.
+ */
+void mv(char * source, char * target) {
+	char name[MAX_FILENAME_SIZE];
+	int previous, other, i;
+	BOOL readOnly;
+
+	// The source is a name, optionally preceded by its directory
+	int dirBlock = resolveParent(source, &source, &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(readOnly) {
+		printf("Snapshots are read-only.\n");
+		return;
+	}
+
+	if(!strcmp(source, "") || !strcmp(source, ".") || !strcmp(source, "..")) {
+		printf("Cannot move '.' or '..'.\n");
+		return;
+	}
+
+	// Files first, then directories, which are stored as ".name"
+	BOOL directory = FALSE;
+	int entryBlock = findEntry(dirBlock, source, &previous);
+	if(entryBlock < 0 && strlen(source) < MAX_FILENAME_SIZE - 1) {
+		name[0] = DIRECTORY;
+		strcpy(name + 1, source);
+		entryBlock = findEntry(dirBlock, name, &previous);
+		directory = TRUE;
+	}
+	if(entryBlock < 0) {
+		printf("No such file or directory.\n");
+		return;
+	}
+
+	// The target is a directory to move into, or a name optionally preceded by one
+	char * base;
+	int targetBlock = resolveTarget(target, source, &base, &readOnly);
+	if(targetBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(readOnly) {
+		printf("Snapshots are read-only.\n");
+		return;
+	}
+	if(base[0] == '\0' || base[0] == DIRECTORY || strchr(base, '/') != NULL || strlen(base) >= MAX_FILENAME_SIZE - 1) {
+		printf("Invalid name.\n");
+		return;
+	}
+
+	struct Journal * journal = (struct Journal *) malloc(sizeof (struct Journal));
+	journal->count = 0;
+	struct Metadata * entry = journalPage(journal, entryBlock);
+	if(entry->fileAttrib & SNAPSHOT) {
+		printf("Snapshots cannot be moved.\n");
+		free(journal);
+		return;
+	}
+
+	if(directory) {
+		// Neither the directory we are in nor one above it can move
+		for(i = 0; i <= currentDirBlock; i++) {
+			if(currentDirBlockStack[i] == entry->blockNumber) {
+				printf("Cannot move a directory that is being used.\n");
+				free(journal);
+				return;
+			}
+		}
+
+		// A directory cannot go below itself
+		int block = targetBlock, steps = 0;
+		while(block > 0 && block != entry->blockNumber && steps++ < MAX_DIRECTORY_DEPTH) {
+			block = parentDirectory(block);
+		}
+		if(block == entry->blockNumber) {
+			printf("Cannot move a directory into itself.\n");
+			free(journal);
+			return;
+		}
+	}
+
+	if(directory) {
+		name[0] = DIRECTORY;
+		strcpy(name + 1, base);
+	} else {
+		strcpy(name, base);
+	}
+	int existing = findEntry(targetBlock, name, &other);
+	if(existing == entryBlock) {
+		free(journal);
+		return;
+	}
+	if(existing >= 0) {
+		printf("A file with that name already exists.\n");
+		free(journal);
+		return;
+	}
+
+	long bytes;
+	int pages;
+	entryUsage(entry, &bytes, &pages);
+	if(targetBlock != dirBlock && !quotaAllows(targetBlock, bytes, dirBlock)) {
+		printf("Quota exceeded.\n");
+		free(journal);
+		return;
+	}
+
+	memset(entry->filename, 0, MAX_FILENAME_SIZE);
+	strcpy(entry->filename, name);
+
+	if(targetBlock != dirBlock) {
+		// Unlink from the source directory
+		struct Metadata * before = journalPage(journal, previous);
+		before->nextBlockNumber = entry->nextBlockNumber;
+		struct Metadata * dot = journalPage(journal, dirBlock);
+		if(dot->dir.tailBlock == entryBlock) {
+			dot->dir.tailBlock = previous;
+		}
+		if(dot->dir.entries > 0) {
+			dot->dir.entries--;
+		}
+		dot->dir.bytes -= bytes;
+		dot->dir.pages -= pages;
+
+		// Link at the tail of the target
+		dot = journalPage(journal, targetBlock);
+		int tail = dot->dir.tailBlock;
+		if(tail <= 0) {
+			struct Metadata * temp = NULL;
+			tail = targetBlock;
+			while((temp = getMetadata(tail))->nextBlockNumber != -1) {
+				tail = temp->nextBlockNumber;
+				free(temp);
+			}
+			free(temp);
+		}
+		journalPage(journal, tail)->nextBlockNumber = entryBlock;
+		entry->nextBlockNumber = -1;
+		dot->dir.tailBlock = entryBlock;
+		dot->dir.entries++;
+		dot->dir.bytes += bytes;
+		dot->dir.pages += pages;
+
+		// A directory's '..' follows it
+		if(directory) {
+			struct Metadata * moved = getMetadata(entry->blockNumber);
+			struct Metadata * parent = journalPage(journal, moved->nextBlockNumber);
+			parent->blockNumber = targetBlock;
+			free(moved);
+		}
+	}
+
+	if(journal->count == 1) {
+		// A rename changes one page, which is written whole
+		saveBlock(entry, entryBlock);
+	} else {
+		journalCommit(journal);
+
+		// The two directories' totals went with the journal, those above follow
+		accountUsage(parentDirectory(dirBlock), -bytes, -pages);
+		accountUsage(parentDirectory(targetBlock), bytes, pages);
+	}
+	free(journal);
+}
+
+/**
+ * Copies a file's data chain into new pages, as one run when there is room,
+ * keeping its holes. tail gets the last page. Returns the new head or -1
+ * when the image is full.
+ */
+int copyChain(int blockNumber, int * tail) {
+	int count;
+	chainExtents(blockNumber, FALSE, &count, NULL);
+	int run = createBlockRun(count);
+	int first = -1, written = -1, added = 0, link = 0;
+	struct Block * last = NULL;
+	while(blockNumber > 0 && added < count) {
+		int target = run >= 0 ? run + added : createBlock();
+		if(target < 0) {
+			if(last != NULL) {
+				last->nextBlockNumber = 0;
+				saveBlock(last, written);
+				free(last);
+			}
+			freeChain(first, FALSE);
+			return -1;
+		}
+		added++;
+
+		// Link the previous copy now that the page after it is known
+		if(last != NULL) {
+			last->nextBlockNumber = MAKE_NEXT(target, HOLES_AFTER(link), run >= 0 ? count - added + 1 : 0);
+			saveBlock(last, written);
+			free(last);
+		} else {
+			first = target;
+		}
+
+		last = (struct Block *)getBlock(blockNumber);
+		link = last->nextBlockNumber;
+		written = target;
+		blockNumber = NEXT_PAGE(link);
+		STAT_INC(STAT_PAGES_COPIED);
+	}
+
+	if(last != NULL) {
+		last->nextBlockNumber = MAKE_NEXT(0, HOLES_AFTER(link), 0);
+		saveBlock(last, written);
+		free(last);
+	}
+	*tail = written;
+	return first;
+}
+
+/**
+ * Copies a file. The copy shares the source's data chain through its
+ * reference count, so it takes one entry page whatever the size, and
+ * whichever side is written next gets its own pages. With physical set the
+ * data is copied up front instead.
+ */
+void cp(char * source, char * target, BOOL physical) {
+	char name[MAX_FILENAME_SIZE];
+	int previous;
+	BOOL readOnly;
+
+	// Copying out of a snapshot is fine, only the target must be writable
+	int dirBlock = resolveParent(source, &source, &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	int entryBlock = source[0] != DIRECTORY ? findEntry(dirBlock, source, &previous) : -1;
+	if(entryBlock < 0) {
+		printf("No such file.\n");
+		return;
+	}
+
+	char * base;
+	int targetBlock = resolveTarget(target, source, &base, &readOnly);
+	if(targetBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(readOnly) {
+		printf("Snapshots are read-only.\n");
+		return;
+	}
+	if(base[0] == '\0' || base[0] == DIRECTORY || strchr(base, '/') != NULL || strlen(base) >= MAX_FILENAME_SIZE - 1) {
+		printf("Invalid name.\n");
+		return;
+	}
+	strcpy(name, base);
+
+	// An existing file is replaced, keeping its place in the directory
+	int existing = findEntry(targetBlock, name, &previous);
+	if(existing == entryBlock) {
+		printf("Source and target are the same file.\n");
+		return;
+	}
+
+	struct Metadata * entry = getMetadata(entryBlock);
+	long bytes, oldBytes = 0;
+	int pages, oldPages = 0;
+	entryUsage(entry, &bytes, &pages);
+	if(existing >= 0) {
+		struct Metadata * old = getMetadata(existing);
+		entryUsage(old, &oldBytes, &oldPages);
+		free(old);
+	}
+	if(!quotaAllows(targetBlock, bytes - oldBytes, -1)) {
+		printf("Quota exceeded.\n");
+		free(entry);
+		return;
+	}
+
+	if(!(entry->fileAttrib & INLINE_DATA) && entry->blockNumber > 0) {
+		int head;
+		if(physical) {
+			// The data goes to the group of the target directory
+			allocGroup = GROUP_OF(targetBlock);
+			head = copyChain(entry->blockNumber, &entry->tail.block);
+			allocGroup = -1;
+		} else {
+			head = sharePage(entry->blockNumber);
+		}
+		if(head < 0) {
+			printf("Not enough space.\n");
+			free(entry);
+			return;
+		}
+		entry->blockNumber = head;
+	}
+
+	memset(entry->filename, 0, MAX_FILENAME_SIZE);
+	strcpy(entry->filename, name);
+	setModifyTime(entry);
+
+	if(existing >= 0) {
+		struct Metadata * old = getMetadata(existing);
+		releaseEntry(old);
+		entry->nextBlockNumber = old->nextBlockNumber;
+		saveBlock(entry, existing);
+		free(old);
+		accountUsage(targetBlock, bytes - oldBytes, pages - oldPages);
+	} else if(addEntry(targetBlock, entry) < 0) {
+		releaseEntry(entry);
+		printf("Not enough space.\n");
+	}
+	free(entry);
+}
+
+/**
+ * Page k of the data reserved for an imported file
+ */
+static int importedPage(struct ImportFile * file, int k) {
+	return file->first >= 0 ? file->first + k : file->pages[k];
+}
+
+/**
+ * Reserves the pages an imported file needs: one for its entry and its data
+ * as one run in its directory's group when there is one. Files small enough
+ * for their entry need no data pages. Returns FALSE when the image is full.
+ */
+static BOOL reservePages(struct ImportFile * file) {
+	file->entry = createBlockIn(GROUP_OF(file->dirBlock));
+	if(file->entry < 0) {
+		return FALSE;
+	}
+	if(inlineMode && file->size <= MAX_INLINE_DATA_SIZE) {
+		return TRUE;
+	}
+	int count = file->size > 0 ? BLOCKS_FOR(file->size) : 1;
+	allocGroup = GROUP_OF(file->dirBlock);
+	file->first = createBlockRun(count);
+	if(file->first < 0) {
+		file->pages = (int *) malloc(count * sizeof (int));
+		for(file->count = 0; file->count < count; file->count++) {
+			file->pages[file->count] = createBlock();
+			if(file->pages[file->count] < 0) {
+				break;
+			}
+		}
+	}
+	allocGroup = -1;
+	if(file->first < 0 && file->count < count) {
+		while(file->count > 0) {
+			invalidateBlock(file->pages[--file->count]);
+		}
+		invalidateBlock(file->entry);
+		file->entry = -1;
+		return FALSE;
+	}
+	file->count = count;
+	return TRUE;
+}
+
+/**
+ * Gives back the pages reserved for an imported file that was not stored
+ */
+static void releasePages(struct ImportFile * file) {
+	int k;
+	for(k = 0; k < file->count; k++) {
+		invalidateBlock(importedPage(file, k));
+	}
+	file->count = 0;
+	if(file->entry >= 0) {
+		invalidateBlock(file->entry);
+		file->entry = -1;
+	}
+}
+
+/**
+ * Writes an imported file's data to its reserved pages and fills in its
+ * entry, which is not linked yet
+ */
+static void writeImported(struct ImportFile * file, struct Metadata * entry) {
+	memset(entry, 0, sizeof (*entry));
+	strcpy(entry->filename, file->name);
+	if(file->count == 0) {
+		setInlineData(entry, file->size, file->data);
+		return;
+	}
+
+	struct Block block;
+	int k, offset = 0;
+	for(k = 0; k < file->count; k++) {
+		int length = file->size - offset < MAX_BLOCK_DATA_SIZE ? file->size - offset : MAX_BLOCK_DATA_SIZE;
+		// A run is recorded in its links so readers can prefetch it
+		block.nextBlockNumber = k + 1 < file->count ? MAKE_NEXT(importedPage(file, k + 1), 0,
+			file->first >= 0 ? file->count - k - 1 : 0) : 0;
+		memcpy(block.data, file->data + offset, length);
+		memset(block.data + length, 0, MAX_BLOCK_DATA_SIZE - length);
+		saveBlock(&block, importedPage(file, k));
+		offset += length;
+	}
+
+	entry->blockNumber = importedPage(file, 0);
+	entry->fileSize = sizeof(*entry) + file->size;
+	entry->tail.block = importedPage(file, file->count - 1);
+	entry->tail.fill = file->size - (file->count - 1) * MAX_BLOCK_DATA_SIZE;
+	entry->tail.pages = file->count;
+	setModifyTime(entry);
+}
+
+/**
+ * Walks a host directory into the directory whose '.' entry is at dirBlock.
+ * Subdirectories are created right away and every file is listed with its
+ * pages reserved. A directory's files are listed before anything below it,
+ * so they are linked in as few batches as possible. listed counts the data
+ * listed so far, against the quotas of the target and above, and depth
+ * how far below the target the walk is.
+ */
+static void walkHostTree(char * hostPath, int dirBlock, int depth, struct ImportList * list,
+		long * listed, int * directories, int * skipped) {
+	struct HostEntry * entries;
+	int count = hostList(hostPath, &entries);
+	if(count < 0) {
+		perror(hostPath);
+		(*skipped)++;
+		return;
+	}
+
+	char name[MAX_FILENAME_SIZE + 1];
+	int * below = (int *) malloc((count > 0 ? count : 1) * sizeof (int));
+	int i, previous;
+	for(i = 0; i < count; i++) {
+		struct HostEntry * item = &entries[i];
+		below[i] = -1;
+		if(item->type == HOST_OTHER) {
+			// Links and special files have no counterpart in the image
+			printf("Skipped %s: not a file or directory\n", item->path);
+			(*skipped)++;
+		} else if(item->name[0] == DIRECTORY || strlen(item->name) >= MAX_FILENAME_SIZE - 1) {
+			// Names starting with '.' are how the image marks directories
+			printf("Skipped %s: name cannot be stored\n", item->path);
+			(*skipped)++;
+		} else if(item->type == HOST_DIRECTORY) {
+			sprintf(name, "%c%s", DIRECTORY, item->name);
+			int existing = findEntry(dirBlock, name, &previous);
+			if(existing >= 0) {
+				// An existing directory is merged into
+				struct Metadata * entry = getMetadata(existing);
+				below[i] = entry->fileAttrib & SNAPSHOT ? -1 : entry->blockNumber;
+				free(entry);
+			} else if(depth + 1 < MAX_DIRECTORY_DEPTH) {
+				below[i] = createDirectory(dirBlock, item->name);
+				if(below[i] >= 0) {
+					(*directories)++;
+				}
+			}
+			if(below[i] < 0) {
+				printf("Skipped %s: %s\n", item->path, existing >= 0 ? "snapshot" : "not enough space");
+				(*skipped)++;
+			}
+		} else if(findEntry(dirBlock, item->name, &previous) >= 0) {
+			printf("Skipped %s: file exists\n", item->path);
+			(*skipped)++;
+		} else if(item->size > FILESIZE || !quotaAllows(dirBlock, *listed + item->size, -1)) {
+			printf("Skipped %s: %s\n", item->path, item->size > FILESIZE ? "not enough space" : "quota exceeded");
+			(*skipped)++;
+		} else {
+			struct ImportFile * file = importAdd(list, item->path, item->size);
+			file->dirBlock = dirBlock;
+			strcpy(file->name, item->name);
+			if(reservePages(file)) {
+				*listed += item->size;
+			} else {
+				printf("Skipped %s: not enough space\n", item->path);
+				(*skipped)++;
+				free(file->hostPath);
+				free(file->pages);
+				list->count--;
+			}
+		}
+	}
+
+	for(i = 0; i < count; i++) {
+		if(below[i] >= 0) {
+			walkHostTree(entries[i].path, below[i], depth + 1, list, listed, directories, skipped);
+		}
+	}
+	free(below);
+	hostListFree(entries, count);
+}
+
+/**
+ * Copies the host directory tree at hostPath into the directory at path.
+ * The host files are read in parallel while the image is written by this
+ * thread alone.
+ */
+void importTree(char * hostPath, char * path) {
+	BOOL readOnly;
+	int dirBlock = resolveDirectory(path, &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(readOnly) {
+		printf("Snapshots are read-only.\n");
+		return;
+	}
+
+	struct ImportList list;
+	long listed = 0, bytes = 0;
+	int directories = 0, skipped = 0, files = 0;
+	memset(&list, 0, sizeof (list));
+	walkHostTree(hostPath, dirBlock, 0, &list, &listed, &directories, &skipped);
+
+	// Entries wait here until a batch is full or the next file is elsewhere
+	struct Metadata * batch = (struct Metadata *) malloc(IMPORT_BATCH * sizeof (struct Metadata));
+	int blocks[IMPORT_BATCH];
+	int batched = 0, batchDir = -1;
+	importStart(&list);
+	for(;;) {
+		struct ImportFile * file = importNext();
+		if(batched > 0 && (file == NULL || batched == IMPORT_BATCH || file->dirBlock != batchDir)) {
+			// Every page was reserved during the walk, so linking cannot run out of space
+			linkEntries(batchDir, batch, blocks, batched);
+			files += batched;
+			batched = 0;
+		}
+		if(file == NULL) {
+			break;
+		}
+
+		if(file->failed) {
+			printf("Skipped %s: could not read it\n", file->hostPath);
+			releasePages(file);
+			skipped++;
+		} else {
+			writeImported(file, &batch[batched]);
+			batchDir = file->dirBlock;
+			blocks[batched++] = file->entry;
+			bytes += file->size;
+		}
+		free(file->data);
+		file->data = NULL;
+	}
+	importFinish();
+	importFree(&list);
+	free(batch);
+
+	printf("Imported %d files and %d directories, %ld bytes.", files, directories, bytes);
+	if(skipped > 0) {
+		printf(" Skipped %d.", skipped);
+	}
+	printf("\n");
+}
+
+/*
+Had to rename due to conflicting function defintions
+*/
+void rmdir2(char * dirName) {
+	// Do not allow the user to remove the '.' and '..' files
+	if(!strcmp(".", dirName) || !strcmp("..", dirName)) {
+		printf("No directory found with the given name\n");
+		return;
+	}
+
+	int previousBlockNumber;
+	int next = findSubdirectory(currentDirBlockStack[currentDirBlock], dirName, &previousBlockNumber);
+
+	if(next >= 0) {
+		struct Metadata * dir = getMetadata(next);
+		// Check to see if the directory is empty (anything besides '.' and '..')
+		struct Metadata * temp = getMetadata(dir->blockNumber);
+		int entries = temp->dir.entries;
+		int temp2 = temp->nextBlockNumber;
+		free(temp);
+
+		if(entries == 0) {
+			// Invalidate the '.' and '..' blocks
+			invalidateBlock(dir->blockNumber);
+			invalidateBlock(temp2);
+
+			// Remove the entry from the linked list
+			removeEntry(currentDirBlockStack[currentDirBlock], previousBlockNumber, next);
+		} else {
+			printf("Directory not empty.\n");
+		}
+
+		free(dir);
+	} else {
+		printf("Cannot find directory with provided name.\n");
+	}
+}
+
+void rm(char * filename) {
+	int previousBlockNumber;
+	int next = filename[0] != DIRECTORY ? findEntry(currentDirBlockStack[currentDirBlock], filename, &previousBlockNumber) : -1;
+
+	if(next >= 0) {
+		struct Metadata * file = getMetadata(next);
+		// Invalidate all data blocks, inline files have none
+		if(!(file->fileAttrib & INLINE_DATA)) {
+			freeChain(file->blockNumber, FALSE);
+		}
+
+		// Delete file handle
+		removeEntry(currentDirBlockStack[currentDirBlock], previousBlockNumber, next);
+		free(file);
+	} else {
+		printf("Cannot find file with provided name.\n");
+	}
+}
+
+void rmForce(char * filename) {
+	// Never remove the current or parent directory out from under the user
+	if(!strcmp(".", filename) || !strcmp("..", filename)) {
+		printf("Cannot remove the current or parent directory.\n");
+		return;
+	}
+
+	// We have no idea if we are deleting a file or a directory
+	int previous;
+	if(filename[0] != DIRECTORY && findEntry(currentDirBlockStack[currentDirBlock], filename, &previous) >= 0) {
+		// If the target is a file, just delete it and be done
+		rm(filename);
+		return;
+	}
+
+	// If the target is a directory, we must do other stuff to remove it
+	int next = findSubdirectory(currentDirBlockStack[currentDirBlock], filename, &previous);
+	if(next >= 0) {
+		struct Metadata * file = getMetadata(next);
+		// To remove a directory, remove every file and directory inside of it nested
+		if(currentDirBlock + 1 < MAX_DIRECTORY_DEPTH) {
+			currentDirBlockStack[++currentDirBlock] = file->blockNumber;
+			clearDirectory(file);
+			currentDirBlockStack[currentDirBlock--] = -1;
+		} else {
+			printf("Max depth achieved.\n");
+		}
+
+		// The directory is now empty so it can be removed normally
+		rmdir2(filename);
+		free(file);
+	} else {
+		printf("Cannot find file with provided name.\n");
+	}
+}
+
+void clearDirectory(struct Metadata * metadata) {
+	// Itterate through every block inside the directory
+	struct Metadata * meta = NULL;
+	int next = metadata->blockNumber;
+	do {
+		meta = getMetadata(next);
+		
+		if(meta->filename[0] == DIRECTORY) {
+			// Used to prevent including the '.' and '..' directories
+			if(!(meta->fileAttrib & SUBDIRECTORY)) {
+				//printf("Directory: %s\n", meta->filename);
+
+				// In order to correctly do this, we must add to the currentDirBlockStack
+				if(currentDirBlock + 1 < MAX_DIRECTORY_DEPTH) {
+					currentDirBlockStack[++currentDirBlock] = meta->blockNumber;
+
+					// Remove that directory recursively
+					struct Metadata * temp = getMetadata(meta->blockNumber);
+					clearDirectory(temp);
+					free(temp);
+
+					// Pop the top off of the currentDirBlockStack now that we returned
+					currentDirBlockStack[currentDirBlock--] = -1;
+				} else {
+					printf("Max depth achieved.\n");
+				}
+
+				// Delete the directory
+				rmdir2(meta->filename + 1);
+			}
+		} else {
+			//printf("File: %s\n", meta->filename);
+			rm(meta->filename);
+		}
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+}
+
+/**
+ * Asks the user whether a file pointing at an unallocated page should be
+ * cut off at that page. Returns TRUE to truncate, FALSE to allocate.
+ */
+BOOL askTruncate(char * filename, int blockNumber) {
+	printf("File %s refers to unallocated page %d. (t)runcate or (a)llocate? ", filename, blockNumber);
+
+	char * answer = NULL;
+	size_t size = 0;
+	BOOL truncate = FALSE;
+	if(promptLine(&answer, &size) != -1 && answer[0] == 't') {
+		truncate = TRUE;
+	}
+	free(answer);
+	return truncate;
+}
+
+/**
+ * Counts the references to every data page owned by a file, repairing
+ * references to pages that are not marked as allocated
+ */
+BOOL scanFile(struct Metadata * file, unsigned char * owners) {
+	struct Block * block = NULL;
+	int previous = -1;
+	int next = file->blockNumber;
+	while(next > 0) {
+		if(next < FIRST_DATA_BLOCK || next >= FIRST_DATA_BLOCK + DATA_BLOCKS) {
+			printf("File %s refers to invalid page %d.\n", file->filename, next);
+			break;
+		}
+
+		if(owners[next]) {
+			// Shared with a chain scanned earlier, which already counted the rest of it.
+			// Also stops us from looping forever on a corrupt chain
+			if(owners[next] < MAX_REFERENCES) {
+				owners[next]++;
+			}
+			return FALSE;
+		}
+
+		if(!allocTable[next - FIRST_DATA_BLOCK]) {
+			// The first block always belongs to the file, so it can only be allocated
+			if(previous > 0 && askTruncate(file->filename, next)) {
+				block = (struct Block *)getBlock(previous);
+				block->nextBlockNumber = 0;
+				saveBlock(block, previous);
+				free(block);
+				break;
+			}
+			allocTable[next - FIRST_DATA_BLOCK] = 1;
+		}
+		owners[next] = 1;
+
+		// Move to the next block
+		block = (struct Block *)getBlock(next);
+		previous = next;
+		next = NEXT_PAGE(block->nextBlockNumber);
+		free(block);
+	}
+
+	// A tail that is not where the walk ended would send appends astray
+	if(!(file->fileAttrib & INLINE_DATA) && file->tail.block != 0 && (next != 0 || previous != file->tail.block)) {
+		printf("Cleared the tail of file %s.\n", file->filename);
+		file->tail.block = 0;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Marks every page reachable from a directory's entry chain, and repairs the
+ * tail and entry count kept in its '.' entry
+ */
+void scanDirectory(int blockNumber, unsigned char * owners, int depth) {
+	struct Metadata * meta = NULL;
+	int next = blockNumber;
+	int tail = -1, entries = 0;
+	do {
+		if(next < FIRST_DATA_BLOCK || next >= FIRST_DATA_BLOCK + DATA_BLOCKS) {
+			printf("Directory entry refers to invalid page %d.\n", next);
+			break;
+		}
+
+		if(owners[next]) {
+			printf("Page %d is owned by more than one file.\n", next);
+			break;
+		}
+		owners[next] = 1;
+
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		if(meta->filename[0] == DIRECTORY) {
+			// Do not follow the '.' and '..' entries
+			if(!(meta->fileAttrib & SUBDIRECTORY) && depth + 1 < MAX_DIRECTORY_DEPTH) {
+				scanDirectory(meta->blockNumber, owners, depth + 1);
+			}
+		} else if(meta->filename[0] != FILE_DELETED && scanFile(meta, owners)) {
+			saveBlock(meta, next);
+		}
+		if(!(meta->fileAttrib & SUBDIRECTORY)) {
+			entries++;
+		}
+
+		tail = next;
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+
+	meta = getMetadata(blockNumber);
+	if(next == -1 && tail > 0 && meta != NULL && (meta->dir.tailBlock != tail || meta->dir.entries != entries)) {
+		printf("Repaired the index of directory page %d.\n", blockNumber);
+		meta->dir.tailBlock = tail;
+		meta->dir.entries = entries;
+		saveBlock(meta, blockNumber);
+	}
+	free(meta);
+}
+
+void scandisk() {
+	// One counter per page in the image, counting the references to each page reachable from the root
+	unsigned char * owners = (unsigned char *) malloc(FILESIZE / PAGE_SIZE);
+	memset(owners, 0, FILESIZE / PAGE_SIZE);
+
+	scanDirectory(ROOT_BLOCK, owners, 0);
+
+	// Anything allocated that nobody can reach is wasted space
+	int i, recovered = 0, recounted = 0;
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(allocTable[i] && !owners[i + FIRST_DATA_BLOCK]) {
+			dedupForget(i + FIRST_DATA_BLOCK);
+			allocTable[i] = 0;
+			if(discardPending != NULL) {
+				discardPending[i] = 1;
+			}
+			STAT_INC(STAT_BLOCKS_FREED);
+			recovered++;
+		} else if(allocTable[i] != owners[i + FIRST_DATA_BLOCK]) {
+			// Shared pages are only freed once their last reference goes
+			allocTable[i] = owners[i + FIRST_DATA_BLOCK];
+			recounted++;
+		}
+	}
+
+	groupCount();
+
+	int repaired = rebuildUsage(ROOT_BLOCK, 0);
+	if(repaired) {
+		printf("Repaired the totals of %d entries.\n", repaired);
+	}
+	if(recovered) {
+		printf("Recovered %d unreachable pages.\n", recovered);
+	}
+	if(recounted) {
+		printf("Corrected the reference count of %d pages.\n", recounted);
+	}
+
+	free(owners);
+}
+/**
+ * Walks a chain of pages, counting the pages and the extents (runs of
+ * consecutive pages) it is made of. Directory chains end at -1 and file
+ * chains at 0. distance, if given, receives the total seek distance.
+ */
+int chainExtents(int blockNumber, BOOL directory, int * pages, long * distance) {
+	int extents = 0, count = 0, previous = -1;
+	long jumps = 0;
+	int next = blockNumber;
+	while(next > 0 && count < FIRST_DATA_BLOCK + DATA_BLOCKS) {
+		if(next >= FIRST_DATA_BLOCK + DATA_BLOCKS) {
+			break;
+		}
+
+		if(previous < 0 || next != previous + 1) {
+			extents++;
+			if(previous >= 0) {
+				jumps += next > previous ? next - previous : previous - next;
+			}
+		}
+		count++;
+		previous = next;
+
+		if(directory) {
+			struct Metadata * meta = getMetadata(next);
+			next = meta->nextBlockNumber;
+			free(meta);
+		} else {
+			next = chainNext(next);
+		}
+	}
+
+	if(pages != NULL) {
+		*pages = count;
+	}
+	if(distance != NULL) {
+		*distance = jumps;
+	}
+	return extents;
+}
+
+/**
+ * Prints one line of the fragmentation report
+ */
+void fragLine(char type, int blockNumber, BOOL directory, char * name) {
+	int pages;
+	long distance;
+	int extents = chainExtents(blockNumber, directory, &pages, &distance);
+	printf("%c %8d %8d %10.1f  %s\n", type, extents, pages,
+		extents > 1 ? (double)distance / (extents - 1) : 0.0, name);
+}
+
+void frag() {
+	printf("T  Extents    Pages    AvgJump  Name\n");
+
+	// The current directory's own entry chain first
+	fragLine('d', currentDirBlockStack[currentDirBlock], TRUE, ".");
+
+	struct Metadata * meta = NULL;
+	int next = currentDirBlockStack[currentDirBlock];
+	int files = 0, fragmented = 0, totalExtents = 0;
+	do {
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+
+		if(meta->filename[0] == DIRECTORY) {
+			if(!(meta->fileAttrib & SUBDIRECTORY)) {
+				fragLine('d', meta->blockNumber, TRUE, meta->filename + 1);
+			}
+		} else if(meta->filename[0] != FILE_DELETED) {
+			int extents = chainExtents(meta->blockNumber, FALSE, NULL, NULL);
+			fragLine('f', meta->blockNumber, FALSE, meta->filename);
+			files++;
+			totalExtents += extents;
+			if(extents > 1) {
+				fragmented++;
+			}
+		}
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+
+	if(files) {
+		printf("Files: %d, fragmented: %d, average extents: %.2f\n", files, fragmented, (double)totalExtents / files);
+	}
+
+	// Histogram of free runs, bucketed by powers of two
+	int histogram[32];
+	int i, run = 0, bucket, largest = 0;
+	memset(histogram, 0, sizeof (histogram));
+	for(i = 0; i <= DATA_BLOCKS; i++) {
+		if(i < DATA_BLOCKS && !allocTable[i]) {
+			run++;
+			continue;
+		}
+		if(run) {
+			for(bucket = 0; (2 << bucket) <= run; bucket++);
+			histogram[bucket]++;
+			if(run > largest) {
+				largest = run;
+			}
+		}
+		run = 0;
+	}
+
+	printf("Free runs (pages)  Count\n");
+	for(bucket = 0; bucket < 32; bucket++) {
+		if(histogram[bucket]) {
+			printf("%7d - %-7d  %6d\n", 1 << bucket, (2 << bucket) - 1, histogram[bucket]);
+		}
+	}
+	printf("Largest free run: %d pages\n", largest);
+
+	printf("Free pages per group:");
+	for(i = 0; i < ALLOCATION_GROUPS; i++) {
+		printf(" %d", groupFree[i]);
+	}
+	printf("\n");
+}
+
+/* Pending defragmentation work, processed from the top */
+struct DefragItem defragQueue[DEFRAG_QUEUE_SIZE];
+int defragPending = 0;
+int defragBudget = 0;
+
+/**
+ * Queue a directory entry page (or a '.' page for DEFRAG_CONTENTS)
+ */
+void defragPush(int blockNumber, char kind) {
+	if(defragPending >= DEFRAG_QUEUE_SIZE) {
+		printf("Defragmentation queue is full, skipping page %d.\n", blockNumber);
+		return;
+	}
+	defragQueue[defragPending].blockNumber = blockNumber;
+	defragQueue[defragPending].kind = kind;
+	defragPending++;
+}
+
+/**
+ * Queue every file and subdirectory of the directory starting at blockNumber
+ */
+void defragQueueContents(int blockNumber) {
+	struct Metadata * meta = NULL;
+	int next = blockNumber;
+	do {
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+
+		if(meta->filename[0] == DIRECTORY) {
+			if(!(meta->fileAttrib & SUBDIRECTORY)) {
+				defragPush(next, DEFRAG_DIRECTORY);
+			}
+		} else if(meta->filename[0] != FILE_DELETED) {
+			defragPush(next, DEFRAG_FILE);
+		}
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+}
+
+/**
+ * Releases every page of a file chain (0 terminated) or directory chain (-1 terminated).
+ * Stops at the first page something else still refers to, the rest of the
+ * chain belongs to that reference as well.
+ */
+void freeChain(int blockNumber, BOOL directory) {
+	int count = 0;
+	while(blockNumber > 0 && count++ < DATA_BLOCKS) {
+		int next;
+		if(directory) {
+			struct Metadata * meta = getMetadata(blockNumber);
+			next = meta->nextBlockNumber;
+			free(meta);
+		} else {
+			next = chainNext(blockNumber);
+		}
+		if(!invalidateBlock(blockNumber)) {
+			break;
+		}
+		blockNumber = next;
+	}
+}
+
+/**
+ * Moves a file's data blocks into one contiguous run. The new chain is
+ * written first and the entry is switched over in a single page write, so
+ * a crash leaves either the old or the new chain in place (plus pages that
+ * scandisk recovers). Returns the number of pages moved.
+ */
+int relocateFile(int entryBlock) {
+	struct Metadata * meta = getMetadata(entryBlock);
+	int count;
+	int extents = chainExtents(meta->blockNumber, FALSE, &count, NULL);
+	if(extents <= 1 || chainShared(meta->blockNumber)) {
+		// Moving a chain shared with a snapshot would unshare it
+		free(meta);
+		return 0;
+	}
+
+	// Keep the data in the group of the directory holding the file
+	allocGroup = GROUP_OF(entryBlock);
+	int first = createBlockRun(count);
+	allocGroup = -1;
+	if(first < 0) {
+		printf("Not enough contiguous space to defragment %s.\n", meta->filename);
+		free(meta);
+		return 0;
+	}
+
+	// Copy the chain into the run, relinking as we go
+	int i, next = meta->blockNumber;
+	for(i = 0; i < count; i++) {
+		struct Block * block = (struct Block *)getBlock(next);
+		next = NEXT_PAGE(block->nextBlockNumber);
+		// Holes stay where they were in the chain
+		block->nextBlockNumber = MAKE_NEXT(i + 1 < count ? first + i + 1 : 0, HOLES_AFTER(block->nextBlockNumber), count - 1 - i);
+		saveBlock(block, first + i);
+		free(block);
+	}
+
+	// Commit
+	int old = meta->blockNumber;
+	meta->blockNumber = first;
+	if(meta->tail.block > 0 && !(meta->fileAttrib & INLINE_DATA)) {
+		meta->tail.block = first + count - 1;
+	}
+	saveBlock(meta, entryBlock);
+	free(meta);
+
+	freeChain(old, FALSE);
+	return count;
+}
+
+/**
+ * Moves a directory's entry pages into one contiguous run, fixing up the
+ * '.' entry, the '..' entries of its subdirectories and the directory
+ * stack. Returns the number of pages moved.
+ */
+int relocateDirectory(int entryBlock) {
+	struct Metadata * meta = getMetadata(entryBlock);
+	int old = meta->blockNumber;
+	int count;
+
+	if(chainExtents(old, TRUE, &count, NULL) <= 1) {
+		free(meta);
+		return 0;
+	}
+
+	allocGroup = GROUP_OF(old);
+	int first = createBlockRun(count);
+	allocGroup = -1;
+	if(first < 0) {
+		printf("Not enough contiguous space to defragment %s.\n", meta->filename + 1);
+		free(meta);
+		return 0;
+	}
+
+	// Copy the entries into the run, relinking as we go
+	struct Metadata * entry = NULL;
+	int i, next = old;
+	for(i = 0; i < count; i++) {
+		entry = getMetadata(next);
+		next = entry->nextBlockNumber;
+		entry->nextBlockNumber = i + 1 < count ? first + i + 1 : -1;
+		if(i == 0) {
+			// The '.' entry points at itself and knows where the chain ends
+			entry->blockNumber = first;
+			entry->dir.tailBlock = first + count - 1;
+		}
+		saveBlock(entry, first + i);
+		free(entry);
+	}
+
+	// Commit
+	meta->blockNumber = first;
+	saveBlock(meta, entryBlock);
+	free(meta);
+
+	// Subdirectories point back at the old '.' page through their '..' entry
+	for(i = 2; i < count; i++) {
+		entry = getMetadata(first + i);
+		if(entry->filename[0] == DIRECTORY && !(entry->fileAttrib & SUBDIRECTORY)) {
+			struct Metadata * dot = getMetadata(entry->blockNumber);
+			struct Metadata * dotdot = getMetadata(dot->nextBlockNumber);
+			if(dotdot != NULL && dotdot->blockNumber == old) {
+				dotdot->blockNumber = first;
+				saveBlock(dotdot, dot->nextBlockNumber);
+			}
+			free(dotdot);
+			free(dot);
+		}
+		free(entry);
+	}
+
+	for(i = 0; i <= currentDirBlock; i++) {
+		if(currentDirBlockStack[i] == old) {
+			currentDirBlockStack[i] = first;
+		}
+	}
+
+	freeChain(old, TRUE);
+	return count;
+}
+
+/**
+ * Processes queued defragmentation work until about budget pages have been
+ * moved (0 runs the queue dry). Returns the number of pages moved.
+ */
+int defragStep(int budget) {
+	int moved = 0;
+	while(defragPending > 0 && (budget <= 0 || moved < budget)) {
+		struct DefragItem item = defragQueue[--defragPending];
+
+		// The tree may have changed since the page was queued
+		if(item.blockNumber < FIRST_DATA_BLOCK || item.blockNumber >= FIRST_DATA_BLOCK + DATA_BLOCKS ||
+				!allocTable[item.blockNumber - FIRST_DATA_BLOCK]) {
+			continue;
+		}
+
+		struct Metadata * meta = getMetadata(item.blockNumber);
+		BOOL directory = meta->filename[0] == DIRECTORY;
+		BOOL valid = meta->filename[0] != 0 && meta->filename[0] != FILE_DELETED;
+		free(meta);
+		if(!valid) {
+			continue;
+		}
+
+		if(item.kind == DEFRAG_CONTENTS && directory) {
+			defragQueueContents(item.blockNumber);
+		} else if(item.kind == DEFRAG_DIRECTORY && directory) {
+			moved += relocateDirectory(item.blockNumber);
+
+			// Queue the children only now, relocating moved their entries
+			meta = getMetadata(item.blockNumber);
+			defragQueueContents(meta->blockNumber);
+			free(meta);
+		} else if(item.kind == DEFRAG_FILE && !directory) {
+			moved += relocateFile(item.blockNumber);
+		}
+	}
+	return moved;
+}
+
+void defrag(char * filename, int budget) {
+	if(filename == NULL || *filename == '\0' || !strcmp(filename, ".")) {
+		// Everything under the current directory
+		defragPush(currentDirBlockStack[currentDirBlock], DEFRAG_CONTENTS);
+	} else {
+		// A file of that name first, then a directory other than '.' and '..'
+		int previous;
+		int next = filename[0] != DIRECTORY ? findEntry(currentDirBlockStack[currentDirBlock], filename, &previous) : -1;
+		if(next >= 0) {
+			defragPush(next, DEFRAG_FILE);
+		} else if((next = findSubdirectory(currentDirBlockStack[currentDirBlock], filename, &previous)) >= 0) {
+			struct Metadata * meta = getMetadata(next);
+			BOOL link = (meta->fileAttrib & SUBDIRECTORY) != 0;
+			free(meta);
+			if(link) {
+				next = -1;
+			} else {
+				defragPush(next, DEFRAG_DIRECTORY);
+			}
+		}
+
+		if(next < 0) {
+			printf("Cannot find file with provided name.\n");
+			return;
+		}
+	}
+
+	defragBudget = budget;
+	if(budget > 0) {
+		printf("Defragmenting between commands, %d pages at a time.\n", budget);
+	} else {
+		printf("Relocated %d pages.\n", defragStep(0));
+	}
+}
+/**
+ * TRUE if any page of a file chain is referenced from more than one place
+ */
+BOOL chainShared(int blockNumber) {
+	int count = 0;
+	while(blockNumber > 0 && count++ < DATA_BLOCKS) {
+		if(allocTable[blockNumber - FIRST_DATA_BLOCK] > 1) {
+			return TRUE;
+		}
+		blockNumber = chainNext(blockNumber);
+	}
+	return FALSE;
+}
+
+/**
+ * Copies a data page. The copy takes its own reference to the rest of the
+ * chain. Returns the copy or -1 when the image is full.
+ */
+int copyPage(int blockNumber) {
+	int copy = createBlock();
+	if(copy < 0) {
+		return -1;
+	}
+
+	struct Block * block = (struct Block *)getBlock(blockNumber);
+	if(NEXT_PAGE(block->nextBlockNumber) > 0) {
+		int next = sharePage(NEXT_PAGE(block->nextBlockNumber));
+		if(next < 0) {
+			invalidateBlock(copy);
+			free(block);
+			return -1;
+		}
+		block->nextBlockNumber = MAKE_NEXT(next, HOLES_AFTER(block->nextBlockNumber), 0);
+	}
+	saveBlock(block, copy);
+	free(block);
+
+	STAT_INC(STAT_PAGES_COPIED);
+	return copy;
+}
+
+/**
+ * Takes another reference to a data chain. The pages are shared until one
+ * side writes to them; a page already referenced MAX_REFERENCES times is
+ * copied instead. Returns the page to refer to or -1 when the image is full.
+ */
+int sharePage(int blockNumber) {
+	if(allocTable[blockNumber - FIRST_DATA_BLOCK] < MAX_REFERENCES) {
+		allocTable[blockNumber - FIRST_DATA_BLOCK]++;
+		return blockNumber;
+	}
+	return copyPage(blockNumber);
+}
+
+/**
+ * Makes a data page private before it is written. A shared page is copied
+ * and the copy returned, the caller relinks it. Returns -1 when the image
+ * is full.
+ */
+int cowPage(int blockNumber) {
+	if(allocTable[blockNumber - FIRST_DATA_BLOCK] <= 1) {
+		return blockNumber;
+	}
+
+	int copy = copyPage(blockNumber);
+	if(copy >= 0) {
+		allocTable[blockNumber - FIRST_DATA_BLOCK]--;
+	}
+	return copy;
+}
+
+/**
+ * Drops whatever a directory entry refers to: a directory's pages or a
+ * file's data chain
+ */
+void releaseEntry(struct Metadata * entry) {
+	if(entry->filename[0] == DIRECTORY) {
+		releaseDirectory(entry->blockNumber);
+	} else if(!(entry->fileAttrib & INLINE_DATA)) {
+		freeChain(entry->blockNumber, FALSE);
+	}
+}
+
+/**
+ * Drops a directory's entry pages along with everything they refer to
+ */
+void releaseDirectory(int blockNumber) {
+	struct Metadata * meta = NULL;
+	int count = 0;
+	while(blockNumber > 0 && count++ < DATA_BLOCKS) {
+		meta = getMetadata(blockNumber);
+		if(!(meta->fileAttrib & SUBDIRECTORY)) {
+			releaseEntry(meta);
+		}
+		invalidateBlock(blockNumber);
+
+		blockNumber = meta->nextBlockNumber;
+		free(meta);
+	}
+}
+
+/**
+ * Points a copied entry at its own copy of a directory, or at a shared
+ * reference to a file's data. Returns FALSE when the image is full.
+ */
+BOOL copyEntry(struct Metadata * entry, int parentBlock, int depth) {
+	if(entry->filename[0] == DIRECTORY) {
+		int copy = depth + 1 < MAX_DIRECTORY_DEPTH ? copyDirectory(entry->blockNumber, parentBlock, depth + 1) : -1;
+		if(copy < 0) {
+			return FALSE;
+		}
+		entry->blockNumber = copy;
+	} else if(!(entry->fileAttrib & INLINE_DATA) && entry->blockNumber > 0) {
+		int shared = sharePage(entry->blockNumber);
+		if(shared < 0) {
+			return FALSE;
+		}
+		entry->blockNumber = shared;
+	}
+	return TRUE;
+}
+
+/**
+ * Copies a directory's entry pages, recursively, while the file data is
+ * only shared. Snapshot entries are left out. parentBlock is the '.' page
+ * the copy's '..' points at, -1 for a copy of the root.
+ * Returns the new '.' page or -1 when the image is full.
+ */
+int copyDirectory(int dotBlock, int parentBlock, int depth) {
+	struct Metadata * meta = NULL;
+	struct Metadata * last = NULL;
+	int first = -1, lastBlock = -1, entries = 0;
+	int next = dotBlock;
+	do {
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		next = meta->nextBlockNumber;
+
+		// Snapshots are never copied into other snapshots
+		if(meta->fileAttrib & SNAPSHOT) {
+			free(meta);
+			continue;
+		}
+
+		int blockNumber = createBlock();
+		BOOL copied = blockNumber >= 0;
+		if(copied && first < 0) {
+			// The '.' entry points at itself
+			first = blockNumber;
+			meta->blockNumber = first;
+		} else if(copied && (meta->fileAttrib & SUBDIRECTORY)) {
+			meta->blockNumber = parentBlock < 0 ? first : parentBlock;
+		} else if(copied) {
+			copied = copyEntry(meta, first, depth);
+			entries++;
+		}
+
+		if(!copied) {
+			invalidateBlock(blockNumber);
+			free(meta);
+			if(last != NULL) {
+				saveBlock(last, lastBlock);
+				free(last);
+				releaseDirectory(first);
+			}
+			return -1;
+		}
+
+		// Link the previous copy to this one now that its page is known
+		meta->nextBlockNumber = -1;
+		if(last != NULL) {
+			last->nextBlockNumber = blockNumber;
+			saveBlock(last, lastBlock);
+			free(last);
+		}
+		last = meta;
+		lastBlock = blockNumber;
+	} while(next != -1);
+	saveBlock(last, lastBlock);
+	free(last);
+
+	meta = getMetadata(first);
+	meta->dir.tailBlock = lastBlock;
+	meta->dir.entries = entries;
+	saveBlock(meta, first);
+	free(meta);
+	return first;
+}
+
+/**
+ * Finds a snapshot in the root by name, returns its entry page or -1
+ */
+int findSnapshot(char * name) {
+	struct Metadata * meta = NULL;
+	int next = ROOT_BLOCK;
+	STAT_INC(STAT_LOOKUPS);
+	do {
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		if((meta->fileAttrib & SNAPSHOT) && !strcmp(meta->filename + 1, name)) {
+			free(meta);
+			return next;
+		}
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+	return -1;
+}
+
+/**
+ * Records the whole tree under name in the root. Only the directory pages
+ * are copied, file data is shared until it is next written.
+ */
+void snapshot(char * name) {
+	if(*name == '\0' || !strcmp(name, ".") || !strcmp(name, "..")) {
+		printf("Invalid snapshot name.\n");
+		return;
+	}
+
+	// Snapshots live in the root next to ordinary directories
+	struct Metadata * meta = NULL;
+	int next = ROOT_BLOCK;
+	STAT_INC(STAT_LOOKUPS);
+	do {
+		meta = getMetadata(next);
+		STAT_INC(STAT_DIRENTS_SCANNED);
+		if(meta->filename[0] == DIRECTORY && !strcmp(meta->filename + 1, name)) {
+			printf("Directory already exists.\n");
+			free(meta);
+			return;
+		}
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+
+	struct Metadata entry;
+	memset(&entry, 0, sizeof (struct Metadata));
+	strncpy(entry.filename, name, MAX_FILENAME_SIZE - 1);
+	setDirectory(&entry);
+	entry.fileAttrib |= SNAPSHOT;
+
+	int copy = copyDirectory(ROOT_BLOCK, -1, 0);
+	if(copy < 0) {
+		printf("Could not create snapshot. Not enough space.\n");
+		return;
+	}
+	entry.blockNumber = copy;
+	if(addEntry(ROOT_BLOCK, &entry) < 0) {
+		releaseDirectory(entry.blockNumber);
+		printf("Could not create snapshot. Not enough space.\n");
+	}
+}
+
+/**
+ * Replaces everything in the root except the snapshots with a copy of the
+ * named snapshot
+ */
+void rollback(char * name) {
+	int snapshotBlock = findSnapshot(name);
+	if(snapshotBlock < 0) {
+		printf("Cannot find snapshot with provided name.\n");
+		return;
+	}
+
+	// Copy first, so running out of space leaves the live tree alone
+	struct Metadata * meta = getMetadata(snapshotBlock);
+	int copy = copyDirectory(meta->blockNumber, -1, 0);
+	free(meta);
+	if(copy < 0) {
+		printf("Could not roll back. Not enough space.\n");
+		return;
+	}
+
+	// Drop the live entries
+	int previous = ROOT_BLOCK;
+	int next = ROOT_BLOCK;
+	do {
+		meta = getMetadata(next);
+		int following = meta->nextBlockNumber;
+		if(meta->fileAttrib & (SUBDIRECTORY | SNAPSHOT)) {
+			previous = next;
+		} else {
+			releaseEntry(meta);
+			removeEntry(ROOT_BLOCK, previous, next);
+		}
+		next = following;
+		free(meta);
+	} while(next != -1);
+
+	// Move the copied entries into the root, past the copy's '.' and '..'
+	struct Metadata * dot = getMetadata(copy);
+	struct Metadata * dotdot = getMetadata(dot->nextBlockNumber);
+	int first = dotdot->nextBlockNumber;
+	invalidateBlock(dot->nextBlockNumber);
+	invalidateBlock(copy);
+
+	if(first != -1) {
+		// Subdirectories point back at the copy's '.' page through their '..' entry
+		next = first;
+		do {
+			meta = getMetadata(next);
+			if(meta->filename[0] == DIRECTORY) {
+				struct Metadata * child = getMetadata(meta->blockNumber);
+				struct Metadata * parent = getMetadata(child->nextBlockNumber);
+				parent->blockNumber = ROOT_BLOCK;
+				saveBlock(parent, child->nextBlockNumber);
+				free(parent);
+				free(child);
+			}
+			next = meta->nextBlockNumber;
+			free(meta);
+		} while(next != -1);
+
+		struct Metadata * root = getMetadata(ROOT_BLOCK);
+		struct Metadata * tail = getMetadata(root->dir.tailBlock);
+		tail->nextBlockNumber = first;
+		saveBlock(tail, root->dir.tailBlock);
+		free(tail);
+
+		root->dir.tailBlock = dot->dir.tailBlock;
+		root->dir.entries += dot->dir.entries;
+		// The copy's '.' and '..' pages are gone, the rest of its totals move over
+		root->dir.bytes += dot->dir.bytes;
+		root->dir.pages += dot->dir.pages - 2;
+		saveBlock(root, ROOT_BLOCK);
+		free(root);
+	}
+	free(dotdot);
+	free(dot);
+
+	// Whatever the user was looking at may be gone
+	while(currentDirBlock > 0) {
+		currentDirBlockStack[currentDirBlock--] = -1;
+	}
+	readOnlyDepth = -1;
+	defragPending = 0;
+}
+/**
+ * Pages referenced by a directory tree, counting a shared page once per
+ * reference. This is what the tree would take without any sharing.
+ */
+long logicalPages(int blockNumber, int depth) {
+	struct Metadata * meta = NULL;
+	long pages = 0;
+	int next = blockNumber;
+	do {
+		meta = getMetadata(next);
+		pages++;
+
+		if(meta->filename[0] == DIRECTORY) {
+			if(!(meta->fileAttrib & SUBDIRECTORY) && depth + 1 < MAX_DIRECTORY_DEPTH) {
+				pages += logicalPages(meta->blockNumber, depth + 1);
+			}
+		} else if(!(meta->fileAttrib & INLINE_DATA)) {
+			int count;
+			chainExtents(meta->blockNumber, FALSE, &count, NULL);
+			pages += count;
+		}
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+	return pages;
+}
+
+/*  XXH64 primes   */
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long xxhRound(unsigned long long acc, unsigned long long input) {
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static unsigned long long xxhMerge(unsigned long long acc, unsigned long long value) {
+	acc ^= xxhRound(0, value);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * XXH64 (seed 0) of a whole page. PAGE_SIZE is a multiple of the 32 byte
+ * stripe, so there is no tail to mix in.
+ */
+unsigned long long hashPage(void * page) {
+	unsigned long long v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0, v4 = -PRIME64_1;
+	unsigned long long lane[4];
+	char * p = (char *)page;
+	int i;
+	for(i = 0; i < PAGE_SIZE; i += sizeof (lane)) {
+		memcpy(lane, p + i, sizeof (lane));
+		v1 = xxhRound(v1, lane[0]);
+		v2 = xxhRound(v2, lane[1]);
+		v3 = xxhRound(v3, lane[2]);
+		v4 = xxhRound(v4, lane[3]);
+	}
+
+	unsigned long long h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+	h = xxhMerge(h, v1);
+	h = xxhMerge(h, v2);
+	h = xxhMerge(h, v3);
+	h = xxhMerge(h, v4);
+	h += PAGE_SIZE;
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Adds a data page to the dedup index
+ */
+void dedupInsert(int blockNumber, unsigned long long hash) {
+	int index = blockNumber - FIRST_DATA_BLOCK;
+	if(dedupBuckets == NULL || index < 0 || index >= DATA_BLOCKS || dedupNext[index] != DEDUP_UNINDEXED) {
+		return;
+	}
+
+	int bucket = hash & (DEDUP_BUCKETS - 1);
+	dedupHashes[index] = hash;
+	dedupNext[index] = dedupBuckets[bucket];
+	dedupBuckets[bucket] = index;
+}
+
+/**
+ * Drops a page from the dedup index, used when it is rewritten or freed
+ */
+void dedupForget(int blockNumber) {
+	int index = blockNumber - FIRST_DATA_BLOCK;
+	if(dedupBuckets == NULL || index < 0 || index >= DATA_BLOCKS || dedupNext[index] == DEDUP_UNINDEXED) {
+		return;
+	}
+
+	int * link = &dedupBuckets[dedupHashes[index] & (DEDUP_BUCKETS - 1)];
+	while(*link != -1 && *link != index) {
+		link = &dedupNext[*link];
+	}
+	if(*link == index) {
+		*link = dedupNext[index];
+	}
+	dedupNext[index] = DEDUP_UNINDEXED;
+}
+
+/**
+ * Finds an indexed page identical to block, returns it or -1
+ */
+int dedupFind(struct Block * block, unsigned long long hash) {
+	if(dedupBuckets == NULL) {
+		return -1;
+	}
+
+	int index = dedupBuckets[hash & (DEDUP_BUCKETS - 1)];
+	while(index != -1) {
+		if(dedupHashes[index] == hash && allocTable[index]) {
+			// Hashes can collide, only identical pages are shared
+			struct Block * candidate = (struct Block *)getBlock(index + FIRST_DATA_BLOCK);
+			BOOL same = !memcmp(candidate, block, PAGE_SIZE);
+			free(candidate);
+			if(same) {
+				return index + FIRST_DATA_BLOCK;
+			}
+		}
+		index = dedupNext[index];
+	}
+	return -1;
+}
+
+/**
+ * Indexes every data page reachable from a directory, run once at startup
+ */
+void dedupIndexTree(int blockNumber, int depth) {
+	struct Metadata * meta = NULL;
+	int next = blockNumber;
+	do {
+		meta = getMetadata(next);
+		if(meta->filename[0] == DIRECTORY) {
+			if(!(meta->fileAttrib & SUBDIRECTORY) && depth + 1 < MAX_DIRECTORY_DEPTH) {
+				dedupIndexTree(meta->blockNumber, depth + 1);
+			}
+		} else if(!(meta->fileAttrib & INLINE_DATA)) {
+			int page = meta->blockNumber, count = 0;
+			while(page >= FIRST_DATA_BLOCK && page < FIRST_DATA_BLOCK + DATA_BLOCKS && count++ < DATA_BLOCKS) {
+				struct Block * block = (struct Block *)getBlock(page);
+				dedupInsert(page, hashPage(block));
+				page = NEXT_PAGE(block->nextBlockNumber);
+				free(block);
+			}
+		}
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+}
+
+/**
+ * TRUE if length bytes of data are all zero. Compares a word at a time,
+ * which the compiler vectorizes.
+ */
+BOOL zeroBlock(char * data, int length) {
+	unsigned long long word, bits = 0;
+	int i;
+	for(i = 0; i + (int)sizeof (word) <= length; i += sizeof (word)) {
+		memcpy(&word, data + i, sizeof (word));
+		bits |= word;
+	}
+	for(; i < length; i++) {
+		bits |= (unsigned char)data[i];
+	}
+	return bits == 0;
+}
+
+/**
+ * TRUE if any block of data after the first is all zero and would be
+ * stored as a hole
+ */
+BOOL hasHoles(int amount, char * data) {
+	int offset;
+	for(offset = MAX_BLOCK_DATA_SIZE; offset < amount; offset += MAX_BLOCK_DATA_SIZE) {
+		int length = amount - offset < MAX_BLOCK_DATA_SIZE ? amount - offset : MAX_BLOCK_DATA_SIZE;
+		if(zeroBlock(data + offset, length)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * Writes data as a new chain, reusing any page whose contents already exist.
+ * The chain is built from its last block backwards so each page's next
+ * pointer is known before it is hashed: files with identical contents (or
+ * identical endings) share their pages. Zero blocks after the first take no
+ * page, the block before them counts them as holes. Returns the first page
+ * or -1 when the image is full.
+ */
+int buildChain(int amount, char * data) {
+	int count = amount > 0 ? (amount + MAX_BLOCK_DATA_SIZE - 1) / MAX_BLOCK_DATA_SIZE : 1;
+	int next = 0, holes = 0;
+	int i;
+	struct Block * block = (struct Block *) malloc(sizeof (struct Block));
+	for(i = count - 1; i >= 0; i--) {
+		int offset = i * MAX_BLOCK_DATA_SIZE;
+		int length = amount - offset < MAX_BLOCK_DATA_SIZE ? amount - offset : MAX_BLOCK_DATA_SIZE;
+		// The entry has no room for a hole count, so the first block is always stored
+		if(i > 0 && holes < MAX_HOLES && zeroBlock(data + offset, length)) {
+			holes++;
+			continue;
+		}
+
+		memset(block, 0, sizeof (struct Block));
+		block->nextBlockNumber = MAKE_NEXT(next, holes, 0);
+		holes = 0;
+		if(length > 0) {
+			memcpy(block->data, data + offset, length);
+		}
+
+		unsigned long long hash = hashPage(block);
+		int page = dedupFind(block, hash);
+		if(page >= 0) {
+			// The shared page already holds a reference to everything after it
+			page = sharePage(page);
+			if(page >= 0) {
+				invalidateBlock(next);
+				STAT_INC(STAT_PAGES_DEDUPED);
+			}
+		} else {
+			page = createBlock();
+			if(page >= 0) {
+				saveBlock(block, page);
+				dedupInsert(page, hash);
+			}
+		}
+
+		if(page < 0) {
+			freeChain(next, FALSE);
+			free(block);
+			return -1;
+		}
+		next = page;
+	}
+	free(block);
+	return next;
+}
+
+/**
+ * writeFS for dedup mode and sparse files: the data goes to a new, possibly
+ * shared or sparse, chain which then replaces the file's old one. file is
+ * the existing entry saved at entryBlock, or NULL to create a new file.
+ * Returns the entry's page or -1 when the image is full.
+ */
+int writeShared(struct Metadata * file, int entryBlock, char * filename, int amount, char * data) {
+	int head = buildChain(amount, data);
+	if(head < 0) {
+		printf("Not enough space.\n");
+		return -1;
+	}
+
+	// Reads of a sparse file need its size to know where a trailing hole ends
+	BOOL sparse = hasHoles(amount, data);
+	int pages;
+	chainExtents(head, FALSE, &pages, NULL);
+
+	if(file != NULL) {
+		int old = file->fileAttrib & INLINE_DATA ? 0 : file->blockNumber;
+		memset(file->inlineData, 0, MAX_INLINE_DATA_SIZE);
+		file->fileAttrib &= ~(INLINE_DATA | SPARSE);
+		file->fileAttrib |= sparse ? SPARSE : 0;
+		file->blockNumber = head;
+		file->fileSize = sizeof(*file) + amount;
+		file->tail.pages = pages;
+		setModifyTime(file);
+		saveBlock(file, entryBlock);
+		freeChain(old, FALSE);
+		return entryBlock;
+	}
+
+	struct Metadata f;
+	memset(&f, 0, sizeof (struct Metadata));
+	strncpy(f.filename, filename, MAX_FILENAME_SIZE - 1);
+	f.blockNumber = head;
+	f.fileAttrib = sparse ? SPARSE : 0;
+	f.fileSize = sizeof(f) + amount;
+	f.tail.pages = pages;
+	setModifyTime(&f);
+	entryBlock = addEntry(currentDirBlockStack[currentDirBlock], &f);
+	if(entryBlock < 0) {
+		freeChain(head, FALSE);
+		printf("Not enough space.\n");
+	}
+	return entryBlock;
+}
+
+/**
+ * Finds (or starts tracking) the access pattern of the file whose entry is
+ * at entryBlock, for a read starting at offset. A read that picks up where
+ * the last one ended, or starts a file from the top, is sequential and gets
+ * a readahead window; any other read turns readahead off for the file.
+ */
+struct ReadStream * readStream(int entryBlock, int offset) {
+	struct ReadStream * stream = &readStreams[0];
+	int i;
+	for(i = 0; i < READ_STREAMS; i++) {
+		if(readStreams[i].entryBlock == entryBlock) {
+			stream = &readStreams[i];
+			break;
+		}
+		if(readStreams[i].lastUse < stream->lastUse) {
+			stream = &readStreams[i];
+		}
+	}
+
+	if(stream->entryBlock != entryBlock) {
+		stream->entryBlock = entryBlock;
+		stream->nextOffset = 0;
+		stream->window = 0;
+		stream->prefetched = 0;
+	}
+	if(offset == 0 || offset == stream->nextOffset) {
+		if(stream->window == 0) {
+			stream->window = READAHEAD_MIN;
+		}
+	} else {
+		stream->window = 0;
+	}
+	stream->lastUse = ++readClock;
+	return stream;
+}
+
+/**
+ * Called with each next pointer a sequential reader follows. When the
+ * pointer's hint says the coming pages are consecutive, prefetches up to a
+ * window of them in one request, once half of the last batch has been
+ * used. The window doubles with every batch.
+ */
+void readahead(struct ReadStream * stream, int next) {
+	int page = NEXT_PAGE(next);
+	int run = RUN_AFTER(next);
+	if(stream->window == 0 || run == 0) {
+		return;
+	}
+
+	int count = run < stream->window ? run : stream->window;
+	int first = page;
+	if(stream->prefetched >= page && stream->prefetched < page + READAHEAD_MAX) {
+		if(stream->prefetched >= page + count / 2) {
+			return;
+		}
+		first = stream->prefetched + 1;
+	}
+
+	storagePrefetch(first, page + count - first);
+	stream->prefetched = page + count - 1;
+	stream->window = stream->window * 2 < READAHEAD_MAX ? stream->window * 2 : READAHEAD_MAX;
+}
+
+/**
+ * Appends one LZ4 sequence: a token, the literals and (unless this is the
+ * last sequence, offset 0) the match. Returns the new output length or -1
+ * if it would not fit in capacity.
+ */
+static int lzSequence(unsigned char * dst, int out, int capacity, unsigned char * literals, int count, int offset, int match) {
+	if(out + 1 + count / 255 + 1 + count + 2 + match / 255 + 1 > capacity) {
+		return -1;
+	}
+
+	int matchCode = offset ? match - LZ_MIN_MATCH : 0;
+	unsigned char * token = dst + out++;
+	*token = (count < 15 ? count : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+
+	// Lengths of 15 or more continue in 255 steps
+	if(count >= 15) {
+		int rest = count - 15;
+		for(; rest >= 255; rest -= 255) {
+			dst[out++] = 255;
+		}
+		dst[out++] = rest;
+	}
+	memcpy(dst + out, literals, count);
+	out += count;
+
+	if(offset == 0) {
+		return out;
+	}
+	dst[out++] = offset & 0xFF;
+	dst[out++] = offset >> 8;
+	if(matchCode >= 15) {
+		int rest = matchCode - 15;
+		for(; rest >= 255; rest -= 255) {
+			dst[out++] = 255;
+		}
+		dst[out++] = rest;
+	}
+	return out;
+}
+
+/**
+ * Compresses src into the LZ4 block format. Returns the compressed length
+ * or -1 if it does not fit in capacity.
+ */
+int lzCompress(unsigned char * src, int length, unsigned char * dst, int capacity) {
+	int table[1 << LZ_HASH_BITS];
+	int anchor = 0, i = 0, out = 0;
+	memset(table, -1, sizeof (table));
+
+	while(i + LZ_MATCH_LIMIT <= length) {
+		unsigned int sequence;
+		memcpy(&sequence, src + i, sizeof (sequence));
+		int hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		int candidate = table[hash];
+		table[hash] = i;
+
+		if(candidate < 0 || i - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + i, LZ_MIN_MATCH)) {
+			i++;
+			continue;
+		}
+
+		int match = LZ_MIN_MATCH;
+		while(i + match < length - LZ_LAST_LITERALS && src[candidate + match] == src[i + match]) {
+			match++;
+		}
+
+		out = lzSequence(dst, out, capacity, src + anchor, i - anchor, i - candidate, match);
+		if(out < 0) {
+			return -1;
+		}
+		i += match;
+		anchor = i;
+	}
+	return lzSequence(dst, out, capacity, src + anchor, length - anchor, 0, 0);
+}
+
+/**
+ * Inflates an LZ4 block. Returns the inflated length or -1 if the input is
+ * corrupt or inflates past capacity.
+ */
+int lzDecompress(unsigned char * src, int length, unsigned char * dst, int capacity) {
+	int in = 0, out = 0;
+	while(in < length) {
+		int token = src[in++];
+
+		int count = token >> 4;
+		if(count == 15) {
+			while(in < length) {
+				count += src[in];
+				if(src[in++] != 255) {
+					break;
+				}
+			}
+		}
+		if(in + count > length || out + count > capacity) {
+			return -1;
+		}
+		memcpy(dst + out, src + in, count);
+		in += count;
+		out += count;
+
+		// The last sequence has no match
+		if(in >= length) {
+			break;
+		}
+
+		if(in + 2 > length) {
+			return -1;
+		}
+		int offset = src[in] | src[in + 1] << 8;
+		in += 2;
+		int match = (token & 15) + LZ_MIN_MATCH;
+		if((token & 15) == 15) {
+			while(in < length) {
+				match += src[in];
+				if(src[in++] != 255) {
+					break;
+				}
+			}
+		}
+		if(offset == 0 || offset > out || out + match > capacity) {
+			return -1;
+		}
+
+		// Byte by byte, a match may overlap the bytes it produces
+		int i;
+		for(i = 0; i < match; i++, out++) {
+			dst[out] = dst[out - offset];
+		}
+	}
+	return out;
+}
+
+/**
+ * Compresses data extent by extent into out, which must hold
+ * COMPRESS_BOUND(amount) bytes. Extents that do not shrink are stored raw.
+ * Returns the bytes written to out.
+ */
+int compressData(char * data, int amount, char * out) {
+	int offset = 0, stored = 0;
+	while(offset < amount) {
+		struct ExtentHeader header;
+		header.logicalSize = amount - offset < EXTENT_DATA_SIZE ? amount - offset : EXTENT_DATA_SIZE;
+
+		unsigned char * body = (unsigned char *)out + stored + sizeof (header);
+		int length = lzCompress((unsigned char *)data + offset, header.logicalSize, body, header.logicalSize - 1);
+		if(length < 0) {
+			memcpy(body, data + offset, header.logicalSize);
+			length = header.logicalSize;
+		}
+		header.storedSize = length;
+
+		memcpy(out + stored, &header, sizeof (header));
+		stored += sizeof (header) + length;
+		offset += header.logicalSize;
+	}
+	return stored;
+}
+
+/**
+ * Copies the next length bytes of a file's data into out, following the
+ * chain as needed (or from the entry for inline data). Returns the bytes
+ * copied, short at the end of the data.
+ */
+int chainRead(struct ChainReader * reader, char * out, int length) {
+	int copied = 0;
+	if(reader->inlineData != NULL) {
+		copied = MAX_INLINE_DATA_SIZE - reader->offset < length ? MAX_INLINE_DATA_SIZE - reader->offset : length;
+		memcpy(out, reader->inlineData + reader->offset, copied);
+		reader->offset += copied;
+		return copied;
+	}
+
+	while(copied < length) {
+		if(reader->offset == MAX_BLOCK_DATA_SIZE) {
+			int next = reader->block->nextBlockNumber;
+			if(reader->stream != NULL) {
+				readahead(reader->stream, next);
+			}
+			free(reader->block);
+			reader->block = NULL;
+			reader->blockNumber = NEXT_PAGE(next);
+			reader->holeBytes = HOLES_AFTER(next) * MAX_BLOCK_DATA_SIZE;
+			reader->offset = 0;
+		}
+		if(reader->holeBytes > 0) {
+			// Holes read back as zeros
+			int count = reader->holeBytes < length - copied ? reader->holeBytes : length - copied;
+			memset(out + copied, 0, count);
+			reader->holeBytes -= count;
+			copied += count;
+			continue;
+		}
+		if(reader->block == NULL) {
+			if(reader->blockNumber <= 0) {
+				break;
+			}
+			reader->block = (struct Block *)getBlock(reader->blockNumber);
+		}
+
+		int count = MAX_BLOCK_DATA_SIZE - reader->offset;
+		if(count > length - copied) {
+			count = length - copied;
+		}
+		memcpy(out + copied, reader->block->data + reader->offset, count);
+		reader->offset += count;
+		copied += count;
+	}
+	return copied;
+}
+
+/**
+ * Prints bytes [start, end) of a compressed file, reading ahead through
+ * the stream its caller looked up. Extents outside the range
+ * are read past without being inflated. text stops each extent at its
+ * first NUL, as cat does.
+ */
+void readCompressed(struct Metadata * file, struct ReadStream * stream, int start, int end, BOOL text) {
+	struct ChainReader reader = {file->blockNumber, 0, NULL, 0, NULL, NULL};
+	reader.stream = stream;
+	int offset = 0;
+	if(file->fileAttrib & INLINE_DATA) {
+		reader.inlineData = file->inlineData;
+	}
+	if(end > INLINE_SIZE(file)) {
+		end = INLINE_SIZE(file);
+	}
+
+	while(offset < end) {
+		struct ExtentHeader header;
+		if(chainRead(&reader, (char *)&header, sizeof (header)) < (int)sizeof (header) || header.logicalSize == 0 ||
+				header.storedSize > EXTENT_DATA_SIZE || chainRead(&reader, (char *)storedExtent, header.storedSize) < header.storedSize) {
+			printf("Compressed data ends early.\n");
+			break;
+		}
+
+		if(offset + header.logicalSize > start) {
+			unsigned char * extent = storedExtent;
+			if(header.storedSize != header.logicalSize) {
+				if(lzDecompress(storedExtent, header.storedSize, extentBuffer, EXTENT_DATA_SIZE) != header.logicalSize) {
+					printf("Compressed extent at offset %d is corrupt.\n", offset);
+					break;
+				}
+				extent = extentBuffer;
+			}
+
+			int from = start > offset ? start - offset : 0;
+			int to = end - offset < header.logicalSize ? end - offset : header.logicalSize;
+			if(text) {
+				printf("%.*s", to - from, extent + from);
+			} else {
+				fwrite(extent + from, 1, to - from, stdout);
+			}
+		}
+		offset += header.logicalSize;
+	}
+	free(reader.block);
+}
+/* End of helper functions */
+
+/* Start of Debugging code*/
+#ifdef DEBUG_MODE
+// Print metadata information
+void printMetadata(struct Metadata meta) {
+	printf("Filename:\t%s\n", meta.filename);
+	printf("Block Number:\t%d\n", meta.blockNumber);
+	printf("Next Block:\t%d\n", meta.nextBlockNumber);
+	printf("Time:\t\t%d\n", meta.lastTimeUpdate);
+	printf("Date:\t\t%d\n", meta.lastDateUpdate);
+	printf("File Attrib:\t%d\n", meta.fileAttrib);
+	printf("File Size:\t%d\n", meta.fileSize);
+	
+	printf("Hour: %d\n", GET_HOUR(meta.lastTimeUpdate));
+	printf("Minute: %d\n", GET_MINUTE(meta.lastTimeUpdate));
+	printf("Second: %d\n", GET_SECOND(meta.lastTimeUpdate));
+	printf("Year: %d\n", GET_YEAR(meta.lastDateUpdate));
+	printf("Month: %d\n", GET_MONTH(meta.lastDateUpdate));
+	printf("Day: %d\n", GET_DAY(meta.lastDateUpdate));
+	printf("\n------\n");
+}
+
+// Print all files in a directory
+void treePrint(struct Metadata metadata) {
+	printMetadata(metadata);
+	struct Metadata * temp = getMetadata(metadata.nextBlockNumber);
+	if(temp != NULL) {
+		treePrint(*temp);
+	}
+	free(temp);
+
+}
+#endif
+/* End of Debugging code */
+
+/**
+ * Get a pointer to block, can be cast to either metadata or block structures
+ */
+void * getBlock(int blockNumber) {
+	if (blockNumber <= 0) {
+		return NULL;
+	}
+
+	STAT_INC(STAT_PAGES_READ);
+	char * block = (char *) malloc(PAGE_SIZE);
+	storageRead(blockNumber, block, FALSE);
+	return (void*)block;
+}
+
+/**
+ * getBlock for a page of directory entries, which the page cache favours
+ */
+struct Metadata * getMetadata(int blockNumber) {
+	if (blockNumber <= 0) {
+		return NULL;
+	}
+
+	STAT_INC(STAT_PAGES_READ);
+	struct Metadata * meta = (struct Metadata *) malloc(PAGE_SIZE);
+	storageRead(blockNumber, meta, TRUE);
+	return meta;
+}
+
+/**
+ * Packed next pointer of a data block, read in place without copying the page
+ */
+int chainLink(int blockNumber) {
+	STAT_INC(STAT_PAGES_READ);
+	struct Block * block = (struct Block *)storagePin(blockNumber, FALSE);
+	int link = block->nextBlockNumber;
+	storageUnpin(blockNumber, FALSE);
+	return link;
+}
+
+/**
+ * Next page of a file chain
+ */
+int chainNext(int blockNumber) {
+	return NEXT_PAGE(chainLink(blockNumber));
+}
+
+/**
+ * Counts the free pages of every allocation group from the allocation table
+ */
+void groupCount() {
+	int i;
+	memset(groupFree, 0, sizeof (groupFree));
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(!allocTable[i]) {
+			groupFree[i / GROUP_BLOCKS]++;
+		}
+	}
+}
+
+/**
+ * Group new pages are allocated in: the current directory's, unless a
+ * caller picked one
+ */
+int allocationGroup() {
+	if(allocGroup >= 0) {
+		return allocGroup;
+	}
+	int dot = currentDirBlockStack[currentDirBlock];
+	return dot >= FIRST_DATA_BLOCK ? GROUP_OF(dot) : 0;
+}
+
+/**
+ * Group for a new directory under parentBlock. Directories in the root go
+ * to the group with the most free pages, deeper ones stay in their
+ * parent's group while it has at least half the average free pages.
+ */
+int directoryGroup(int parentBlock) {
+	int parent = parentBlock >= FIRST_DATA_BLOCK ? GROUP_OF(parentBlock) : 0;
+	int best = parent, total = 0, i;
+	for(i = 0; i < ALLOCATION_GROUPS; i++) {
+		total += groupFree[i];
+		if(groupFree[i] > groupFree[best]) {
+			best = i;
+		}
+	}
+	if(parentBlock != ROOT_BLOCK && groupFree[parent] * ALLOCATION_GROUPS * 2 >= total) {
+		return parent;
+	}
+	return best;
+}
+
+/**
+ * Allocates a page in group, or in the groups after it when it is full.
+ * Returns -1 when the image is full.
+ */
+int createBlockIn(int group) {
+	int g, i;
+	for(g = 0; g < ALLOCATION_GROUPS; g++) {
+		int current = (group + g) % ALLOCATION_GROUPS;
+		if(!groupFree[current]) {
+			continue;
+		}
+		// Only this group's slice of the table is scanned
+		for(i = current * GROUP_BLOCKS; i < (current + 1) * GROUP_BLOCKS; i++) {
+			if (!allocTable[i]) {
+				allocTable[i] = 1;
+				groupFree[current]--;
+				STAT_INC(STAT_BLOCKS_CREATED);
+				return i + FIRST_DATA_BLOCK;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Get the next valid block number
+ */
+int createBlock() {
+	return createBlockIn(allocationGroup());
+}
+
+/**
+ * Allocates count consecutive pages, returns the first one or -1 if there is
+ * no free run that long. The search starts at the current allocation group.
+ */
+int createBlockRun(int count) {
+	int first = allocationGroup() * GROUP_BLOCKS;
+	int i, run = 0;
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		int index = (first + i) % DATA_BLOCKS;
+		// Runs do not wrap around the end of the table
+		run = allocTable[index] ? 0 : index == 0 ? 1 : run + 1;
+		if(run == count) {
+			int start = index - count + 1, j;
+			memset(allocTable + start, 1, count);
+			for(j = start; j <= index; j++) {
+				groupFree[j / GROUP_BLOCKS]--;
+			}
+			STAT_ADD(STAT_BLOCKS_CREATED, count);
+			return start + FIRST_DATA_BLOCK;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Saves a block back to the file system
+ */
+void saveBlock(void * b, int blockNumber) {
+	if(blockNumber > 0) {
+		// The page's contents no longer match what was indexed
+		dedupForget(blockNumber);
+		nameIndexWrite(blockNumber, (struct Metadata *)b);
+
+		// Incremental backups take the pages written since the last one
+		int index = blockNumber - FIRST_DATA_BLOCK;
+		if(index >= 0 && index < DATA_BLOCKS && pageGenerations[index] != generation) {
+			pageGenerations[index] = generation;
+			generationDirty[index * sizeof (unsigned int) / PAGE_SIZE] = TRUE;
+		}
+
+		STAT_INC(STAT_PAGES_WRITTEN);
+		storageWrite(blockNumber, b);
+	}
+}
+
+/**
+ * Drops one reference to a block, allowing it to be overwritten once nothing
+ * refers to it. Returns TRUE if the block is now free.
+ */
+BOOL invalidateBlock(int blockNumber) {
+	blockNumber -= FIRST_DATA_BLOCK;
+	if (blockNumber >= 0 && blockNumber < DATA_BLOCKS && allocTable[blockNumber]) {
+		if(--allocTable[blockNumber] == 0) {
+			groupFree[blockNumber / GROUP_BLOCKS]++;
+			if(discardPending != NULL) {
+				discardPending[blockNumber] = 1;
+			}
+			dedupForget(blockNumber + FIRST_DATA_BLOCK);
+			nameIndexWrite(blockNumber + FIRST_DATA_BLOCK, NULL);
+			STAT_INC(STAT_BLOCKS_FREED);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * Write all changes to the file system to disk
  */
 void syncFilesystem() {
-	memcpy(map, allocTable, ALLOCATION_BITMAP_PAGES * PAGE_SIZE);
-	memcpy(map + ALLOCATION_BITMAP_PAGES * PAGE_SIZE, rootDir->metadata, sizeof (struct Metadata) * ROOT_SECTOR_ENTRIES);
+	int i;
+	for(i = 0; i < ALLOCATION_BITMAP_PAGES; i++) {
+		storageWrite(i, allocTable + i * PAGE_SIZE);
+	}
+	for(i = 0; i < GENERATION_PAGES; i++) {
+		if(generationDirty[i]) {
+			storageWrite(GENERATION_BLOCK + i, (char *)pageGenerations + i * PAGE_SIZE);
+			generationDirty[i] = FALSE;
+		}
+	}
+
+	STAT_TIMER(start);
+	unsigned long bytes = storageFlush();
+	STAT_ELAPSED(STAT_SYNC_NS, start);
+	STAT_INC(STAT_SYNC_CALLS);
+	STAT_ADD(STAT_SYNC_BYTES, bytes);
+	(void)bytes;
+
+	if(discardPending != NULL) {
+		discardReclaimed += discardFree(FALSE, NULL);
+	}
+}
+
+/**
+ * Punches the free pages out of the image on the host. Every free run is
+ * discarded when all is set, otherwise only runs holding a page freed
+ * since the last call, widened to the whole free run around it so the
+ * host blocks it shares with older free pages go too. Returns the host
+ * bytes reclaimed and counts the runs discarded in runs.
+ */
+long discardFree(BOOL all, int * runs) {
+	long before = storageHostBytes();
+	int i, start = -1, count = 0;
+	BOOL pending = FALSE, supported = TRUE;
+	for(i = 0; i <= DATA_BLOCKS && supported; i++) {
+		if(i < DATA_BLOCKS && !allocTable[i]) {
+			if(start < 0) {
+				start = i;
+			}
+			if(discardPending != NULL && discardPending[i]) {
+				discardPending[i] = 0;
+				pending = TRUE;
+			}
+			continue;
+		}
+
+		if(start >= 0 && (all || pending)) {
+			supported = storageDiscard(start + FIRST_DATA_BLOCK, i - start);
+			count++;
+		}
+		start = -1;
+		pending = FALSE;
+	}
+
+	if(!supported) {
+		perror("Could not punch holes in the image");
+		// Pages freed later would fail the same way
+		free(discardPending);
+		discardPending = NULL;
+	}
+	if(runs != NULL) {
+		*runs = count;
+	}
+
+	long after = storageHostBytes();
+	return before > after ? before - after : 0;
+}
+
+/**
+ * Gives every free page back to the host at once
+ */
+void trim() {
+	int runs;
+	long reclaimed = discardFree(TRUE, &runs);
+	printf("Trimmed %d free runs, reclaimed %ld bytes on the host. The image takes %ld bytes.\n",
+		runs, reclaimed, storageHostBytes());
+}
+
+/**
+ * Random identifier for a new image, so backups of different images are
+ * never mixed up
+ */
+unsigned int newImageId() {
+	unsigned int id = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd < 0 || read(fd, &id, sizeof (id)) != sizeof (id)) {
+		id = (unsigned int)time(NULL) ^ (unsigned int)getpid() << 16;
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+	// 0 is what images without an identity have
+	return id != 0 ? id : 1;
+}
+
+/**
+ * Writes the image's identity and the generation writes go to
+ */
+void saveGenerationHeader() {
+	char page[PAGE_SIZE];
+	struct GenerationHeader * header = (struct GenerationHeader *)page;
+	memset(page, 0, PAGE_SIZE);
+	header->magic = GENERATION_MAGIC;
+	header->image = imageId;
+	header->next = generation;
+	STAT_INC(STAT_PAGES_WRITTEN);
+	storageWrite(GENERATION_HEADER_BLOCK, page);
+}
+
+/**
+ * Writes the allocated pages of the image to a backup at hostPath, in page
+ * order and as runs of consecutive pages. Given the backup it follows, only
+ * the pages written since then are taken; the allocation table always is.
+ */
+void backup(char * hostPath, char * basePath) {
+	struct BackupHeader header;
+	unsigned int base = 0;
+	if(basePath != NULL) {
+		FILE * in = fopen(basePath, "rb");
+		if(in == NULL) {
+			perror(basePath);
+			return;
+		}
+		BOOL valid = fread(&header, sizeof (header), 1, in) == 1 && header.magic == BACKUP_MAGIC;
+		fclose(in);
+		if(!valid) {
+			printf("%s is not a backup.\n", basePath);
+			return;
+		}
+		if(header.image != imageId || header.generation >= generation) {
+			printf("%s is not a backup of this image.\n", basePath);
+			return;
+		}
+		base = header.generation;
+	}
+
+	// The count goes in the header, ahead of the pages
+	int i, pages = 0, runs = 0;
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(allocTable[i] && pageGenerations[i] > base) {
+			pages++;
+		}
+	}
 
-	if (msync(map, FILESIZE, MS_SYNC) < 0) {
-		perror("Could not sync filesystem");
+	FILE * out = fopen(hostPath, "wb");
+	if(out == NULL) {
+		perror(hostPath);
+		return;
+	}
+	header.magic = BACKUP_MAGIC;
+	header.image = imageId;
+	header.generation = generation;
+	header.base = base;
+	header.pages = pages;
+	BOOL failed = fwrite(&header, sizeof (header), 1, out) != 1 ||
+		fwrite(allocTable, PAGE_SIZE, ALLOCATION_BITMAP_PAGES, out) != ALLOCATION_BITMAP_PAGES;
+
+	char * chunk = (char *) malloc(BACKUP_CHUNK_PAGES * PAGE_SIZE);
+	for(i = 0; i < DATA_BLOCKS && !failed; ) {
+		if(!allocTable[i] || pageGenerations[i] <= base) {
+			i++;
+			continue;
+		}
+		struct BackupRun run;
+		run.first = i + FIRST_DATA_BLOCK;
+		run.count = 0;
+		while(i + run.count < DATA_BLOCKS && run.count < BACKUP_CHUNK_PAGES &&
+				allocTable[i + run.count] && pageGenerations[i + run.count] > base) {
+			run.count++;
+		}
+
+		// The run is read as one sequential request
+		storagePrefetch(run.first, run.count);
+		int j;
+		for(j = 0; j < run.count; j++) {
+			STAT_INC(STAT_PAGES_READ);
+			storageRead(run.first + j, chunk + j * PAGE_SIZE, FALSE);
+		}
+		failed = fwrite(&run, sizeof (run), 1, out) != 1 ||
+			fwrite(chunk, PAGE_SIZE, run.count, out) != (size_t)run.count;
+		i += run.count;
+		runs++;
+	}
+	free(chunk);
+
+	struct BackupRun end = {0, 0};
+	failed = failed || fwrite(&end, sizeof (end), 1, out) != 1 || fflush(out) != 0 || fsync(fileno(out)) != 0;
+	if(fclose(out) != 0 || failed) {
+		perror(hostPath);
+		remove(hostPath);
+		return;
+	}
+
+	// Whatever is written from now on is newer than this backup, in later sessions too
+	generation++;
+	saveGenerationHeader();
+	storageBarrier();
+	printf("Backed up %d pages in %d runs%s.\n", pages, runs, base > 0 ? " since the previous backup" : "");
+}
+
+/**
+ * Applies one backup of a chain to the pages being restored. last holds
+ * the generation of the backup before it, 0 for the first one.
+ */
+BOOL restoreRead(char * hostPath, struct RestoreMap * map, unsigned int * last) {
+	struct BackupHeader header;
+	struct BackupRun run;
+	FILE * in = fopen(hostPath, "rb");
+	if(in == NULL) {
+		perror(hostPath);
+		return FALSE;
+	}
+	if(fread(&header, sizeof (header), 1, in) != 1 || header.magic != BACKUP_MAGIC) {
+		printf("%s is not a backup.\n", hostPath);
+		fclose(in);
+		return FALSE;
+	}
+	if(*last != 0 && header.image != map->image) {
+		printf("%s is a backup of another image.\n", hostPath);
+		fclose(in);
+		return FALSE;
+	}
+	if(header.base != *last) {
+		printf(*last == 0 ? "%s is incremental, restore the backups before it first.\n" :
+			"%s does not follow the backup before it.\n", hostPath);
+		fclose(in);
+		return FALSE;
+	}
+
+	BOOL valid = fread(map->table, PAGE_SIZE, ALLOCATION_BITMAP_PAGES, in) == ALLOCATION_BITMAP_PAGES;
+	while(valid && (valid = fread(&run, sizeof (run), 1, in) == 1) && run.count > 0) {
+		valid = run.first >= FIRST_DATA_BLOCK && run.count <= DATA_BLOCKS &&
+			run.first + run.count <= FIRST_DATA_BLOCK + DATA_BLOCKS &&
+			fread(map->pages + (run.first - FIRST_DATA_BLOCK) * PAGE_SIZE, PAGE_SIZE, run.count, in) == (size_t)run.count;
+		if(valid) {
+			memset(map->present + run.first - FIRST_DATA_BLOCK, TRUE, run.count);
+		}
+	}
+	fclose(in);
+	if(!valid) {
+		printf("%s is truncated or damaged.\n", hostPath);
+		return FALSE;
+	}
+	*last = header.generation;
+	map->image = header.image;
+	return TRUE;
+}
+
+/**
+ * Gives an old page its place in the restored image, the next free one.
+ * Returns FALSE if it already has one, or when the backups do not have it.
+ */
+BOOL restoreClaim(struct RestoreMap * map, int page, char kind) {
+	int index = page - FIRST_DATA_BLOCK;
+	if(index < 0 || index >= DATA_BLOCKS || !map->table[index] || !map->present[index]) {
+		map->dropped++;
+		return FALSE;
+	}
+	if(map->remap[index] > 0) {
+		// Another chain shares the rest of this one
+		if(map->references[index] < MAX_REFERENCES) {
+			map->references[index]++;
+		}
+		return FALSE;
+	}
+	map->remap[index] = FIRST_DATA_BLOCK + map->used++;
+	map->kinds[index] = kind;
+	map->references[index] = 1;
+	return TRUE;
+}
+
+/**
+ * Lays out a directory: its entry chain, then the data of its files, then
+ * the directories below it. Pages end up grouped by directory and every
+ * chain on consecutive pages.
+ */
+void restoreDirectory(struct RestoreMap * map, int dotBlock, int depth) {
+	if(!restoreClaim(map, dotBlock, RESTORE_DOT)) {
+		return;
+	}
+	struct Metadata * entry = (struct Metadata *)(map->pages + (dotBlock - FIRST_DATA_BLOCK) * PAGE_SIZE);
+	int next = entry->nextBlockNumber, count = 0;
+	while(next != -1 && count++ < DATA_BLOCKS && restoreClaim(map, next, RESTORE_ENTRY)) {
+		next = ((struct Metadata *)(map->pages + (next - FIRST_DATA_BLOCK) * PAGE_SIZE))->nextBlockNumber;
+	}
+
+	int pass;
+	for(pass = 0; pass < 2; pass++) {
+		next = entry->nextBlockNumber;
+		count = 0;
+		while(next >= FIRST_DATA_BLOCK && next < FIRST_DATA_BLOCK + DATA_BLOCKS && count++ < DATA_BLOCKS &&
+				map->kinds[next - FIRST_DATA_BLOCK] == RESTORE_ENTRY) {
+			struct Metadata * item = (struct Metadata *)(map->pages + (next - FIRST_DATA_BLOCK) * PAGE_SIZE);
+			next = item->nextBlockNumber;
+			if(item->fileAttrib & SUBDIRECTORY) {
+				continue;
+			}
+			if(item->filename[0] == DIRECTORY) {
+				if(pass == 1 && depth + 1 < MAX_DIRECTORY_DEPTH) {
+					restoreDirectory(map, item->blockNumber, depth + 1);
+				}
+			} else if(pass == 0 && !(item->fileAttrib & INLINE_DATA) && item->blockNumber > 0) {
+				int page = item->blockNumber;
+				while(page > 0 && restoreClaim(map, page, RESTORE_DATA)) {
+					page = NEXT_PAGE(((struct Block *)(map->pages + (page - FIRST_DATA_BLOCK) * PAGE_SIZE))->nextBlockNumber);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * New page of an old one, 0 if it was not laid out
+ */
+int restoredPage(struct RestoreMap * map, int page) {
+	int index = page - FIRST_DATA_BLOCK;
+	return index >= 0 && index < DATA_BLOCKS ? map->remap[index] : 0;
+}
+
+/**
+ * Lays out the pages of a backup chain again from the root and replaces the
+ * image with them. The image comes back compacted: no free pages between
+ * used ones and every file on consecutive pages. Pages nothing refers to
+ * are left out. Returns the pages restored.
+ */
+int restoreImage(struct RestoreMap * map) {
+	char * images = (char *) malloc(DATA_BLOCKS * PAGE_SIZE);
+	int * runs = (int *) calloc(DATA_BLOCKS + 1, sizeof (int));
+	int i;
+
+	// The root is laid out first, so it stays on ROOT_BLOCK
+	restoreDirectory(map, ROOT_BLOCK, 0);
+
+	// Point every page at the new places of the pages it refers to
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(map->remap[i] == 0) {
+			continue;
+		}
+		char * image = images + (map->remap[i] - FIRST_DATA_BLOCK) * PAGE_SIZE;
+		memcpy(image, map->pages + i * PAGE_SIZE, PAGE_SIZE);
+		struct Metadata * entry = (struct Metadata *)image;
+		if(map->kinds[i] == RESTORE_DATA) {
+			struct Block * block = (struct Block *)image;
+			int next = NEXT_PAGE(block->nextBlockNumber);
+			block->nextBlockNumber = MAKE_NEXT(next > 0 ? restoredPage(map, next) : 0, HOLES_AFTER(block->nextBlockNumber), 0);
+			continue;
+		}
+		// A chain that runs into a page the backups lack ends there
+		int next = entry->nextBlockNumber == -1 ? 0 : restoredPage(map, entry->nextBlockNumber);
+		entry->nextBlockNumber = next > 0 ? next : -1;
+		if(map->kinds[i] == RESTORE_DOT) {
+			entry->blockNumber = restoredPage(map, entry->blockNumber);
+			// An unknown tail is found again by the next addEntry
+			entry->dir.tailBlock = restoredPage(map, entry->dir.tailBlock);
+		} else if((entry->fileAttrib & SUBDIRECTORY) || entry->filename[0] == DIRECTORY) {
+			entry->blockNumber = restoredPage(map, entry->blockNumber);
+		} else if(!(entry->fileAttrib & INLINE_DATA) && entry->blockNumber > 0) {
+			entry->blockNumber = restoredPage(map, entry->blockNumber);
+			entry->tail.block = restoredPage(map, entry->tail.block);
+		}
+	}
+
+	// Readahead hints: how many pages of a chain sit at consecutive pages from each one
+	for(i = map->used - 1; i >= 0; i--) {
+		struct Block * block = (struct Block *)(images + i * PAGE_SIZE);
+		runs[i] = 1;
+		if(i + 1 < map->used && NEXT_PAGE(block->nextBlockNumber) == FIRST_DATA_BLOCK + i + 1) {
+			runs[i] += runs[i + 1];
+		}
 	}
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(map->kinds[i] == RESTORE_DATA) {
+			struct Block * block = (struct Block *)(images + (map->remap[i] - FIRST_DATA_BLOCK) * PAGE_SIZE);
+			int next = NEXT_PAGE(block->nextBlockNumber);
+			if(next > 0) {
+				block->nextBlockNumber = MAKE_NEXT(next, HOLES_AFTER(block->nextBlockNumber), runs[next - FIRST_DATA_BLOCK]);
+			}
+		}
+	}
+
+	// The image is replaced in one pass, front to back
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(i >= map->used && allocTable[i] && discardPending != NULL) {
+			discardPending[i] = 1;
+		}
+		allocTable[i] = 0;
+		if(i < map->used) {
+			saveBlock(images + i * PAGE_SIZE, FIRST_DATA_BLOCK + i);
+		}
+	}
+	for(i = 0; i < DATA_BLOCKS; i++) {
+		if(map->remap[i] > 0) {
+			allocTable[map->remap[i] - FIRST_DATA_BLOCK] = map->references[i];
+		}
+	}
+	groupCount();
+
+	// Nothing kept about the old image applies to the new one
+	currentDirBlock = 0;
+	currentDirBlockStack[0] = ROOT_BLOCK;
+	readOnlyDepth = -1;
+	defragPending = 0;
+	memset(readStreams, 0, sizeof (readStreams));
+	nameIndexReset();
+	if(dedupMode) {
+		memset(dedupBuckets, -1, DEDUP_BUCKETS * sizeof (int));
+		for(i = 0; i < DATA_BLOCKS; i++) {
+			dedupNext[i] = DEDUP_UNINDEXED;
+		}
+		dedupIndexTree(ROOT_BLOCK, 0);
+	}
+
+	free(images);
+	free(runs);
+	return map->used;
+}
+
+/**
+ * Rebuilds the whole image from a full backup and the incremental ones
+ * taken after it, in order
+ */
+void restore(char ** paths, int count) {
+	struct RestoreMap map;
+	memset(&map, 0, sizeof (map));
+	map.table = (unsigned char *) malloc(ALLOCATION_BITMAP_PAGES * PAGE_SIZE);
+	map.pages = (char *) malloc(DATA_BLOCKS * PAGE_SIZE);
+	map.present = (BOOL *) calloc(DATA_BLOCKS, sizeof (BOOL));
+	map.remap = (int *) calloc(DATA_BLOCKS, sizeof (int));
+	map.kinds = (char *) calloc(DATA_BLOCKS, sizeof (char));
+	map.references = (unsigned char *) calloc(DATA_BLOCKS, sizeof (unsigned char));
+
+	// Nothing is touched unless every backup of the chain reads back whole
+	unsigned int last = 0;
+	BOOL valid = TRUE;
+	int i;
+	for(i = 0; i < count && valid; i++) {
+		valid = restoreRead(paths[i], &map, &last);
+	}
+	if(valid && (!map.table[ROOT_BLOCK - FIRST_DATA_BLOCK] || !map.present[ROOT_BLOCK - FIRST_DATA_BLOCK])) {
+		printf("The backups hold no root directory.\n");
+		valid = FALSE;
+	}
+
+	if(valid) {
+		// Restored pages count as written after every backup of the chain, and
+		// the image takes the chain's identity so later backups can build on it
+		if(generation <= last) {
+			generation = last + 1;
+		}
+		imageId = map.image;
+		int pages = restoreImage(&map);
+		saveGenerationHeader();
+		printf("Restored %d pages from %d backup%s.", pages, count, count > 1 ? "s" : "");
+		if(map.dropped > 0) {
+			printf(" Dropped %d references to pages missing from the backups.", map.dropped);
+		}
+		printf("\n");
+	}
+
+	free(map.table);
+	free(map.pages);
+	free(map.present);
+	free(map.remap);
+	free(map.kinds);
+	free(map.references);
 }
 
 /**
@@ -862,64 +4405,420 @@ void setDirectory(struct Metadata * metadata) {
 	setModifyTime(metadata);
 }
 
-/**
- * Set metadata to be a file and attach a block to it
- */
-void setFile(struct Metadata * metadata) {
-	metadata->blockNumber = createBlock();
-	// Set page size to metadata + first block size
-	metadata->fileSize = sizeof(*metadata) + PAGE_SIZE;
-	metadata->nextBlockNumber = -1;
-	metadata->fileAttrib = 0;
-	
-	setModifyTime(metadata);
+/**
+ * Set metadata to be a file and attach a block to it
+ */
+void setFile(struct Metadata * metadata) {
+	int blockNumber = createBlock();
+	metadata->blockNumber = blockNumber < 0 ? 0 : blockNumber;
+	// Set page size to metadata + first block size
+	metadata->fileSize = sizeof(*metadata) + PAGE_SIZE;
+	metadata->nextBlockNumber = -1;
+	metadata->fileAttrib = 0;
+	metadata->tail.pages = 1;
+	
+	setModifyTime(metadata);
+
+	// Initialize block
+	struct Block * block = (struct Block *) malloc(sizeof (struct Block));
+	memset((char*)block, 0, sizeof (struct Block));
+	saveBlock(block, metadata->blockNumber);
+	free(block);
+}
+
+/**
+ * Store a small file's contents in its own entry instead of a data block
+ */
+void setInlineData(struct Metadata * metadata, int amount, char * data) {
+	memset(metadata->inlineData, 0, MAX_INLINE_DATA_SIZE);
+	memcpy(metadata->inlineData, data, amount);
+
+	metadata->fileAttrib &= ~SPARSE;
+	metadata->fileAttrib |= INLINE_DATA;
+	metadata->blockNumber = 0;
+	// The entry is the only page, so ls reports just the data size
+	metadata->fileSize = sizeof(*metadata) + amount;
+
+	setModifyTime(metadata);
+}
+
+/**
+ * Used to create a new directory
+ * i.e. - Once a directory file is created call this method to create the . and ..
+ * links which are instantly written to disk and linked up. Passing NULL creates
+ * the root, whose '..' points back at itself. Returns the '.' page or -1 when
+ * the image is full.
+ */
+int createDirectoryStruct(struct Metadata * parentDir) {
+	struct Metadata * meta = (struct Metadata *)malloc(sizeof (struct Metadata) * 2);
+	memset(meta, 0, sizeof (struct Metadata) * 2);
+
+	// Create . block
+	meta[0].filename[0] = '.';
+	setDirectory(&meta[0]);
+	meta[0].fileAttrib |= SUBDIRECTORY;
+	
+	// Create .. block
+	strcpy(meta[1].filename, "..\0");
+	setDirectory(&meta[1]);
+	meta[1].fileAttrib |= SUBDIRECTORY;
+	meta[1].nextBlockNumber = -1;
+
+	// The new directory's pages, and later its files, go to a group picked for it
+	int group = directoryGroup(parentDir != NULL ? parentDir->blockNumber : -1);
+	int block = createBlockIn(group);
+	int block2 = createBlockIn(group);
+	if(block < 0 || block2 < 0) {
+		invalidateBlock(block);
+		invalidateBlock(block2);
+		free(meta);
+		return -1;
+	}
+
+	meta[0].blockNumber     = block;
+	meta[0].nextBlockNumber = block2;
+	meta[0].dir.tailBlock   = block2;
+	meta[0].dir.entries     = 0;
+	meta[0].dir.pages       = 2;
+	meta[1].blockNumber     = parentDir != NULL ? parentDir->blockNumber : block;
+
+	saveBlock(&meta[0], block);
+	saveBlock(&meta[1], block2);
+
+	if(parentDir != NULL) {
+		parentDir->blockNumber = block;
+	}
+
+	free(meta);
+	return block;
+}
+
+/**
+ * '.' page of the directory above the one at dotBlock, -1 for the root
+ */
+int parentDirectory(int dotBlock) {
+	if(dotBlock == ROOT_BLOCK) {
+		return -1;
+	}
+	struct Metadata * dot = getMetadata(dotBlock);
+	struct Metadata * parent = getMetadata(dot->nextBlockNumber);
+	int parentBlock = parent->blockNumber;
+	free(parent);
+	free(dot);
+	// The top of a snapshot points at itself
+	return parentBlock != dotBlock ? parentBlock : -1;
+}
+
+/**
+ * What an entry adds to the totals of its directory: its own page, plus a
+ * file's data or a subdirectory's totals. Snapshots add nothing.
+ */
+void entryUsage(struct Metadata * entry, long * bytes, int * pages) {
+	*bytes = 0;
+	*pages = 0;
+	if(entry->fileAttrib & (SNAPSHOT | SUBDIRECTORY)) {
+		return;
+	}
+
+	*pages = 1;
+	if(entry->filename[0] == DIRECTORY) {
+		struct Metadata * dot = getMetadata(entry->blockNumber);
+		*bytes = dot->dir.bytes;
+		*pages += dot->dir.pages;
+		free(dot);
+	} else {
+		*bytes = entry->fileSize - sizeof(*entry);
+		if(!(entry->fileAttrib & INLINE_DATA)) {
+			*pages += entry->tail.pages;
+		}
+	}
+}
+
+/**
+ * Adds to the totals of a directory and of every directory above it
+ */
+void accountUsage(int dirBlock, long bytes, int pages) {
+	if(bytes == 0 && pages == 0) {
+		return;
+	}
+
+	// The current directory's ancestors are on the stack, others are found through '..'
+	int level = dirBlock == currentDirBlockStack[currentDirBlock] ? currentDirBlock : -1;
+	int steps = 0;
+	while(dirBlock > 0 && steps++ < MAX_DIRECTORY_DEPTH) {
+		struct Metadata * dot = getMetadata(dirBlock);
+		dot->dir.bytes += bytes;
+		dot->dir.pages += pages;
+		saveBlock(dot, dirBlock);
+		free(dot);
+
+		// The last step goes through '..', since the top of a snapshot stops there
+		if(level > 1) {
+			dirBlock = currentDirBlockStack[--level];
+		} else {
+			level = -1;
+			dirBlock = parentDirectory(dirBlock);
+		}
+	}
+}
+
+/**
+ * Whether bytes more data fit the quotas of a directory and of those above
+ * it. Directories that also hold fromBlock (-1 for none), which a move
+ * leaves unchanged, are not checked.
+ */
+BOOL quotaAllows(int dirBlock, long bytes, int fromBlock) {
+	if(bytes <= 0) {
+		return TRUE;
+	}
+
+	int ancestors[MAX_DIRECTORY_DEPTH];
+	int count = 0, i, steps = 0;
+	while(fromBlock > 0 && count < MAX_DIRECTORY_DEPTH) {
+		ancestors[count++] = fromBlock;
+		fromBlock = parentDirectory(fromBlock);
+	}
+
+	while(dirBlock > 0 && steps++ < MAX_DIRECTORY_DEPTH) {
+		for(i = 0; i < count; i++) {
+			if(ancestors[i] == dirBlock) {
+				return TRUE;
+			}
+		}
+
+		struct Metadata * dot = getMetadata(dirBlock);
+		BOOL over = dot->dir.quota > 0 && dot->dir.bytes + bytes > dot->dir.quota;
+		free(dot);
+		if(over) {
+			return FALSE;
+		}
+		dirBlock = parentDirectory(dirBlock);
+	}
+	return TRUE;
+}
+
+/**
+ * Recomputes the totals of a directory and everything below it, along with
+ * the page count of every file. Returns the number of pages repaired.
+ */
+int rebuildUsage(int dotBlock, int depth) {
+	struct Metadata * meta = NULL;
+	long bytes = 0, entryBytes;
+	int pages = 0, entryPages, repaired = 0;
+	int next = dotBlock;
+	do {
+		meta = getMetadata(next);
+		if(meta->filename[0] == DIRECTORY && !(meta->fileAttrib & SUBDIRECTORY)) {
+			// Subdirectories first, so their totals are right when they are added
+			if(depth + 1 < MAX_DIRECTORY_DEPTH) {
+				repaired += rebuildUsage(meta->blockNumber, depth + 1);
+			}
+		} else if(meta->filename[0] != DIRECTORY && !(meta->fileAttrib & INLINE_DATA)) {
+			int count;
+			chainExtents(meta->blockNumber, FALSE, &count, NULL);
+			if(meta->tail.pages != count) {
+				meta->tail.pages = count;
+				saveBlock(meta, next);
+				repaired++;
+			}
+		}
+
+		// '.' and '..' are pages of the directory itself
+		entryUsage(meta, &entryBytes, &entryPages);
+		bytes += entryBytes;
+		pages += meta->fileAttrib & SUBDIRECTORY ? 1 : entryPages;
+
+		next = meta->nextBlockNumber;
+		free(meta);
+	} while(next != -1);
+
+	meta = getMetadata(dotBlock);
+	if(meta->dir.bytes != bytes || meta->dir.pages != pages) {
+		meta->dir.bytes = bytes;
+		meta->dir.pages = pages;
+		saveBlock(meta, dotBlock);
+		repaired++;
+	}
+	free(meta);
+	return repaired;
+}
+
+/**
+ * Prints the path of every entry below a directory whose name matches a
+ * pattern
+ */
+void find(char * path, char * pattern) {
+	BOOL readOnly;
+	int dirBlock = resolveDirectory(path, &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(strlen(pattern) >= MAX_FILENAME_SIZE) {
+		printf("Pattern too long.\n");
+		return;
+	}
+	findTree(dirBlock, path, pattern);
+}
+
+/**
+ * Prints the totals kept for a directory, without walking it
+ */
+void du(char * path) {
+	BOOL readOnly;
+	int dirBlock = resolveDirectory(*path != '\0' ? path : ".", &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+
+	struct Metadata * dot = getMetadata(dirBlock);
+	printf("%u bytes in %d pages", dot->dir.bytes, dot->dir.pages);
+	if(dot->dir.quota > 0) {
+		printf(", quota %u bytes", dot->dir.quota);
+	}
+	printf("\n");
+	free(dot);
+}
+
+/**
+ * Limits the bytes of file data below a directory, 0 removes the limit. A
+ * quota below what is already there only stops further growth.
+ */
+void quota(char * path, unsigned int bytes) {
+	BOOL readOnly;
+	int dirBlock = resolveDirectory(path, &readOnly);
+	if(dirBlock < 0) {
+		printf("No such directory\n");
+		return;
+	}
+	if(readOnly) {
+		printf("Snapshots are read-only.\n");
+		return;
+	}
+
+	struct Metadata * dot = getMetadata(dirBlock);
+	dot->dir.quota = bytes;
+	saveBlock(dot, dirBlock);
+	free(dot);
+}
+
+/**
+ * Saves an entry to a new page and links it at the tail of a directory,
+ * returns the page or -1 when the image is full
+ */
+int addEntry(int dirBlock, struct Metadata * entry) {
+	return addEntries(dirBlock, entry, 1);
+}
+
+/**
+ * Saves count entries to new pages linked one after the other, then links
+ * them at the tail of a directory with a single update of its '.' entry.
+ * Returns the first page, or -1 with nothing linked when the image is full.
+ */
+int addEntries(int dirBlock, struct Metadata * entries, int count) {
+	int * blocks = (int *) malloc(count * sizeof (int));
+	int i;
+	for(i = 0; i < count; i++) {
+		blocks[i] = createBlockIn(GROUP_OF(dirBlock));
+		if(blocks[i] < 0) {
+			while(i-- > 0) {
+				invalidateBlock(blocks[i]);
+			}
+			free(blocks);
+			return -1;
+		}
+	}
+
+	int first = linkEntries(dirBlock, entries, blocks, count);
+	free(blocks);
+	return first;
+}
+
+/**
+ * Links count entries to the end of a directory's chain, saving them to the
+ * pages already allocated for them in blocks. Returns the first one's page.
+ */
+int linkEntries(int dirBlock, struct Metadata * entries, int * blocks, int count) {
+	int i;
+	long bytes = 0;
+	int pages = 0;
+	for(i = 0; i < count; i++) {
+		long entryBytes;
+		int entryPages;
+		entries[i].nextBlockNumber = i + 1 < count ? blocks[i + 1] : -1;
+		saveBlock(&entries[i], blocks[i]);
+		entryUsage(&entries[i], &entryBytes, &entryPages);
+		bytes += entryBytes;
+		pages += entryPages;
+	}
+	int first = blocks[0];
+	int last = blocks[count - 1];
+
+	struct Metadata * dot = getMetadata(dirBlock);
+	int tail = dot->dir.tailBlock;
+	if(tail <= 0) {
+		// No tail recorded, find it the slow way
+		struct Metadata * temp = NULL;
+		tail = dirBlock;
+		while((temp = getMetadata(tail))->nextBlockNumber != -1) {
+			tail = temp->nextBlockNumber;
+			free(temp);
+		}
+		free(temp);
+	}
+	nameIndexAppend(dirBlock, tail, blocks, entries, count);
+
+	if(tail == dirBlock) {
+		dot->nextBlockNumber = first;
+	} else {
+		struct Metadata * previous = getMetadata(tail);
+		previous->nextBlockNumber = first;
+		saveBlock(previous, tail);
+		free(previous);
+	}
+
+	dot->dir.tailBlock = last;
+	dot->dir.entries += count;
+	saveBlock(dot, dirBlock);
+	free(dot);
 
-	// Initialize block
-	struct Block * block = (struct Block *) malloc(sizeof (struct Block));
-	memset((char*)block, 0, sizeof (struct Block));
-	free(block);
+	accountUsage(dirBlock, bytes, pages);
+	return first;
 }
 
 /**
- * Used to create a new directory
- * i.e. - Once a directory file is created call this method to create the . and ..
- * links which are instantly written to disk and linked up
+ * Unlinks an entry from a directory and releases its page. previousBlock is
+ * the entry linking to it.
  */
-void createDirectoryStruct(struct Metadata * parentDir) {
-	struct Metadata * meta = (struct Metadata *)malloc(sizeof (struct Metadata) * 2);
-	memset(meta, 0, sizeof (struct Metadata) * 2);
+void removeEntry(int dirBlock, int previousBlock, int entryBlock) {
+	struct Metadata * entry = getMetadata(entryBlock);
+	struct Metadata * previous = getMetadata(previousBlock);
+	long bytes;
+	int pages;
+	entryUsage(entry, &bytes, &pages);
+
+	nameIndexUnlink(previousBlock, entryBlock, entry->nextBlockNumber);
+	previous->nextBlockNumber = entry->nextBlockNumber;
+	saveBlock(previous, previousBlock);
+	free(previous);
 
-	// Create . block
-	meta[0].filename[0] = '.';
-	setDirectory(&meta[0]);
-	meta[0].fileAttrib |= SUBDIRECTORY;
-	
-	// Create .. block
-	strcpy(meta[1].filename, "..\0");
-	setDirectory(&meta[1]);
-	meta[1].fileAttrib |= SUBDIRECTORY;
-	meta[1].nextBlockNumber = -1;
-	
-	if (parentDir != NULL) {
-		int block = createBlock();
-		int block2 = createBlock();
-		
-		meta[0].blockNumber     = block;
-		meta[0].nextBlockNumber = block2;
-		meta[1].blockNumber     = parentDir->blockNumber;
+	entry->filename[0] = FILE_DELETED;
+	saveBlock(entry, entryBlock);
+	invalidateBlock(entryBlock);
+	free(entry);
 
-		memcpy(map + block * PAGE_SIZE, &meta[0], sizeof (struct Metadata));
-		memcpy(map + block2 * PAGE_SIZE, &meta[1], sizeof (struct Metadata));
-		
-		parentDir->blockNumber = meta[0].blockNumber;
-	} else {
-		meta[0].blockNumber     = ALLOCATION_BITMAP_PAGES;
-		meta[0].nextBlockNumber = ALLOCATION_BITMAP_PAGES + 1;
-		meta[1].blockNumber     = ALLOCATION_BITMAP_PAGES;
-		memcpy(map + ALLOCATION_BITMAP_PAGES * PAGE_SIZE, meta, sizeof(struct Metadata) * 2);
+	// Read the '.' entry only now, it may be the previous entry we just saved
+	struct Metadata * dot = getMetadata(dirBlock);
+	if(dot->dir.tailBlock == entryBlock) {
+		dot->dir.tailBlock = previousBlock;
 	}
-	
-	free(meta);
+	if(dot->dir.entries > 0) {
+		dot->dir.entries--;
+	}
+	saveBlock(dot, dirBlock);
+	free(dot);
+	accountUsage(dirBlock, -bytes, -pages);
 }
 
 /**
@@ -949,18 +4848,90 @@ char* generateData(char *source, size_t size)
 	return retval;
 }
 
+/*
+ * commandName() - Copies the command word of a line into name, used to
+ * bucket the instrumentation counters. "rm -rf" is kept apart from "rm".
+ */
+void commandName(char * buffer, char * name)
+{
+	size_t length = strcspn(buffer, " ");
+	if(!strncmp(buffer, "rm -rf ", 7))
+	{
+		length = 6;
+	}
+	if(length >= STATS_MAX_COMMAND_NAME)
+	{
+		length = STATS_MAX_COMMAND_NAME - 1;
+	}
+	memcpy(name, buffer, length);
+	name[length] = '\0';
+}
+
+/*
+ * traceBegin() - Starts digesting the output of a command
+ */
+void traceBegin()
+{
+	if(traceFile == NULL)
+	{
+		return;
+	}
+	fflush(stdout);
+	statsDigestReset();
+	traceAnswersLength = 0;
+}
+
+/*
+ * promptLine() - Reads a line a command asks the user for. The answer is
+ * traced after the command, so a replay feeds it to the same prompt.
+ */
+ssize_t promptLine(char ** line, size_t * size)
+{
+	fflush(stdout);
+	ssize_t length = getline(line, size, stdin);
+	if(length == -1 || traceFile == NULL)
+	{
+		return length;
+	}
+
+	int answer = length > 0 && (*line)[length - 1] == '\n' ? length - 1 : length;
+	traceAnswers = (char *) realloc(traceAnswers, traceAnswersLength + answer + 3);
+	traceAnswersLength += sprintf(traceAnswers + traceAnswersLength, "%c\t%.*s\n", TRACE_ANSWER, answer, *line);
+	return length;
+}
+
+/*
+ * traceCommand() - Appends a command to the trace as
+ * <start ns> <tab> <duration ns> <tab> <result> <tab> <command line>, with
+ * the start relative to when the filesystem was loaded and the result the
+ * bytes the command printed and their FNV-1a hash, <bytes>:<hash>. Any
+ * answers it read follow on their own lines.
+ */
+void traceCommand(char * line, unsigned long long start)
+{
+	if(traceFile == NULL || line == NULL)
+	{
+		return;
+	}
+
+	unsigned long long duration = statsNow() - start;
+	unsigned long bytes;
+	fflush(stdout);
+	unsigned long long digest = statsDigest(&bytes);
+	fprintf(traceFile, "%llu\t%llu\t%lu:%016llx\t%s\n", start - traceEpoch, duration, bytes, digest, line);
+	fwrite(traceAnswers, 1, traceAnswersLength, traceFile);
+	traceAnswersLength = 0;
+}
+
 /*
  * filesystem() - loads in the filesystem and accepts commands
  */
 void filesystem(char * file) {
 	BOOL createFile = FALSE;
 
-	/* pointer to the memory-mapped filesystem */
-	map = NULL;
-	
 	/*
 	 * open file, handle errors, create it if necessary.
-	 * should end up with map referring to the filesystem.
+	 * should end up with the storage backend holding the filesystem.
 	 */
 	int fd;
 	fd = open(file, O_RDWR, S_IRUSR | S_IWUSR);
@@ -981,12 +4952,6 @@ void filesystem(char * file) {
 					perror("Error enlarging file size");
 					exit(-1);
 				}
-
-				// Create root Directory
-				if(lseek(fd, ALLOCATION_BITMAP_PAGES * PAGE_SIZE, SEEK_SET) < 0) {
-					perror("Error adding root directory");
-					exit(-1);
-				}
 				createFile = TRUE;
 			}
 		} else {
@@ -995,82 +4960,114 @@ void filesystem(char * file) {
 		}
 	}
 	
-	map = (char*) mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
+	if (!storageOpen(fd, FILESIZE)) {
 		close(fd);
-		perror("Error mapping file");
 		exit(-1);
 	}
 	
+	/* Load file system structures */
+	int page;
+	for(page = 0; page < ALLOCATION_BITMAP_PAGES; page++) {
+		storageRead(page, allocTable + page * PAGE_SIZE, TRUE);
+	}
+	// Writes go to a generation newer than any page has
+	for(page = 0; page < GENERATION_PAGES; page++) {
+		storageRead(GENERATION_BLOCK + page, (char *)pageGenerations + page * PAGE_SIZE, TRUE);
+	}
+	for(page = 0; page < DATA_BLOCKS; page++) {
+		if(pageGenerations[page] >= generation) {
+			generation = pageGenerations[page] + 1;
+		}
+	}
+	struct GenerationHeader * generations = (struct GenerationHeader *)getBlock(GENERATION_HEADER_BLOCK);
+	if(generations->magic == GENERATION_MAGIC) {
+		imageId = generations->image;
+		if(generations->next > generation) {
+			generation = generations->next;
+		}
+	} else {
+		// A new image, or one from before images were told apart
+		imageId = newImageId();
+		saveGenerationHeader();
+	}
+	free(generations);
+	groupCount();
+	nameIndexReset();
+	currentDirBlockStack[0] = ROOT_BLOCK;
+	if(!createFile) {
+		journalReplay();
+	}
+
+	if(discardMode) {
+		discardPending = (unsigned char *) malloc(DATA_BLOCKS);
+		memset(discardPending, 0, DATA_BLOCKS);
+	}
+
+	if(dedupMode) {
+		// The index lives in memory only, rebuild it from the tree
+		dedupBuckets = (int *) malloc(DEDUP_BUCKETS * sizeof (int));
+		memset(dedupBuckets, -1, DEDUP_BUCKETS * sizeof (int));
+		dedupNext = (int *) malloc(DATA_BLOCKS * sizeof (int));
+		dedupHashes = (unsigned long long *) malloc(DATA_BLOCKS * sizeof (unsigned long long));
+		int i;
+		for(i = 0; i < DATA_BLOCKS; i++) {
+			dedupNext[i] = DEDUP_UNINDEXED;
+		}
+		if(!createFile) {
+			dedupIndexTree(ROOT_BLOCK, 0);
+		}
+	}
+
 	if(createFile) {
+		// The root is the first directory allocated, so it always lands on ROOT_BLOCK
 		createDirectoryStruct(NULL);
-	}
+		syncFilesystem();
 
-	/* Load file system structures */	
-	memcpy(allocTable, map, ALLOCATION_BITMAP_PAGES * PAGE_SIZE);
-	memcpy((char *)rootDir->metadata, map + ALLOCATION_BITMAP_PAGES * PAGE_SIZE, ROOT_SECTOR_ENTRIES * PAGE_SIZE);
-	currentDirBlockStack[0] = ALLOCATION_BITMAP_PAGES;
+		#ifdef DEBUG_MODE
+		/* Create the Parent directory */
+		struct Metadata dir;
+		memset(&dir, 0, sizeof (struct Metadata));
+		strcpy(dir.filename, "Dir1");
+		setDirectory(&dir);
+		dir.blockNumber = ROOT_BLOCK;
 
-	#ifdef DEBUG_MODE
-	/* Create the Parent directory */
-	struct Metadata dir;
-	strcpy(dir.filename, "Dir1");
-	setDirectory(&dir);
-	dir.blockNumber = ALLOCATION_BITMAP_PAGES;
-	
-	/* Create internal directory structure and write to disk */
-	createDirectoryStruct(&dir);
-	
-	/* Add directory to root directory listing */
-	saveMetadataToRootBlock(dir);
-	
-	/* Directory created */
-	
-	/* Create a file */
-	struct Metadata f;
-	strcpy(f.filename, "File1.txt");
-	setFile(&f);
+		/* Create internal directory structure and add it to the root */
+		createDirectoryStruct(&dir);
+		addEntry(ROOT_BLOCK, &dir);
 
-	// Save block
-	int blockNumber = createBlock();
-	saveBlock(&f, blockNumber);
-	
-	// Link to block
-	struct Metadata * temp = NULL;
-	int temp2 = dir.blockNumber;
-	do {
-		temp = (struct Metadata *)getBlock(temp2);
-		if(temp->nextBlockNumber == -1) {
-			break;
+		/* Directory created */
+
+		/* Create a file */
+		struct Metadata f;
+		memset(&f, 0, sizeof (struct Metadata));
+		strcpy(f.filename, "File1.txt");
+		setFile(&f);
+		addEntry(dir.blockNumber, &f);
+
+		/* Write to file */
+		struct Block * b = (struct Block *)getBlock(f.blockNumber);
+		if(b != NULL) {
+			strcpy(b->data, "This is a test string");
+			saveBlock(b, f.blockNumber);
 		}
-		temp2 = temp->nextBlockNumber;
-		free(temp);
-	} while(temp != NULL);
+		free(b);
 
-	temp->nextBlockNumber = blockNumber;
-	saveBlock(temp, temp2);
-	free(temp);
+		/* File created */
 
-	/* Write to file */
-	struct Block * b = (struct Block *)getBlock(f.blockNumber);
-	strcpy(b->data, "This is a test string");
-	saveBlock(b, f.blockNumber);
-	free(b);
-	
-	/* File created */
+		// Sync filesystem
+		syncFilesystem();
 
-	// Sync filesystem
-	syncFilesystem();
-	
-	/* Print our the metadata blocks */
-	treePrint(rootDir->metadata[0]);
-	
-	/* Read from created file */
-	b = (struct Block *) getBlock(f.blockNumber);
-	printf("File Contents: <%s>\n", b->data);
-	free(b);
-	
-	#endif
+		/* Print our the metadata blocks */
+		struct Metadata * root = getMetadata(ROOT_BLOCK);
+		treePrint(*root);
+		free(root);
+
+		/* Read from created file */
+		b = (struct Block *) getBlock(f.blockNumber);
+		printf("File Contents: <%s>\n", b->data);
+		free(b);
+		#endif
+	}
 	
 	/*
 	 * Accept commands, calling accessory functions unless
@@ -1079,6 +5076,29 @@ void filesystem(char * file) {
 	 */
 	char *buffer = NULL;
 	size_t size = 0;
+
+	/* Record the command stream so it can be replayed later */
+	if(traceFileName != NULL)
+	{
+		traceFile = fopen(traceFileName, "w");
+		if(traceFile == NULL)
+		{
+			perror("Error opening trace file");
+		}
+		else
+		{
+			fprintf(traceFile, "# start_ns\tduration_ns\tresult\tcommand\n");
+
+			traceStdout = stdout;
+			FILE * out = statsDigestStream(traceStdout);
+			if(out != NULL)
+			{
+				stdout = out;
+			}
+		}
+	}
+	traceEpoch = statsNow();
+
 	while(getline(&buffer, &size, stdin) != -1)
 	{
 		/* Basic checks and newline removal */
@@ -1092,15 +5112,40 @@ void filesystem(char * file) {
 			buffer[length-1] = '\0';
 		}
 
+		/* Attribute counters and latency to this command */
+		char command[STATS_MAX_COMMAND_NAME];
+		commandName(buffer, command);
+		statsBeginCommand(command);
+
+		/* Keep the untouched line, parsing below splits it in place */
+		unsigned long long commandStart = statsNow();
+		char * traced = traceFile != NULL ? strdup(buffer) : NULL;
+		traceBegin();
+
 		/* TODO: Complete this function */
 		/* You do not have to use the functions as commented (and probably can not)
 		 *	They are notes for you on what you ultimately need to do.
 		 */
 
+		/* Buffered appends must land before anything else looks at the files */
+		if(strncmp(buffer, "append ", 7))
+		{
+			appendFlushAll();
+		}
+
 		if(!strcmp(buffer, "quit"))
 		{
+			traceCommand(traced, commandStart);
+			free(traced);
 			break;
 		}
+		else if(readOnlyDepth >= 0 && (!strncmp(buffer, "write ", 6) || !strncmp(buffer, "append ", 7) ||
+				!strncmp(buffer, "mkdir ", 6) || !strncmp(buffer, "rm", 2) || !strncmp(buffer, "mv ", 3) ||
+				!strncmp(buffer, "import-tree ", 12) || !strncmp(buffer, "restore ", 8) ||
+				!strncmp(buffer, "defrag", 6)))
+		{
+			printf("Snapshots are read-only.\n");
+		}
 		else if(!strncmp(buffer, "dump ", 5))
 		{
 			if(isdigit(buffer[5]))
@@ -1128,9 +5173,174 @@ void filesystem(char * file) {
 		{
 			cd(buffer+3);
 		}
+		else if(!strncmp(buffer, "find ", 5))
+		{
+			// find [dir] <pattern>
+			char *path = strtok(buffer + 5, " ");
+			char *pattern = strtok(NULL, " ");
+			if(path == NULL)
+			{
+				printf("Usage: find [dir] <pattern>\n");
+			}
+			else if(pattern == NULL)
+			{
+				find(".", path);
+			}
+			else
+			{
+				find(path, pattern);
+			}
+		}
+		else if(!strncmp(buffer, "du", 2))
+		{
+			// du [dir]
+			du(buffer[2] == ' ' ? buffer + 3 : "");
+		}
+		else if(!strncmp(buffer, "quota ", 6))
+		{
+			// quota <dir> [bytes]
+			char *path = strtok(buffer + 6, " ");
+			char *bytes = strtok(NULL, " ");
+			if(path == NULL)
+			{
+				printf("Usage: quota <dir> [bytes]\n");
+			}
+			else if(bytes == NULL)
+			{
+				du(path);
+			}
+			else
+			{
+				quota(path, strtoul(bytes, NULL, 10));
+			}
+		}
+		else if(!strncmp(buffer, "cp ", 3))
+		{
+			// cp [-c] <source> <target>
+			BOOL physical = FALSE;
+			char *source = strtok(buffer + 3, " ");
+			if(source != NULL && !strcmp(source, "-c"))
+			{
+				physical = TRUE;
+				source = strtok(NULL, " ");
+			}
+			char *target = strtok(NULL, " ");
+			if(source == NULL || target == NULL)
+			{
+				printf("Usage: cp [-c] <source> <target>\n");
+			}
+			else
+			{
+				cp(source, target, physical);
+			}
+		}
+		else if(!strncmp(buffer, "backup ", 7))
+		{
+			// backup <hostfile> [<previous backup>]
+			char *hostPath = strtok(buffer + 7, " ");
+			char *basePath = strtok(NULL, " ");
+			if(hostPath == NULL)
+			{
+				printf("Usage: backup <hostfile> [<previous backup>]\n");
+			}
+			else
+			{
+				backup(hostPath, basePath);
+			}
+		}
+		else if(!strncmp(buffer, "restore ", 8))
+		{
+			// restore <full backup> [<incremental backup>]...
+			char *paths[MAX_BACKUPS];
+			int count = 0;
+			char *path = strtok(buffer + 8, " ");
+			while(path != NULL && count < MAX_BACKUPS)
+			{
+				paths[count++] = path;
+				path = strtok(NULL, " ");
+			}
+			if(count == 0 || path != NULL)
+			{
+				printf("Usage: restore <full backup> [<incremental backup>]... (at most %d)\n", MAX_BACKUPS);
+			}
+			else
+			{
+				restore(paths, count);
+			}
+		}
+		else if(!strncmp(buffer, "import-tree ", 12))
+		{
+			// import-tree <hostdir> <dir>
+			char *hostPath = strtok(buffer + 12, " ");
+			char *path = strtok(NULL, " ");
+			if(hostPath == NULL || path == NULL)
+			{
+				printf("Usage: import-tree <hostdir> <dir>\n");
+			}
+			else
+			{
+				importTree(hostPath, path);
+			}
+		}
+		else if(!strncmp(buffer, "mv ", 3))
+		{
+			// mv <source> <target>
+			char *source = strtok(buffer + 3, " ");
+			char *target = strtok(NULL, " ");
+			if(source == NULL || target == NULL)
+			{
+				printf("Usage: mv <source> <target>\n");
+			}
+			else
+			{
+				mv(source, target);
+			}
+		}
 		else if(!strncmp(buffer, "ls", 2))
 		{
-			ls();
+			// ls [-N|-S|-t] [-r] [-n <entries>] [-c <position>] [-a <last entry>]
+			int sortKey = LS_UNSORTED, count = 0, position = 0;
+			BOOL reverse = FALSE;
+			char *after = NULL;
+			char *option = strtok(buffer + 2, " ");
+			while(option != NULL)
+			{
+				if(!strcmp(option, "-N"))
+				{
+					sortKey = LS_BY_NAME;
+				}
+				else if(!strcmp(option, "-S"))
+				{
+					sortKey = LS_BY_SIZE;
+				}
+				else if(!strcmp(option, "-t"))
+				{
+					sortKey = LS_BY_TIME;
+				}
+				else if(!strcmp(option, "-r"))
+				{
+					reverse = TRUE;
+				}
+				else if(!strcmp(option, "-n") || !strcmp(option, "-c"))
+				{
+					char *value = strtok(NULL, " ");
+					int number = value != NULL ? atoi(value) : 0;
+					if(option[1] == 'n')
+					{
+						count = number;
+					}
+					else
+					{
+						position = number;
+					}
+				}
+				else if(!strcmp(option, "-a"))
+				{
+					after = strtok(NULL, " ");
+				}
+				option = strtok(NULL, " ");
+			}
+			ls(sortKey, reverse, count, position, after);
 		}
 		else if(!strncmp(buffer, "mkdir ", 6))
 		{
@@ -1161,7 +5371,7 @@ void filesystem(char * file) {
 			space = strstr(space+1, " ");
 
 			char *data = generateData(space+1, amt<<1);
-			//append(filename, amt, data);
+			append(filename, amt, data);
 			free(data);
 		}
 		else if(!strncmp(buffer, "getpages ", 9))
@@ -1176,7 +5386,7 @@ void filesystem(char * file) {
 			size_t start = atoi(space + 1);
 			space = strstr(space+1, " ");
 			size_t end = atoi(space + 1);
-			//get(filename, start, end);
+			get(filename, start, end);
 		}
 		else if(!strncmp(buffer, "rmdir ", 6))
 		{
@@ -1198,19 +5408,108 @@ void filesystem(char * file) {
 		{
 			//undelete(buffer + 9);
 		}
+		else if(!strncmp(buffer, "trim", 4))
+		{
+			trim();
+		}
+		else if(!strncmp(buffer, "frag", 4))
+		{
+			frag();
+		}
+		else if(!strncmp(buffer, "defrag", 6))
+		{
+			// defrag [-b <pages per command>] [file|dir]
+			char *target = buffer + 6;
+			int budget = 0;
+			while(*target == ' ')
+			{
+				target++;
+			}
+			if(!strncmp(target, "-b ", 3))
+			{
+				budget = atoi(target + 3);
+				target = strstr(target + 3, " ");
+				target = target == NULL ? "" : target + 1;
+			}
+			defrag(target, budget);
+		}
+		else if(!strncmp(buffer, "snapshot ", 9))
+		{
+			snapshot(buffer + 9);
+		}
+		else if(!strncmp(buffer, "rollback ", 9))
+		{
+			rollback(buffer + 9);
+		}
+		else if(!strncmp(buffer, "stats", 5))
+		{
+			if(!strcmp(buffer + 5, " reset"))
+			{
+				statsReset();
+			}
+			else
+			{
+				statsPrint(stdout);
+				storageCacheReport(stdout);
+			}
+		}
 
 		// Sync filesystem
 		syncFilesystem();
+		statsEndCommand();
+		traceCommand(traced, commandStart);
+		free(traced);
+
+		/* Throttled defragmentation runs in the gaps between commands */
+		if(defragPending > 0 && defragBudget > 0)
+		{
+			statsBeginCommand("defrag-step");
+			// Buffers are keyed by entry page, which the step may move
+			appendFlushAll();
+			defragStep(defragBudget);
+			syncFilesystem();
+			statsEndCommand();
+		}
 
 		free(buffer);
 		buffer = NULL;
 	}
 	free(buffer);
 	buffer = NULL;
-	
-	if (munmap(map, FILESIZE) < 0) {
-		perror("Error un-mmaping file");
+
+	// The input may end without a quit
+	appendFlushAll();
+	syncFilesystem();
+
+	if(traceFile != NULL)
+	{
+		fclose(traceFile);
+		traceFile = NULL;
+		if(stdout != traceStdout)
+		{
+			fclose(stdout);
+			stdout = traceStdout;
+		}
+		free(traceAnswers);
+		traceAnswers = NULL;
+	}
+
+	/* Dump the instrumentation counters for offline analysis */
+	if(statsFile != NULL)
+	{
+		FILE * fp = fopen(statsFile, "w");
+		if(fp == NULL)
+		{
+			perror("Error opening stats file");
+		}
+		else
+		{
+			statsDumpJSON(fp);
+			fclose(fp);
+		}
 	}
+	
+	storageClose();
 	close(fd);
 }
 
@@ -1219,8 +5518,19 @@ void filesystem(char * file) {
  */
 void help(char *progname)
 {
-	printf("Usage: %s [FILE]...\n", progname);
+	printf("Usage: %s [-s STATSFILE] [-t TRACEFILE] [-I] [-D] [-C] [-d] [-b BACKEND] [-c PAGES] [-o OPTIONS] [FILE]...\n", progname);
 	printf("Loads FILE as a filesystem. Creates FILE if it does not exist\n");
+	printf("  -s STATSFILE  Dump instrumentation counters as JSON to STATSFILE on exit\n");
+	printf("  -t TRACEFILE  Record every command with its timing and result to TRACEFILE\n");
+	printf("  -I            Store every file in data blocks, even ones small enough to inline\n");
+	printf("  -D            Share data pages with identical contents between files\n");
+	printf("  -C            Compress file data\n");
+	printf("  -d            Give the pages freed by each command back to the host\n");
+	printf("  -b BACKEND    Storage backend for the image: mmap (default) or pread\n");
+	printf("  -c PAGES      Pages held by the page cache of the pread backend (default %d)\n", DEFAULT_CACHE_PAGES);
+	printf("  -o OPTIONS    Comma separated mmap mount options: populate (prefault the image),\n");
+	printf("                hugepage (transparent huge page hint), random or sequential (access\n");
+	printf("                pattern advice) and lock (mlock the allocation table and root)\n");
 	exit(0);
 }
 
@@ -1236,19 +5546,57 @@ int main(int argc, char **argv)
 	/* run a student name check */
 	check_student(argv[0]);
 
-	/* parse the command-line options. For this program, we only support */
-	/* the parameterless 'h' option, for getting help on program usage. */
-	while((opt = getopt(argc, argv, "h")) != -1)
+	/* parse the command-line options. We support the parameterless 'h' */
+	/* option for help, 's' for choosing where to dump statistics and 't' */
+	/* for recording a trace of the commands. 'I' turns off inline data */
+	/* 'D' turns on deduplication, 'C' compression and 'd' discard. 'b' */
+	/* picks the storage backend, 'c' sizes its page cache and 'o' takes */
+	/* mount options. */
+	while((opt = getopt(argc, argv, "hs:t:IDCdb:c:o:")) != -1)
 	{
 		switch(opt)
 		{
 		case 'h':
 			help(argv[0]);
 			break;
+		case 's':
+			statsFile = optarg;
+			break;
+		case 't':
+			traceFileName = optarg;
+			break;
+		case 'I':
+			inlineMode = FALSE;
+			break;
+		case 'D':
+			dedupMode = TRUE;
+			break;
+		case 'C':
+			compressMode = TRUE;
+			break;
+		case 'd':
+			discardMode = TRUE;
+			break;
+		case 'b':
+			if(!storageSelect(optarg))
+			{
+				fprintf(stderr, "Unknown storage backend %s, try -h for help.\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			storageCacheSize(atoi(optarg));
+			break;
+		case 'o':
+			if(!storageMountOptions(optarg))
+			{
+				return 1;
+			}
+			break;
 		}
 	}
 
-	if(argv[1] == NULL)
+	if(argv[optind] == NULL)
 	{
 		fprintf(stderr, "No filename provided, try -h for help.\n");
 		return 1;
@@ -1258,21 +5606,22 @@ int main(int argc, char **argv)
 	allocTable = (unsigned char *) malloc(ALLOCATION_BITMAP_PAGES * PAGE_SIZE + 1);
 	memset(allocTable, 0, ALLOCATION_BITMAP_PAGES * PAGE_SIZE);
 
-	rootDir = (struct RootDir *) malloc(sizeof (struct RootDir) + 1);
-	memset(rootDir, 0, sizeof(struct RootDir));
-	rootDir->metadata = (struct Metadata *) malloc((sizeof (struct Metadata)) * ROOT_SECTOR_ENTRIES + 1);
-	memset(rootDir->metadata, 0, (sizeof (struct Metadata)) * ROOT_SECTOR_ENTRIES);
+	pageGenerations = (unsigned int *) malloc(GENERATION_PAGES * PAGE_SIZE);
+	memset(pageGenerations, 0, GENERATION_PAGES * PAGE_SIZE);
 
-	currentDirBlockStack = (short*) malloc(MAX_DIRECTORY_DEPTH);
-	memset(currentDirBlockStack, -1, MAX_DIRECTORY_DEPTH);
+	currentDirBlockStack = (short*) malloc(MAX_DIRECTORY_DEPTH * sizeof (short));
+	memset(currentDirBlockStack, -1, MAX_DIRECTORY_DEPTH * sizeof (short));
 
 	currentDirBlock = 0;
 
-	filesystem(argv[1]);
+	filesystem(argv[optind]);
 	
 	free(allocTable);
-	free(rootDir->metadata);
-	free(rootDir);
+	free(pageGenerations);
 	free(currentDirBlockStack);
+	free(dedupBuckets);
+	free(dedupNext);
+	free(dedupHashes);
+	free(discardPending);
 	return 0;
 }
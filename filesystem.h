@@ -28,9 +28,49 @@
 /*   Constants for the file system  */
 #define FILESIZE 4000000
 #define PAGE_SIZE 512
-#define ROOT_SECTOR_ENTRIES 20
 #define ALLOCATION_BITMAP_PAGES 4
 
+/*  Pages tracked by the allocation table, starting right after it   */
+#define FIRST_DATA_BLOCK ALLOCATION_BITMAP_PAGES
+#define DATA_BLOCKS (ALLOCATION_BITMAP_PAGES * PAGE_SIZE)
+
+/*
+ *  The allocation table is split into groups allocated from separately:
+ *  pages go to the group of the directory they belong to, and directories
+ *  near the root spread out over the groups.
+ */
+#define ALLOCATION_GROUPS 8
+#define GROUP_BLOCKS (DATA_BLOCKS / ALLOCATION_GROUPS)
+#define GROUP_OF(page) (((page) - FIRST_DATA_BLOCK) / GROUP_BLOCKS)
+
+/*
+ *  Multi-page metadata updates (mv) go through a redo journal in the pages
+ *  after the data blocks: the header and the new page images are made
+ *  durable before the pages are written in place, and replayed on startup
+ *  if that was interrupted.
+ */
+#define JOURNAL_BLOCK (FIRST_DATA_BLOCK + DATA_BLOCKS)
+#define JOURNAL_MAGIC 0x4A524E4C
+
+/*
+ *  The generation each data page was last written in is kept in the pages
+ *  after the journal. A backup holds the pages written since the backup it
+ *  is based on and then starts a new generation.
+ */
+#define GENERATION_BLOCK (JOURNAL_BLOCK + 1 + JOURNAL_MAX_PAGES)
+#define GENERATION_PAGES ((DATA_BLOCKS * (int)sizeof (unsigned int) + PAGE_SIZE - 1) / PAGE_SIZE)
+// Followed by a page naming the image and the generation writes go to next
+#define GENERATION_HEADER_BLOCK (GENERATION_BLOCK + GENERATION_PAGES)
+#define GENERATION_MAGIC 0x4E524547
+#define BACKUP_MAGIC 0x50554B42
+// Most backups a restore applies, the full one and the incremental ones after it
+#define MAX_BACKUPS 16
+// Pages a backup reads and writes at a time
+#define BACKUP_CHUNK_PAGES 64
+
+/*  The root '.' entry is the first page allocated on a new image   */
+#define ROOT_BLOCK FIRST_DATA_BLOCK
+
 /*  FILE NAME FIRST CHARACTERS   */
 #define FILE_DELETED      -27//0xE5
 // This is used if the first character of the filename is really 0xE5
@@ -44,10 +84,178 @@
 #define DISK_VOLUME_LABEL 0x08
 #define SUBDIRECTORY      0x10
 #define ARCHIVE           0x20
+// The file's data is stored in Metadata.inlineData rather than in blocks
+#define INLINE_DATA       0x40
+// A read-only copy of the tree kept in the root
+#define SNAPSHOT          0x80
+// The file's blocks hold compressed extents
+#define COMPRESSED        0x100
+// The file's chain has holes, fileSize holds its length
+#define SPARSE            0x200
+
+/* The allocation table holds a reference count per page */
+#define MAX_REFERENCES 255
+
+/*  Deduplication index   */
+#define DEDUP_BUCKETS 4096
+// dedupNext value of a page that is not in the index
+#define DEDUP_UNINDEXED -2
+
+/*  Compression   */
+// Files are compressed in extents of this many bytes, so get only inflates what it prints
+#define EXTENT_DATA_SIZE 4096
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// As in LZ4, the last bytes are always literals and no match starts this close to the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/*
+ *  A data block's nextBlockNumber packs the next page with the zero blocks
+ *  (holes) between it and that page, and a readahead hint: how many pages of
+ *  the chain, starting with the next one, sit at consecutive page numbers
+ *  (0 when unknown). The hint may go stale, it is only used to prefetch.
+ */
+#define HOLE_SHIFT 16
+#define RUN_SHIFT 24
+#define MAX_HOLES 0xFF
+#define MAX_RUN 0x7F
+#define NEXT_PAGE(x) ((x) & 0xFFFF)
+#define HOLES_AFTER(x) (((x) >> HOLE_SHIFT) & MAX_HOLES)
+#define RUN_AFTER(x) (((x) >> RUN_SHIFT) & MAX_RUN)
+#define MAKE_NEXT(page, holes, run) ((page) | (holes) << HOLE_SHIFT | ((run) < MAX_RUN ? (run) : MAX_RUN) << RUN_SHIFT)
+
+/*  Readahead   */
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+// Files whose access pattern is remembered between commands
+#define READ_STREAMS 8
+
+/* Data blocks needed for x bytes */
+#define BLOCKS_FOR(x) (((x) + MAX_BLOCK_DATA_SIZE - 1) / MAX_BLOCK_DATA_SIZE)
+
+/* Largest compressed form of x bytes: every extent stored raw behind its header */
+#define COMPRESS_BOUND(x) ((x) + ((x) / EXTENT_DATA_SIZE + 1) * (int)sizeof (struct ExtentHeader))
+
+/* Bytes of data held by an inline or compressed file */
+#define INLINE_SIZE(x) ((int)((x)->fileSize - sizeof (struct Metadata)))
 
 /* Used for tracking the directory path */
 #define MAX_DIRECTORY_DEPTH 255
 
+/*  Trace of the commands run with -t   */
+// Starts the trace line of an answer a command read, after the command's own line
+#define TRACE_ANSWER '>'
+
+/*  Name index of directory entries   */
+#define NAME_BUCKETS 1024
+// nameDirs value of a page that is not in the index
+#define NAME_UNINDEXED -1
+
+/*  Online defragmentation   */
+#define DEFRAG_QUEUE_SIZE 1024
+#define DEFRAG_FILE       0x01
+#define DEFRAG_DIRECTORY  0x02
+// A '.' page whose entries should be queued, without moving the directory itself
+#define DEFRAG_CONTENTS   0x03
+
+struct DefragItem {
+	int blockNumber;
+	char kind;
+};
+
+/*  Listing order of ls   */
+#define LS_UNSORTED 0
+#define LS_BY_NAME  1
+#define LS_BY_SIZE  2
+#define LS_BY_TIME  3
+// ls output is collected and written in chunks of this size
+#define LS_BUFFER_SIZE 16384
+
+/*  Position in a directory listing, which a later command can resume from   */
+struct DirCursor {
+	int dirBlock;
+	// Page of the next entry, -1 once the listing is done
+	int position;
+};
+
+/*  What ls prints of an entry   */
+struct ListEntry {
+	char type;
+	unsigned int size;
+	// Modification date and time, comparable as one number
+	unsigned long stamp;
+	char name[MAX_FILENAME_SIZE];
+};
+
+/*  Appends held back until they fill the tail block   */
+#define APPEND_BUFFERS 8
+
+struct AppendBuffer {
+	// Entry of the file, 0 for a free slot
+	int entryBlock;
+	int length;
+	unsigned long lastUse;
+	char data[MAX_BLOCK_DATA_SIZE];
+};
+
+/*  Pages changed together by one journaled update   */
+struct Journal {
+	int count;
+	int pages[JOURNAL_MAX_PAGES];
+	char images[JOURNAL_MAX_PAGES][PAGE_SIZE];
+};
+
+/*  What restore found a page of a backup to be   */
+#define RESTORE_UNSEEN 0
+#define RESTORE_DOT 1
+#define RESTORE_ENTRY 2
+#define RESTORE_DATA 3
+
+/*  The pages of a backup chain while restore lays them out again   */
+struct RestoreMap {
+	// Allocation table and data pages as of the last backup applied
+	unsigned char * table;
+	char * pages;
+	BOOL * present;
+	// New page of every old one (0 while unseen), what it is and its reference count
+	int * remap;
+	char * kinds;
+	unsigned char * references;
+	// Image the backups were taken of
+	unsigned int image;
+	// Pages laid out so far, and references to pages the backups do not have
+	int used;
+	int dropped;
+};
+
+/*  Access pattern of a file being read   */
+struct ReadStream {
+	// Entry of the file, 0 for a free slot
+	int entryBlock;
+	// Where a sequential read would continue, -1 after a cat
+	int nextOffset;
+	// Pages to prefetch ahead, 0 while access looks random
+	int window;
+	// Last page prefetched
+	int prefetched;
+	unsigned long lastUse;
+};
+
+/*  Sequential reader over a file's data blocks   */
+struct ChainReader {
+	int blockNumber;
+	int offset;
+	struct Block * block;
+	// Zeros still to be read for the holes after the current block
+	int holeBytes;
+	// Set to read an inline file's data instead
+	char * inlineData;
+	// Prefetches ahead of the reader when set
+	struct ReadStream * stream;
+};
+
 /*
  *	Prototypes for our filesystem functions.
  *
@@ -59,20 +267,99 @@ void dump(FILE * fp, int blockNumber);
 void usage();
 void pwd();
 void cd(char * path);
-void ls();
+void ls(int sortKey, BOOL reverse, int count, int position, char * after);
+void openDir(struct DirCursor * cursor, int dirBlock);
+BOOL seekDir(struct DirCursor * cursor, int dirBlock, int position);
+struct Metadata * readDir(struct DirCursor * cursor);
 void mkdir(char * dirname);
+int createDirectory(int dirBlock, char * dirname);
 void cat(char * filename);
+int storeFile(char * filename, int amount, char * data);
+int replaceFile(char * filename, int amount, char * data);
 void writeFS(char * filename, int amount, char * data);
-//void append(char * filename, int amount, char * data);
+int readFile(struct Metadata * file, char * out);
+BOOL appendable(struct Metadata * file);
+int appendChain(struct Metadata * file, int entryBlock, int amount, char * data);
+void appendFlush(struct AppendBuffer * buffer);
+void appendFlushAll();
+void append(char * filename, int amount, char * data);
 //void remove(char * filename, int start, int end);
+int resolveDirectory(char * path, BOOL * readOnly);
+int resolveParent(char * path, char ** base, BOOL * readOnly);
+int resolveTarget(char * target, char * name, char ** base, BOOL * readOnly);
+struct Metadata * journalPage(struct Journal * journal, int blockNumber);
+void journalCommit(struct Journal * journal);
+void journalReplay();
+int copyChain(int blockNumber, int * tail);
+void cp(char * source, char * target, BOOL physical);
+void importTree(char * hostPath, char * path);
+void mv(char * source, char * target);
 void rmdir2(char * dirName);
 void rm(char * filename);
 void rmForce(char * filename);
 void getpages(char * filename);
-//void get(char * filename, int start, int end);
+void get(char * filename, int start, int end);
+void nameIndexReset();
+BOOL nameIndexDirectory(int dirBlock);
+void nameIndexDrop(int dirBlock);
+void nameIndexWrite(int blockNumber, struct Metadata * entry);
+void nameIndexAppend(int dirBlock, int tail, int * blocks, struct Metadata * entries, int count);
+void nameIndexUnlink(int previousBlock, int entryBlock, int following);
+int findEntry(int dirBlock, char * filename, int * previous);
+int findSubdirectory(int dirBlock, char * dirname, int * previous);
 void scandisk();
+BOOL askTruncate(char * filename, int blockNumber);
+BOOL scanFile(struct Metadata * file, unsigned char * owners);
+void scanDirectory(int blockNumber, unsigned char * owners, int depth);
+int chainExtents(int blockNumber, BOOL directory, int * pages, long * distance);
+void fragLine(char type, int blockNumber, BOOL directory, char * name);
+void frag();
+void defragPush(int blockNumber, char kind);
+void defragQueueContents(int blockNumber);
+void freeChain(int blockNumber, BOOL directory);
+int relocateFile(int entryBlock);
+int relocateDirectory(int entryBlock);
+int defragStep(int budget);
+void defrag(char * filename, int budget);
 //void undelete(char * filename);
+BOOL chainShared(int blockNumber);
+int copyPage(int blockNumber);
+int sharePage(int blockNumber);
+int cowPage(int blockNumber);
+void releaseEntry(struct Metadata * entry);
+void releaseDirectory(int blockNumber);
+BOOL copyEntry(struct Metadata * entry, int parentBlock, int depth);
+int copyDirectory(int dotBlock, int parentBlock, int depth);
+int findSnapshot(char * name);
+void snapshot(char * name);
+void rollback(char * name);
+long logicalPages(int blockNumber, int depth);
+unsigned long long hashPage(void * page);
+void dedupInsert(int blockNumber, unsigned long long hash);
+void dedupForget(int blockNumber);
+int dedupFind(struct Block * block, unsigned long long hash);
+void dedupIndexTree(int blockNumber, int depth);
+BOOL zeroBlock(char * data, int length);
+BOOL hasHoles(int amount, char * data);
+int buildChain(int amount, char * data);
+int writeShared(struct Metadata * file, int entryBlock, char * filename, int amount, char * data);
+int lzCompress(unsigned char * src, int length, unsigned char * dst, int capacity);
+int lzDecompress(unsigned char * src, int length, unsigned char * dst, int capacity);
+int compressData(char * data, int amount, char * out);
+int chainRead(struct ChainReader * reader, char * out, int length);
+struct ReadStream * readStream(int entryBlock, int offset);
+void readahead(struct ReadStream * stream, int next);
+void readCompressed(struct Metadata * file, struct ReadStream * stream, int start, int end, BOOL text);
 void clearDirectory(struct Metadata * metadata);
+unsigned int newImageId();
+void saveGenerationHeader();
+void backup(char * hostPath, char * basePath);
+BOOL restoreRead(char * hostPath, struct RestoreMap * map, unsigned int * last);
+BOOL restoreClaim(struct RestoreMap * map, int page, char kind);
+void restoreDirectory(struct RestoreMap * map, int dotBlock, int depth);
+int restoredPage(struct RestoreMap * map, int page);
+int restoreImage(struct RestoreMap * map);
+void restore(char ** paths, int count);
 
 //Help dialog
 void help(char *progname);
@@ -80,6 +367,12 @@ void help(char *progname);
 //Main filesystem loop
 void filesystem(char *file);
 
+//Command bookkeeping for the stats and trace recorders
+void commandName(char * buffer, char * name);
+void traceCommand(char * line, unsigned long long start);
+void traceBegin();
+ssize_t promptLine(char ** line, size_t * size);
+
 //Converts source data into appropriate binary data.
 //User must free the returned pointer
 char* generateData(char *source, size_t size);
@@ -89,22 +382,43 @@ void printMetadata(struct Metadata meta);
 void treePrint(struct Metadata metadata);
 #endif
 
-struct Metadata * getMetadata();
+struct Metadata * getMetadata(int blockNumber);
+int chainLink(int blockNumber);
+int chainNext(int blockNumber);
 
 void * getBlock(int blockNumber);
+void groupCount();
+int allocationGroup();
+int directoryGroup(int parentBlock);
+int createBlockIn(int group);
 int createBlock();
+int createBlockRun(int count);
 
-void createDirectoryStruct(struct Metadata * parentDir);
+int createDirectoryStruct(struct Metadata * parentDir);
+int parentDirectory(int dotBlock);
+void entryUsage(struct Metadata * entry, long * bytes, int * pages);
+void accountUsage(int dirBlock, long bytes, int pages);
+BOOL quotaAllows(int dirBlock, long bytes, int fromBlock);
+int rebuildUsage(int dotBlock, int depth);
+void find(char * path, char * pattern);
+void du(char * path);
+void quota(char * path, unsigned int bytes);
+int addEntry(int dirBlock, struct Metadata * entry);
+int addEntries(int dirBlock, struct Metadata * entries, int count);
+int linkEntries(int dirBlock, struct Metadata * entries, int * blocks, int count);
+void removeEntry(int dirBlock, int previousBlock, int entryBlock);
 
 void setDirectory(struct Metadata * metadata);
 void setFile(struct Metadata * metadata);
+void setInlineData(struct Metadata * metadata, int amount, char * data);
 
-int saveMetadataToRootBlock(struct Metadata metadata);
 void saveBlock(void * b, int blockNumber);
 void setModifyTime(struct Metadata * metadata);
 
 BOOL invalidateBlock(int blockNumber);
 
 void syncFilesystem();
+long discardFree(BOOL all, int * runs);
+void trim();
 
 #endif
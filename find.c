@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "structs.h"
+#include "filesystem.h"
+#include "stats.h"
+#include "storage.h"
+#include "find.h"
+
+/*
+ *
+ * Parallel search of a directory tree by entry name. Directories are read
+ * by whichever worker is free, so a wide tree keeps every thread busy.
+ *
+ */
+
+static struct FindQueue queue;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueWake = PTHREAD_COND_INITIALIZER;
+// Serializes writes to stdout, and page reads when the backend has a cache
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pageLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Shell-style match of a whole name: '*' matches any run of characters and
+ * '?' any one character
+ */
+BOOL globMatch(const char * pattern, const char * name) {
+	const char * star = NULL, * resume = NULL;
+	while(*name != '\0') {
+		if(*pattern == '*') {
+			// Remember the star, first try matching nothing with it
+			star = pattern++;
+			resume = name;
+		} else if(*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if(star != NULL) {
+			// Let the last star take one more character
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return FALSE;
+		}
+	}
+	while(*pattern == '*') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+/**
+ * Longest run of a pattern without wildcards
+ */
+static void patternLiteral(const char * pattern, char * literal) {
+	int best = 0, start = 0, i;
+	for(i = 0; ; i++) {
+		if(pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '\0') {
+			if(i - start > best) {
+				best = i - start;
+				memcpy(literal, pattern + start, best);
+			}
+			start = i + 1;
+			if(pattern[i] == '\0') {
+				break;
+			}
+		}
+	}
+	literal[best] = '\0';
+}
+
+/**
+ * Joins a directory path and a name, the result is allocated
+ */
+static char * joinPath(const char * path, const char * name) {
+	int length = strlen(path);
+	char * joined = (char *) malloc(length + strlen(name) + 2);
+	strcpy(joined, path);
+	if(length == 0 || path[length - 1] != '/') {
+		joined[length++] = '/';
+	}
+	strcpy(joined + length, name);
+	return joined;
+}
+
+/**
+ * Queues a directory and wakes a worker for it. Takes over path.
+ */
+static void queuePush(int dotBlock, int depth, char * path) {
+	pthread_mutex_lock(&queueLock);
+	if(queue.count == queue.capacity) {
+		queue.capacity = queue.capacity ? queue.capacity * 2 : 64;
+		queue.items = (struct FindItem *) realloc(queue.items, queue.capacity * sizeof (struct FindItem));
+	}
+	queue.items[queue.count].dotBlock = dotBlock;
+	queue.items[queue.count].depth = depth;
+	queue.items[queue.count].path = path;
+	queue.count++;
+	pthread_cond_signal(&queueWake);
+	pthread_mutex_unlock(&queueLock);
+}
+
+/**
+ * Writes out what a worker has collected
+ */
+static void flushOutput(char * output, int * length) {
+	if(*length > 0) {
+		pthread_mutex_lock(&outputLock);
+		fwrite(output, 1, *length, stdout);
+		pthread_mutex_unlock(&outputLock);
+		*length = 0;
+	}
+}
+
+/**
+ * Reads one directory's entries, printing the names that match and
+ * queueing the subdirectories
+ */
+static void findDirectory(struct FindItem * item, char * output, int * length, unsigned long * scanned) {
+	struct Metadata entry;
+	int next = item->dotBlock, count = 0;
+	while(next >= FIRST_DATA_BLOCK && next < FIRST_DATA_BLOCK + DATA_BLOCKS && count++ < DATA_BLOCKS) {
+		// Mapped pages are read where they are, the cache is used by one thread at a time
+		if(queue.concurrent) {
+			struct Metadata * page = (struct Metadata *)storagePin(next, TRUE);
+			memcpy(&entry, page, sizeof (entry));
+			storageUnpin(next, FALSE);
+		} else {
+			pthread_mutex_lock(&pageLock);
+			storageRead(next, &entry, TRUE);
+			pthread_mutex_unlock(&pageLock);
+		}
+		next = entry.nextBlockNumber;
+		(*scanned)++;
+
+		// Neither '.' and '..' nor the copies of the tree in snapshots are searched
+		if(entry.filename[0] == FILE_DELETED || (entry.fileAttrib & (SUBDIRECTORY | SNAPSHOT))) {
+			continue;
+		}
+
+		entry.filename[MAX_FILENAME_SIZE - 1] = '\0';
+		BOOL directory = entry.filename[0] == DIRECTORY;
+		char * name = directory ? entry.filename + 1 : entry.filename;
+
+		// strstr is vectorized, so most names are turned down without the full match
+		if((queue.literal[0] == '\0' || strstr(name, queue.literal) != NULL) && globMatch(queue.pattern, name)) {
+			int needed = strlen(item->path) + strlen(name) + 3;
+			if(*length + needed > FIND_OUTPUT_SIZE) {
+				flushOutput(output, length);
+			}
+			if(needed <= FIND_OUTPUT_SIZE) {
+				*length += sprintf(output + *length, "%s%s%s\n", item->path,
+					item->path[strlen(item->path) - 1] == '/' ? "" : "/", name);
+			}
+		}
+
+		if(directory && item->depth + 1 < MAX_DIRECTORY_DEPTH) {
+			queuePush(entry.blockNumber, item->depth + 1, joinPath(item->path, name));
+		}
+	}
+}
+
+static void * findWorker(void * arg) {
+	char output[FIND_OUTPUT_SIZE];
+	int length = 0;
+	unsigned long scanned = 0;
+	(void)arg;
+
+	pthread_mutex_lock(&queueLock);
+	for(;;) {
+		if(queue.count == 0) {
+			if(queue.busy == 0) {
+				break;
+			}
+			pthread_cond_wait(&queueWake, &queueLock);
+			continue;
+		}
+
+		// Take the newest directory, which keeps the queue short on deep trees
+		struct FindItem item = queue.items[--queue.count];
+		queue.busy++;
+		pthread_mutex_unlock(&queueLock);
+
+		findDirectory(&item, output, &length, &scanned);
+		free(item.path);
+		// Results go out a directory at a time rather than at the end
+		flushOutput(output, &length);
+
+		pthread_mutex_lock(&queueLock);
+		queue.busy--;
+		if(queue.count == 0 && queue.busy == 0) {
+			pthread_cond_broadcast(&queueWake);
+		}
+	}
+	queue.scanned += scanned;
+	pthread_mutex_unlock(&queueLock);
+	return NULL;
+}
+
+/**
+ * Prints every entry below the directory whose '.' entry is at dotBlock
+ * with a name matching pattern, under path
+ */
+void findTree(int dotBlock, char * path, char * pattern) {
+	memset(&queue, 0, sizeof (queue));
+	queue.pattern = pattern;
+	patternLiteral(pattern, queue.literal);
+	queue.concurrent = storageConcurrent();
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus < 1 ? 1 : cpus > FIND_MAX_THREADS ? FIND_MAX_THREADS : (int)cpus;
+	pthread_t workers[FIND_MAX_THREADS];
+	int i, started = 0;
+
+	// Anything printed before must not be overtaken by the workers
+	fflush(stdout);
+	queuePush(dotBlock, 0, strdup(path));
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&workers[i], NULL, findWorker, NULL) == 0) {
+			started++;
+		}
+	}
+	if(started == 0) {
+		findWorker(NULL);
+	}
+	for(i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	fflush(stdout);
+
+	STAT_INC(STAT_LOOKUPS);
+	STAT_ADD(STAT_DIRENTS_SCANNED, queue.scanned);
+	STAT_ADD(STAT_PAGES_READ, queue.scanned);
+	free(queue.items);
+	queue.items = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef FIND_H
+#define FIND_H
+
+/*
+ * find walks a directory tree with a pool of threads sharing a queue of
+ * directories still to read. Workers read entry pages in place where the
+ * backend maps them and take turns on the page cache where it does not.
+ * Matching paths are written as they are found, a buffer per worker at a
+ * time, so their order varies from run to run.
+ */
+
+/*  Most threads a find starts   */
+#define FIND_MAX_THREADS 8
+
+/*  Output a worker collects before writing it   */
+#define FIND_OUTPUT_SIZE 4096
+
+/*  A directory waiting to be read   */
+struct FindItem {
+	// Its '.' page
+	int dotBlock;
+	int depth;
+	// Path printed in front of its entries, allocated
+	char * path;
+};
+
+/*  What the workers share   */
+struct FindQueue {
+	struct FindItem * items;
+	int count;
+	int capacity;
+	// Workers holding a directory, the walk is over when none is and the queue is empty
+	int busy;
+	char * pattern;
+	// Longest run of the pattern without wildcards, every match contains it
+	char literal[MAX_FILENAME_SIZE];
+	// Whether several threads may pin pages at once
+	BOOL concurrent;
+	// Entries read by all workers
+	unsigned long scanned;
+};
+
+BOOL globMatch(const char * pattern, const char * name);
+void findTree(int dotBlock, char * path, char * pattern);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "import.h"
+
+/*
+ *
+ * Host side of an import: lists host directories, and reads the files of
+ * an import on a pool of threads. Files are taken
+ * in list order and handed back in the same order, so the image is filled
+ * in the order the tree was walked whichever reader finishes first.
+ *
+ */
+
+static struct ImportList * reading;
+// Next file a reader takes, and next one handed to the image
+static int claimed, delivered;
+static pthread_t readers[IMPORT_MAX_THREADS];
+static int started;
+static pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readDone = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Lists a host directory without its '.' and '..', each entry with its
+ * type and size. Returns the number of entries or -1 when it cannot be
+ * opened.
+ */
+int hostList(char * hostPath, struct HostEntry ** entries) {
+	DIR * host = opendir(hostPath);
+	if(host == NULL) {
+		return -1;
+	}
+	int count = 0, capacity = 0;
+	struct dirent * item;
+	*entries = NULL;
+	while((item = readdir(host)) != NULL) {
+		if(!strcmp(item->d_name, ".") || !strcmp(item->d_name, "..")) {
+			continue;
+		}
+		if(count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			*entries = (struct HostEntry *) realloc(*entries, capacity * sizeof (struct HostEntry));
+		}
+		struct HostEntry * entry = &(*entries)[count++];
+		int length = strlen(hostPath);
+		entry->path = (char *) malloc(length + strlen(item->d_name) + 2);
+		sprintf(entry->path, "%s%s%s", hostPath, length > 0 && hostPath[length - 1] == '/' ? "" : "/", item->d_name);
+		entry->name = entry->path + strlen(entry->path) - strlen(item->d_name);
+
+		struct stat info;
+		entry->size = 0;
+		entry->type = HOST_OTHER;
+		if(lstat(entry->path, &info) == 0) {
+			entry->type = S_ISREG(info.st_mode) ? HOST_FILE : S_ISDIR(info.st_mode) ? HOST_DIRECTORY : HOST_OTHER;
+			entry->size = info.st_size;
+		}
+	}
+	closedir(host);
+	return count;
+}
+
+/**
+ * Releases what hostList returned
+ */
+void hostListFree(struct HostEntry * entries, int count) {
+	int i;
+	for(i = 0; i < count; i++) {
+		free(entries[i].path);
+	}
+	free(entries);
+}
+
+/**
+ * Adds a file to an import, returns it with nothing reserved yet
+ */
+struct ImportFile * importAdd(struct ImportList * list, char * hostPath, unsigned int size) {
+	if(list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->files = (struct ImportFile *) realloc(list->files, list->capacity * sizeof (struct ImportFile));
+	}
+	struct ImportFile * file = &list->files[list->count++];
+	memset(file, 0, sizeof (*file));
+	file->hostPath = strdup(hostPath);
+	file->size = size;
+	file->first = -1;
+	file->entry = -1;
+	return file;
+}
+
+/**
+ * Reads a whole file, a few large preads at a time. A file that shrank
+ * since it was listed counts as failed.
+ */
+static void readHostFile(struct ImportFile * file) {
+	int fd = open(file->hostPath, O_RDONLY);
+	unsigned int done = 0;
+	file->data = (char *) malloc(file->size > 0 ? file->size : 1);
+	if(fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while(done < file->size) {
+			unsigned int length = file->size - done < IMPORT_READ_SIZE ? file->size - done : IMPORT_READ_SIZE;
+			ssize_t got = pread(fd, file->data + done, length, done);
+			if(got <= 0) {
+				break;
+			}
+			done += got;
+		}
+		close(fd);
+	}
+	if(fd < 0 || done < file->size) {
+		free(file->data);
+		file->data = NULL;
+		file->failed = TRUE;
+	}
+}
+
+static void * importWorker(void * arg) {
+	(void)arg;
+	pthread_mutex_lock(&readLock);
+	while(claimed < reading->count) {
+		struct ImportFile * file = &reading->files[claimed++];
+		pthread_mutex_unlock(&readLock);
+
+		readHostFile(file);
+
+		pthread_mutex_lock(&readLock);
+		file->ready = TRUE;
+		pthread_cond_broadcast(&readDone);
+	}
+	pthread_mutex_unlock(&readLock);
+	return NULL;
+}
+
+/**
+ * Starts reading the files of list, up to one thread per processor
+ */
+void importStart(struct ImportList * list) {
+	reading = list;
+	claimed = 0;
+	delivered = 0;
+	started = 0;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus < 1 ? 1 : cpus > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : (int)cpus;
+	if(threads > list->count) {
+		threads = list->count;
+	}
+	while(started < threads && pthread_create(&readers[started], NULL, importWorker, NULL) == 0) {
+		started++;
+	}
+}
+
+/**
+ * Waits for the next file in list order to be read, NULL after the last.
+ * Without readers the file is read here.
+ */
+struct ImportFile * importNext() {
+	if(delivered >= reading->count) {
+		return NULL;
+	}
+	struct ImportFile * file = &reading->files[delivered++];
+	if(started == 0) {
+		readHostFile(file);
+		file->ready = TRUE;
+		return file;
+	}
+	pthread_mutex_lock(&readLock);
+	while(!file->ready) {
+		pthread_cond_wait(&readDone, &readLock);
+	}
+	pthread_mutex_unlock(&readLock);
+	return file;
+}
+
+/**
+ * Waits for the readers to stop
+ */
+void importFinish() {
+	int i;
+	for(i = 0; i < started; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	started = 0;
+}
+
+/**
+ * Releases every file of an import and what the readers left
+ */
+void importFree(struct ImportList * list) {
+	int i;
+	for(i = 0; i < list->count; i++) {
+		free(list->files[i].hostPath);
+		free(list->files[i].pages);
+		free(list->files[i].data);
+	}
+	free(list->files);
+	memset(list, 0, sizeof (*list));
+}
@@ -0,0 +1,74 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+/*
+ * import-tree copies a host directory tree into the image. The tree is
+ * walked first: directories are created as they are found and every file
+ * gets its pages reserved from its stat size. A pool of threads then reads
+ * the files with large preads while the main thread, the only one touching
+ * the image, stores each file as soon as it has been read and links the
+ * entries of a directory in batches.
+ */
+
+/*  Most threads reading host files   */
+#define IMPORT_MAX_THREADS 8
+
+/*  Largest single read of a host file   */
+#define IMPORT_READ_SIZE (1 << 20)
+
+/*  Entries linked into a directory at once   */
+#define IMPORT_BATCH 32
+
+/*  A host file on its way into the image   */
+struct ImportFile {
+	// Allocated
+	char * hostPath;
+	unsigned int size;
+	// Where it goes: the directory's '.' page, the entry's name and the
+	// page reserved for the entry
+	int dirBlock;
+	char name[MAX_FILENAME_SIZE];
+	int entry;
+	// Pages reserved for its data, a run starting at first or a list when
+	// no run was free. Neither is set for a file kept in its entry.
+	int first;
+	int * pages;
+	int count;
+	// Set by the readers: the contents, allocated, and whether they could
+	// not be read
+	char * data;
+	BOOL ready;
+	BOOL failed;
+};
+
+/*  What a host directory entry is   */
+#define HOST_FILE 0
+#define HOST_DIRECTORY 1
+// Links, devices and anything that cannot be read
+#define HOST_OTHER 2
+
+/*  An entry of a host directory   */
+struct HostEntry {
+	// Allocated, the entry's path and its last component
+	char * path;
+	char * name;
+	int type;
+	unsigned long long size;
+};
+
+/*  The files of an import, in the order they were found   */
+struct ImportList {
+	struct ImportFile * files;
+	int count;
+	int capacity;
+};
+
+int hostList(char * hostPath, struct HostEntry ** entries);
+void hostListFree(struct HostEntry * entries, int count);
+struct ImportFile * importAdd(struct ImportList * list, char * hostPath, unsigned int size);
+void importStart(struct ImportList * list);
+struct ImportFile * importNext();
+void importFinish();
+void importFree(struct ImportList * list);
+
+#endif
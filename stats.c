@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "structs.h"
+#include "stats.h"
+
+/*
+ *
+ * Per-command instrumentation. Commands are bracketed with
+ * statsBeginCommand()/statsEndCommand() and every counter that moved in
+ * between is attributed to that command, along with its latency.
+ *
+ */
+
+#ifdef STATS_MODE
+unsigned long long statCounters[STAT_COUNTERS];
+
+static struct CommandStats commandStats[STATS_MAX_COMMANDS];
+static int commandCount = 0;
+
+static struct CommandStats * activeCommand = NULL;
+static unsigned long long activeStart;
+static unsigned long long activeCounters[STAT_COUNTERS];
+#endif
+
+static const char * counterNames[STAT_COUNTERS] = {
+	"pages_read",
+	"pages_written",
+	"blocks_created",
+	"blocks_freed",
+	"sync_calls",
+	"sync_bytes",
+	"sync_ns",
+	"lookups",
+	"dirents_scanned",
+	"pages_copied",
+	"pages_deduped",
+	"cache_hits",
+	"cache_misses",
+	"pages_prefetched"
+};
+
+/**
+ * Monotonic time in nanoseconds
+ */
+unsigned long long statsNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef STATS_MODE
+/**
+ * Maps a latency onto its histogram bucket
+ */
+static int bucketIndex(unsigned long long ns) {
+	if(ns < STATS_SUB_BUCKETS) {
+		return (int)ns;
+	}
+
+	int exponent = 63 - __builtin_clzll(ns);
+	int sub = (int)((ns >> (exponent - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1));
+	return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/**
+ * Upper bound (in nanoseconds) of the values that land in a bucket
+ */
+static unsigned long long bucketLimit(int index) {
+	if(index < STATS_SUB_BUCKETS) {
+		return index;
+	}
+
+	int exponent = index / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+	unsigned long long sub = index % STATS_SUB_BUCKETS;
+	unsigned long long width = 1ULL << (exponent - STATS_SUB_BUCKET_BITS);
+	return (1ULL << exponent) + (sub + 1) * width - 1;
+}
+#endif
+
+/**
+ * Find the stats slot for a command, returns NULL if it was never run
+ */
+struct CommandStats * statsFind(const char * name) {
+#ifdef STATS_MODE
+	int i;
+	for(i = 0; i < commandCount; i++) {
+		if(!strcmp(commandStats[i].name, name)) {
+			return &commandStats[i];
+		}
+	}
+#endif
+	return NULL;
+}
+
+/**
+ * Start attributing counters and time to the given command
+ */
+void statsBeginCommand(const char * command) {
+#ifdef STATS_MODE
+	activeCommand = statsFind(command);
+	if(activeCommand == NULL) {
+		if(commandCount >= STATS_MAX_COMMANDS) {
+			return;
+		}
+		activeCommand = &commandStats[commandCount++];
+		strncpy(activeCommand->name, command, STATS_MAX_COMMAND_NAME - 1);
+	}
+
+	memcpy(activeCounters, statCounters, sizeof (statCounters));
+	activeStart = statsNow();
+#else
+	(void)command;
+#endif
+}
+
+/**
+ * Finish the running command and fold its deltas into the histograms
+ */
+void statsEndCommand() {
+#ifdef STATS_MODE
+	if(activeCommand == NULL) {
+		return;
+	}
+
+	unsigned long long elapsed = statsNow() - activeStart;
+	int i;
+	for(i = 0; i < STAT_COUNTERS; i++) {
+		activeCommand->counters[i] += statCounters[i] - activeCounters[i];
+	}
+
+	activeCommand->count++;
+	activeCommand->totalNs += elapsed;
+	if(elapsed > activeCommand->maxNs) {
+		activeCommand->maxNs = elapsed;
+	}
+	activeCommand->histogram[bucketIndex(elapsed)]++;
+
+	activeCommand = NULL;
+#endif
+}
+
+/**
+ * Clear every counter and histogram
+ */
+void statsReset() {
+#ifdef STATS_MODE
+	memset(statCounters, 0, sizeof (statCounters));
+	memset(commandStats, 0, sizeof (commandStats));
+	commandCount = 0;
+	activeCommand = NULL;
+#endif
+}
+
+/**
+ * Latency (in nanoseconds) below which the given fraction of runs fall
+ */
+unsigned long long statsPercentile(struct CommandStats * cmd, double percentile) {
+#ifdef STATS_MODE
+	if(cmd == NULL || cmd->count == 0) {
+		return 0;
+	}
+
+	unsigned long target = (unsigned long)(percentile * cmd->count);
+	unsigned long seen = 0;
+	int i;
+	if(target >= cmd->count) {
+		target = cmd->count - 1;
+	}
+	for(i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += cmd->histogram[i];
+		if(seen > target) {
+			unsigned long long limit = bucketLimit(i);
+			return limit < cmd->maxNs ? limit : cmd->maxNs;
+		}
+	}
+	return cmd->maxNs;
+#else
+	(void)cmd;
+	(void)percentile;
+	return 0;
+#endif
+}
+
+/**
+ * Human readable table used by the `stats` command
+ */
+void statsPrint(FILE * fp) {
+#ifdef STATS_MODE
+	int i, j;
+	fprintf(fp, "%-12s %8s %12s %12s %12s", "Command", "Count", "Avg(ns)", "p50(ns)", "p99(ns)");
+	for(j = 0; j < STAT_COUNTERS; j++) {
+		fprintf(fp, " %s", counterNames[j]);
+	}
+	fprintf(fp, "\n");
+
+	for(i = 0; i < commandCount; i++) {
+		struct CommandStats * cmd = &commandStats[i];
+		if(cmd->count == 0) {
+			continue;
+		}
+
+		fprintf(fp, "%-12s %8lu %12llu %12llu %12llu", cmd->name, cmd->count,
+			cmd->totalNs / cmd->count, statsPercentile(cmd, 0.5), statsPercentile(cmd, 0.99));
+		for(j = 0; j < STAT_COUNTERS; j++) {
+			fprintf(fp, " %*llu", (int)strlen(counterNames[j]), cmd->counters[j]);
+		}
+		fprintf(fp, "\n");
+	}
+
+	fprintf(fp, "%-12s", "Total");
+	for(j = 0; j < STAT_COUNTERS; j++) {
+		fprintf(fp, " %s=%llu", counterNames[j], statCounters[j]);
+	}
+	fprintf(fp, "\n");
+#else
+	fprintf(fp, "Statistics were compiled out.\n");
+#endif
+}
+
+/**
+ * Machine readable dump, one command object per line
+ */
+void statsDumpJSON(FILE * fp) {
+	int i, j;
+	fprintf(fp, "{\n\"enabled\": %s,\n\"totals\": {",
+#ifdef STATS_MODE
+		"true"
+#else
+		"false"
+#endif
+		);
+	for(j = 0; j < STAT_COUNTERS; j++) {
+#ifdef STATS_MODE
+		fprintf(fp, "%s\"%s\": %llu", j ? ", " : "", counterNames[j], statCounters[j]);
+#else
+		fprintf(fp, "%s\"%s\": 0", j ? ", " : "", counterNames[j]);
+#endif
+	}
+	fprintf(fp, "},\n\"commands\": [\n");
+
+#ifdef STATS_MODE
+	BOOL first = TRUE;
+	for(i = 0; i < commandCount; i++) {
+		struct CommandStats * cmd = &commandStats[i];
+		if(cmd->count == 0) {
+			continue;
+		}
+
+		fprintf(fp, "%s{\"command\": \"%s\", \"count\": %lu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+			first ? "" : ",\n", cmd->name, cmd->count, cmd->totalNs, statsPercentile(cmd, 0.5), statsPercentile(cmd, 0.99), cmd->maxNs);
+		for(j = 0; j < STAT_COUNTERS; j++) {
+			fprintf(fp, ", \"%s\": %llu", counterNames[j], cmd->counters[j]);
+		}
+		fprintf(fp, "}");
+		first = FALSE;
+	}
+	fprintf(fp, "\n");
+#else
+	(void)i;
+#endif
+
+	fprintf(fp, "]\n}\n");
+}
+
+/*
+ * Output digests. A digest stream passes what is written to it on to out,
+ * hashing it with FNV-1a so a trace can record what each command printed.
+ */
+static unsigned long long outputDigest;
+static unsigned long outputBytes;
+
+static ssize_t digestWrite(void * cookie, const char * data, size_t length) {
+	size_t i;
+	for(i = 0; i < length; i++) {
+		outputDigest = (outputDigest ^ (unsigned char)data[i]) * FNV64_PRIME;
+	}
+	outputBytes += length;
+	return fwrite(data, 1, length, (FILE *)cookie);
+}
+
+FILE * statsDigestStream(FILE * out) {
+	cookie_io_functions_t digest = {NULL, digestWrite, NULL, NULL};
+	statsDigestReset();
+	return fopencookie(out, "w", digest);
+}
+
+void statsDigestReset() {
+	outputDigest = FNV64_OFFSET;
+	outputBytes = 0;
+}
+
+unsigned long long statsDigest(unsigned long * bytes) {
+	*bytes = outputBytes;
+	return outputDigest;
+}
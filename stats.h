@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * Instrumentation counters for the hot paths of the filesystem.
+ *
+ * Build with `make STATS=0` (which defines NO_STATS) to compile every
+ * counter out of the command loop and the block helpers.
+ */
+#ifndef NO_STATS
+#define STATS_MODE
+#endif
+
+/*  Global counters bumped by the block helpers   */
+enum StatCounter {
+	STAT_PAGES_READ,
+	STAT_PAGES_WRITTEN,
+	STAT_BLOCKS_CREATED,
+	STAT_BLOCKS_FREED,
+	STAT_SYNC_CALLS,
+	STAT_SYNC_BYTES,
+	STAT_SYNC_NS,
+	STAT_LOOKUPS,
+	STAT_DIRENTS_SCANNED,
+	STAT_PAGES_COPIED,
+	STAT_PAGES_DEDUPED,
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_PAGES_PREFETCHED,
+	STAT_COUNTERS
+};
+
+/*  Latency histogram: 4 linear sub-buckets per power of two   */
+#define STATS_SUB_BUCKET_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_HISTOGRAM_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+/* Maximum number of distinct commands tracked */
+#define STATS_MAX_COMMANDS 64
+#define STATS_MAX_COMMAND_NAME 16
+
+struct CommandStats {
+	char name[STATS_MAX_COMMAND_NAME];
+	unsigned long count;
+	unsigned long long totalNs;
+	unsigned long long maxNs;
+	unsigned long long counters[STAT_COUNTERS];
+	unsigned long histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+#ifdef STATS_MODE
+extern unsigned long long statCounters[STAT_COUNTERS];
+
+#define STAT_INC(c) (statCounters[(c)]++)
+#define STAT_ADD(c, n) (statCounters[(c)] += (n))
+#define STAT_TIMER(t) unsigned long long t = statsNow()
+#define STAT_ELAPSED(c, t) (statCounters[(c)] += statsNow() - (t))
+#else
+#define STAT_INC(c) ((void)0)
+#define STAT_ADD(c, n) ((void)0)
+#define STAT_TIMER(t) ((void)0)
+#define STAT_ELAPSED(c, t) ((void)0)
+#endif
+
+unsigned long long statsNow();
+
+void statsBeginCommand(const char * command);
+void statsEndCommand();
+void statsReset();
+
+unsigned long long statsPercentile(struct CommandStats * cmd, double percentile);
+struct CommandStats * statsFind(const char * name);
+
+void statsPrint(FILE * fp);
+void statsDumpJSON(FILE * fp);
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+FILE * statsDigestStream(FILE * out);
+void statsDigestReset();
+unsigned long long statsDigest(unsigned long * bytes);
+
+#endif
@@ -0,0 +1,812 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "structs.h"
+#include "filesystem.h"
+#include "stats.h"
+#include "storage.h"
+#include "discard.h"
+
+/*
+ *
+ * Storage backends for the image. The filesystem only ever asks for whole
+ * pages, so a backend is free to cache, queue or reorder them as long as a
+ * read sees the last write to the page.
+ *
+ */
+
+static int storageFd = -1;
+static int storagePages = 0;
+
+/*  mmap backend   */
+
+static char * map = NULL;
+static int mapSize = 0;
+
+// Mount options, a MOUNT_* bit each
+static int mountOptions = 0;
+
+static const char * mountOptionNames[] = {"populate", "hugepage", "random", "sequential", "lock", NULL};
+
+static BOOL mmapOpen(int fd, int size) {
+	int flags = MAP_SHARED;
+	if(mountOptions & MOUNT_POPULATE) {
+		// Fault the whole image in now rather than page by page later
+		flags |= MAP_POPULATE;
+	}
+
+	map = (char *) mmap(0, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("Error mapping file");
+		map = NULL;
+		return FALSE;
+	}
+	mapSize = size;
+
+	// The rest are hints, the image works without them
+	if((mountOptions & MOUNT_HUGEPAGE) && madvise(map, size, MADV_HUGEPAGE) < 0) {
+		perror("Error asking for huge pages");
+	}
+	if((mountOptions & MOUNT_RANDOM) && madvise(map, size, MADV_RANDOM) < 0) {
+		perror("Error advising random access");
+	}
+	if((mountOptions & MOUNT_SEQUENTIAL) && madvise(map, size, MADV_SEQUENTIAL) < 0) {
+		perror("Error advising sequential access");
+	}
+	if(mountOptions & MOUNT_LOCK) {
+		// The allocation table and the root are touched by nearly every command
+		long systemPage = sysconf(_SC_PAGESIZE);
+		long locked = ((long)(ROOT_BLOCK + 1) * PAGE_SIZE + systemPage - 1) / systemPage * systemPage;
+		if(mlock(map, locked < size ? locked : size) < 0) {
+			perror("Error locking the allocation table");
+		}
+	}
+	return TRUE;
+}
+
+static void mmapRead(int pageNumber, void * page) {
+	memcpy(page, map + pageNumber * PAGE_SIZE, PAGE_SIZE);
+}
+
+static void mmapWrite(int pageNumber, void * page) {
+	memcpy(map + pageNumber * PAGE_SIZE, page, PAGE_SIZE);
+}
+
+static char * mmapMap(int pageNumber) {
+	return map + pageNumber * PAGE_SIZE;
+}
+
+static void mmapPrefetch(int first, int count) {
+	// madvise wants the range aligned to the system's pages
+	long systemPage = sysconf(_SC_PAGESIZE);
+	long start = (long)first * PAGE_SIZE / systemPage * systemPage;
+	long end = (long)(first + count) * PAGE_SIZE;
+	if(end > mapSize) {
+		end = mapSize;
+	}
+	if(end > start && madvise(map + start, end - start, MADV_WILLNEED) < 0) {
+		perror("Error advising the mapping");
+	}
+}
+
+static unsigned long mmapFlush() {
+	if (msync(map, mapSize, MS_SYNC) < 0) {
+		perror("Could not sync filesystem");
+	}
+	return mapSize;
+}
+
+static BOOL mmapDiscard(int first, int count) {
+	// Punching drops the pages from the mapping too, dirty or not
+	return punchHole(storageFd, (long)first * PAGE_SIZE, (long)count * PAGE_SIZE, PAGE_SIZE);
+}
+
+static void mmapClose() {
+	if (munmap(map, mapSize) < 0) {
+		perror("Error un-mmaping file");
+	}
+	map = NULL;
+}
+
+/*  pread backend   */
+
+// Queued page writes, batchSlot maps a page to its slot or -1
+static char * batch = NULL;
+static int batchPages[WRITE_BATCH_PAGES];
+static int batchCount = 0;
+static int * batchSlot = NULL;
+
+// Background fdatasync
+static pthread_t flusher;
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushWake = PTHREAD_COND_INITIALIZER;
+static BOOL flushPending = FALSE;
+static BOOL flushStop = FALSE;
+
+static void * flushThread(void * arg) {
+	(void)arg;
+	pthread_mutex_lock(&flushLock);
+	while(!flushStop) {
+		if(!flushPending) {
+			pthread_cond_wait(&flushWake, &flushLock);
+			continue;
+		}
+
+		// Syncs requested while this one runs are folded into the next
+		flushPending = FALSE;
+		pthread_mutex_unlock(&flushLock);
+		if(fdatasync(storageFd) < 0) {
+			perror("Could not sync filesystem");
+		}
+		pthread_mutex_lock(&flushLock);
+	}
+	pthread_mutex_unlock(&flushLock);
+	return NULL;
+}
+
+static int comparePages(const void * a, const void * b) {
+	return batchPages[*(const int *)a] - batchPages[*(const int *)b];
+}
+
+/**
+ * Writes every queued page to the image, one pwritev per run of
+ * consecutive pages. Returns the bytes written.
+ */
+static unsigned long submitBatch() {
+	int order[WRITE_BATCH_PAGES];
+	struct iovec iov[WRITE_BATCH_PAGES];
+	unsigned long bytes = 0;
+	int i, run = 0;
+
+	for(i = 0; i < batchCount; i++) {
+		order[i] = i;
+	}
+	qsort(order, batchCount, sizeof (int), comparePages);
+
+	for(i = 0; i < batchCount; i++) {
+		iov[run].iov_base = batch + order[i] * PAGE_SIZE;
+		iov[run].iov_len = PAGE_SIZE;
+		run++;
+
+		// Submit at the end of each run of consecutive pages
+		if(i + 1 == batchCount || batchPages[order[i + 1]] != batchPages[order[i]] + 1) {
+			int first = batchPages[order[i]] - run + 1;
+			if(pwritev(storageFd, iov, run, (off_t)first * PAGE_SIZE) < run * PAGE_SIZE) {
+				perror("Error writing pages");
+			}
+			bytes += run * PAGE_SIZE;
+			run = 0;
+		}
+	}
+
+	for(i = 0; i < batchCount; i++) {
+		batchSlot[batchPages[i]] = -1;
+	}
+	batchCount = 0;
+	return bytes;
+}
+
+static BOOL preadOpen(int fd, int size) {
+	int i;
+	(void)size;
+	batch = (char *) malloc(WRITE_BATCH_PAGES * PAGE_SIZE);
+	batchSlot = (int *) malloc(storagePages * sizeof (int));
+	for(i = 0; i < storagePages; i++) {
+		batchSlot[i] = -1;
+	}
+
+	flushStop = FALSE;
+	flushPending = FALSE;
+	if(pthread_create(&flusher, NULL, flushThread, NULL)) {
+		perror("Error starting the flush thread");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void preadRead(int pageNumber, void * page) {
+	if(batchSlot[pageNumber] >= 0) {
+		memcpy(page, batch + batchSlot[pageNumber] * PAGE_SIZE, PAGE_SIZE);
+		return;
+	}
+
+	if(pread(storageFd, page, PAGE_SIZE, (off_t)pageNumber * PAGE_SIZE) < PAGE_SIZE) {
+		perror("Error reading page");
+		memset(page, 0, PAGE_SIZE);
+	}
+}
+
+/**
+ * Reads count consecutive pages into the given buffers with one preadv.
+ * Returns FALSE if the read came up short.
+ */
+static BOOL preadReadRun(int first, int count, char ** pages) {
+	struct iovec iov[MAX_PREFETCH_PAGES];
+	int i;
+	if(count <= 0 || count > MAX_PREFETCH_PAGES) {
+		return FALSE;
+	}
+	for(i = 0; i < count; i++) {
+		iov[i].iov_base = pages[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	if(preadv(storageFd, iov, count, (off_t)first * PAGE_SIZE) < count * PAGE_SIZE) {
+		return FALSE;
+	}
+
+	// Queued writes are newer than the image
+	for(i = 0; i < count; i++) {
+		if(batchSlot[first + i] >= 0) {
+			memcpy(pages[i], batch + batchSlot[first + i] * PAGE_SIZE, PAGE_SIZE);
+		}
+	}
+	return TRUE;
+}
+
+static void preadWrite(int pageNumber, void * page) {
+	int slot = batchSlot[pageNumber];
+	if(slot < 0) {
+		if(batchCount == WRITE_BATCH_PAGES) {
+			submitBatch();
+		}
+		slot = batchCount++;
+		batchSlot[pageNumber] = slot;
+		batchPages[slot] = pageNumber;
+	}
+	memcpy(batch + slot * PAGE_SIZE, page, PAGE_SIZE);
+}
+
+static unsigned long preadFlush() {
+	unsigned long bytes = submitBatch();
+
+	pthread_mutex_lock(&flushLock);
+	flushPending = TRUE;
+	pthread_cond_signal(&flushWake);
+	pthread_mutex_unlock(&flushLock);
+	return bytes;
+}
+
+static BOOL preadDiscard(int first, int count) {
+	// A queued write must not land after the hole
+	int i;
+	for(i = first; i < first + count; i++) {
+		if(batchSlot[i] >= 0) {
+			submitBatch();
+			break;
+		}
+	}
+	return punchHole(storageFd, (long)first * PAGE_SIZE, (long)count * PAGE_SIZE, PAGE_SIZE);
+}
+
+static void preadClose() {
+	submitBatch();
+
+	pthread_mutex_lock(&flushLock);
+	flushStop = TRUE;
+	pthread_cond_signal(&flushWake);
+	pthread_mutex_unlock(&flushLock);
+	pthread_join(flusher, NULL);
+
+	// The thread may have stopped with a sync still requested
+	if(fdatasync(storageFd) < 0) {
+		perror("Could not sync filesystem");
+	}
+
+	free(batch);
+	free(batchSlot);
+	batch = NULL;
+	batchSlot = NULL;
+}
+
+static struct StorageBackend backends[] = {
+	{"mmap", mmapOpen, mmapRead, mmapWrite, mmapMap, mmapPrefetch, NULL, mmapFlush, mmapDiscard, mmapClose},
+	{"pread", preadOpen, preadRead, preadWrite, NULL, NULL, preadReadRun, preadFlush, preadDiscard, preadClose},
+	{NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+static struct StorageBackend * backend = &backends[0];
+
+/*  Page cache (ARC)   */
+
+static int cachePages = DEFAULT_CACHE_PAGES;
+static char * frames = NULL;
+static int * freeFrames = NULL;
+static int freeFrameCount = 0;
+
+// Twice as many entries as frames, for the ghosts. pageEntry maps a page to its entry or -1
+static struct CacheEntry * entries = NULL;
+static int * pageEntry = NULL;
+static int freeEntries = -1;
+
+// Most recently used end, least recently used end and length of each list
+static int listHead[CACHE_LISTS];
+static int listTail[CACHE_LISTS];
+static int listSize[CACHE_LISTS];
+
+// Pages of recent (as opposed to frequent) data ARC aims to keep resident
+static int target = 0;
+
+static unsigned long long cacheHits = 0;
+static unsigned long long cacheMisses = 0;
+static unsigned long long cacheEvictions = 0;
+
+static void listRemove(int e) {
+	struct CacheEntry * entry = &entries[e];
+	if(entry->prev >= 0) {
+		entries[entry->prev].next = entry->next;
+	} else {
+		listHead[entry->list] = entry->next;
+	}
+	if(entry->next >= 0) {
+		entries[entry->next].prev = entry->prev;
+	} else {
+		listTail[entry->list] = entry->prev;
+	}
+	listSize[entry->list]--;
+	entry->list = CACHE_FREE;
+}
+
+static void listPush(int list, int e) {
+	struct CacheEntry * entry = &entries[e];
+	entry->list = list;
+	entry->prev = -1;
+	entry->next = listHead[list];
+	if(listHead[list] >= 0) {
+		entries[listHead[list]].prev = e;
+	} else {
+		listTail[list] = e;
+	}
+	listHead[list] = e;
+	listSize[list]++;
+}
+
+/**
+ * Forgets a ghost (or a page being dropped outright) entirely
+ */
+static void entryRelease(int e) {
+	if(entries[e].list != CACHE_FREE) {
+		listRemove(e);
+	}
+	if(entries[e].frame >= 0) {
+		freeFrames[freeFrameCount++] = entries[e].frame;
+		entries[e].frame = -1;
+	}
+	pageEntry[entries[e].page] = -1;
+	entries[e].next = freeEntries;
+	freeEntries = e;
+}
+
+/**
+ * Least recently used page of a resident list that may be evicted, or -1.
+ * Directory pages are moved back to the front once before they are picked.
+ */
+static int findVictim(int list) {
+	int e = listTail[list];
+	int tries = listSize[list] * 2;
+	while(e >= 0 && tries-- > 0) {
+		int prev = entries[e].prev;
+		if(entries[e].pins == 0) {
+			if(!entries[e].metadata || !entries[e].chance) {
+				return e;
+			}
+			entries[e].chance = FALSE;
+			listRemove(e);
+			listPush(list, e);
+			if(prev < 0) {
+				prev = listTail[list];
+			}
+		}
+		e = prev;
+	}
+	return -1;
+}
+
+/**
+ * Evicts the victim of a resident list into its ghost list, returns FALSE
+ * if every page on the list is pinned
+ */
+static BOOL demote(int list) {
+	int e = findVictim(list);
+	if(e < 0) {
+		return FALSE;
+	}
+
+	listRemove(e);
+	freeFrames[freeFrameCount++] = entries[e].frame;
+	entries[e].frame = -1;
+	listPush(list == CACHE_RECENT ? CACHE_RECENT_GHOST : CACHE_FREQUENT_GHOST, e);
+	cacheEvictions++;
+	return TRUE;
+}
+
+/**
+ * ARC's REPLACE: frees a frame from the recent or the frequent list,
+ * depending on how the recent list compares to its target
+ */
+static void replace(BOOL frequentGhostHit) {
+	int recent = listSize[CACHE_RECENT];
+	BOOL fromRecent = recent > 0 && (recent > target || (frequentGhostHit && recent == target));
+	if(fromRecent ? demote(CACHE_RECENT) || demote(CACHE_FREQUENT) : demote(CACHE_FREQUENT) || demote(CACHE_RECENT)) {
+		return;
+	}
+	fprintf(stderr, "Every page in the page cache is pinned.\n");
+	exit(-1);
+}
+
+static BOOL cacheOpen() {
+	int i;
+	frames = (char *) malloc((size_t)cachePages * PAGE_SIZE);
+	freeFrames = (int *) malloc(cachePages * sizeof (int));
+	entries = (struct CacheEntry *) malloc(2 * cachePages * sizeof (struct CacheEntry));
+	pageEntry = (int *) malloc(storagePages * sizeof (int));
+	if(frames == NULL || freeFrames == NULL || entries == NULL || pageEntry == NULL) {
+		perror("Error allocating the page cache");
+		return FALSE;
+	}
+
+	for(i = 0; i < cachePages; i++) {
+		freeFrames[i] = cachePages - 1 - i;
+	}
+	freeFrameCount = cachePages;
+	for(i = 0; i < 2 * cachePages; i++) {
+		entries[i].frame = -1;
+		entries[i].list = CACHE_FREE;
+		entries[i].next = i + 1 < 2 * cachePages ? i + 1 : -1;
+	}
+	freeEntries = 0;
+	for(i = 0; i < storagePages; i++) {
+		pageEntry[i] = -1;
+	}
+	for(i = 0; i < CACHE_LISTS; i++) {
+		listHead[i] = listTail[i] = -1;
+		listSize[i] = 0;
+	}
+	target = 0;
+	return TRUE;
+}
+
+/**
+ * Makes a page resident and pins it. load reads its contents from the
+ * backend, callers about to overwrite the whole page skip that. A page
+ * brought in by readahead is not a reference: it goes on the recent list
+ * without counting a miss, and its first real use keeps it there.
+ */
+static char * cachePin(int pageNumber, BOOL metadata, BOOL load, BOOL prefetch) {
+	int e = pageEntry[pageNumber];
+	if(prefetch && e >= 0 && entries[e].frame < 0) {
+		// Readahead says nothing about how the cache is sized, leave the ghosts alone
+		entryRelease(e);
+		e = -1;
+	}
+	if(e >= 0 && entries[e].frame >= 0) {
+		cacheHits++;
+		STAT_INC(STAT_CACHE_HITS);
+		listRemove(e);
+		listPush(entries[e].prefetched ? CACHE_RECENT : CACHE_FREQUENT, e);
+		entries[e].prefetched = FALSE;
+	} else {
+		if(!prefetch) {
+			cacheMisses++;
+			STAT_INC(STAT_CACHE_MISSES);
+		}
+		int recentGhosts = listSize[CACHE_RECENT_GHOST], frequentGhosts = listSize[CACHE_FREQUENT_GHOST];
+		int list = CACHE_FREQUENT;
+
+		if(e >= 0 && entries[e].list == CACHE_RECENT_GHOST) {
+			// Recent pages were evicted too early, let them have more room
+			int step = frequentGhosts > recentGhosts ? frequentGhosts / recentGhosts : 1;
+			target = target + step < cachePages ? target + step : cachePages;
+			replace(FALSE);
+			listRemove(e);
+		} else if(e >= 0) {
+			int step = recentGhosts > frequentGhosts ? recentGhosts / frequentGhosts : 1;
+			target = target - step > 0 ? target - step : 0;
+			replace(TRUE);
+			listRemove(e);
+		} else {
+			int recentSide = listSize[CACHE_RECENT] + recentGhosts;
+			int total = recentSide + listSize[CACHE_FREQUENT] + frequentGhosts;
+			if(recentSide >= cachePages) {
+				if(listSize[CACHE_RECENT] < cachePages) {
+					entryRelease(listTail[CACHE_RECENT_GHOST]);
+					replace(FALSE);
+				} else {
+					int victim = findVictim(CACHE_RECENT);
+					if(victim >= 0) {
+						entryRelease(victim);
+						cacheEvictions++;
+					} else {
+						replace(FALSE);
+					}
+				}
+			} else if(total >= cachePages) {
+				if(total == 2 * cachePages) {
+					entryRelease(listTail[CACHE_FREQUENT_GHOST]);
+				}
+				replace(FALSE);
+			}
+
+			e = freeEntries;
+			freeEntries = entries[e].next;
+			entries[e].page = pageNumber;
+			entries[e].frame = -1;
+			entries[e].pins = 0;
+			entries[e].metadata = FALSE;
+			pageEntry[pageNumber] = e;
+			list = CACHE_RECENT;
+		}
+
+		if(freeFrameCount == 0) {
+			replace(FALSE);
+		}
+		entries[e].frame = freeFrames[--freeFrameCount];
+		entries[e].prefetched = prefetch;
+		listPush(list, e);
+		if(load) {
+			backend->read(pageNumber, frames + (size_t)entries[e].frame * PAGE_SIZE);
+		}
+	}
+
+	entries[e].pins++;
+	if(metadata) {
+		entries[e].metadata = TRUE;
+		entries[e].chance = TRUE;
+	}
+	return frames + (size_t)entries[e].frame * PAGE_SIZE;
+}
+
+static void cacheClose() {
+	free(frames);
+	free(freeFrames);
+	free(entries);
+	free(pageEntry);
+	frames = NULL;
+	freeFrames = NULL;
+	entries = NULL;
+	pageEntry = NULL;
+}
+
+/**
+ * Picks the backend used by the next storageOpen(), returns FALSE if there
+ * is no backend by that name
+ */
+BOOL storageSelect(char * name) {
+	int i;
+	for(i = 0; backends[i].name != NULL; i++) {
+		if(!strcmp(backends[i].name, name)) {
+			backend = &backends[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+const char * storageName() {
+	return backend->name;
+}
+
+/**
+ * Parses a comma separated list of mount options for the mmap backend,
+ * returns FALSE on an unknown one
+ */
+BOOL storageMountOptions(char * options) {
+	char * copy = strdup(options);
+	char * option = strtok(copy, ",");
+	BOOL valid = TRUE;
+	while(option != NULL && valid) {
+		int i;
+		for(i = 0; mountOptionNames[i] != NULL && strcmp(mountOptionNames[i], option); i++);
+		if(mountOptionNames[i] == NULL) {
+			fprintf(stderr, "Unknown mount option %s.\n", option);
+			valid = FALSE;
+		} else {
+			mountOptions |= 1 << i;
+		}
+		option = strtok(NULL, ",");
+	}
+	free(copy);
+
+	if((mountOptions & MOUNT_RANDOM) && (mountOptions & MOUNT_SEQUENTIAL)) {
+		fprintf(stderr, "The random and sequential mount options exclude each other.\n");
+		valid = FALSE;
+	}
+	return valid;
+}
+
+/**
+ * Sets the pages held by the page cache, used by the next storageOpen()
+ */
+void storageCacheSize(int pages) {
+	cachePages = pages > MIN_CACHE_PAGES ? pages : MIN_CACHE_PAGES;
+}
+
+/**
+ * Hands the open image of size bytes to the selected backend
+ */
+BOOL storageOpen(int fd, int size) {
+	storageFd = fd;
+	storagePages = size / PAGE_SIZE;
+	if(mountOptions && backend->map == NULL) {
+		fprintf(stderr, "Mount options only apply to the mmap backend, ignoring them.\n");
+	}
+	if(!backend->open(fd, size)) {
+		return FALSE;
+	}
+	return backend->map != NULL || cacheOpen();
+}
+
+/**
+ * Pins a page in memory and returns it. The page stays valid, and its
+ * changes unwritten, until storageUnpin(). metadata marks a directory page.
+ */
+char * storagePin(int pageNumber, BOOL metadata) {
+	if(backend->map != NULL) {
+		return backend->map(pageNumber);
+	}
+	return cachePin(pageNumber, metadata, TRUE, FALSE);
+}
+
+/**
+ * Whether several threads may pin pages at once while nothing writes. Only
+ * mapping backends, which hand out pages without touching the cache, allow
+ * it.
+ */
+BOOL storageConcurrent() {
+	return backend->map != NULL;
+}
+
+/**
+ * Releases a pinned page, writing it back if it was changed
+ */
+void storageUnpin(int pageNumber, BOOL dirty) {
+	if(backend->map != NULL) {
+		return;
+	}
+
+	struct CacheEntry * entry = &entries[pageEntry[pageNumber]];
+	entry->pins--;
+	if(dirty) {
+		backend->write(pageNumber, frames + (size_t)entry->frame * PAGE_SIZE);
+	}
+}
+
+void storageRead(int pageNumber, void * page, BOOL metadata) {
+	memcpy(page, storagePin(pageNumber, metadata), PAGE_SIZE);
+	storageUnpin(pageNumber, FALSE);
+}
+
+void storageWrite(int pageNumber, void * page) {
+	if(backend->map != NULL) {
+		backend->write(pageNumber, page);
+		return;
+	}
+
+	// The whole page is replaced, so a miss needs no read
+	memcpy(cachePin(pageNumber, FALSE, FALSE, FALSE), page, PAGE_SIZE);
+	storageUnpin(pageNumber, TRUE);
+}
+
+/**
+ * Starts bringing count consecutive pages into memory ahead of a reader
+ */
+void storagePrefetch(int first, int count) {
+	if(first <= 0 || count <= 0) {
+		return;
+	}
+	if(first + count > storagePages) {
+		count = storagePages - first;
+	}
+	if(backend->prefetch != NULL) {
+		backend->prefetch(first, count);
+		STAT_ADD(STAT_PAGES_PREFETCHED, count);
+		return;
+	}
+
+	// Leave most of the cache to the pages already in it
+	int limit = cachePages / 4 < MAX_PREFETCH_PAGES ? cachePages / 4 : MAX_PREFETCH_PAGES;
+	if(count > limit) {
+		count = limit;
+	}
+
+	// Read each run of pages that are not cached yet with one request
+	char * pages[MAX_PREFETCH_PAGES];
+	int i, run = 0;
+	for(i = 0; i <= count; i++) {
+		int page = first + i;
+		BOOL cached = i < count && pageEntry[page] >= 0 && entries[pageEntry[page]].frame >= 0;
+		if(i < count && !cached) {
+			pages[run++] = cachePin(page, FALSE, FALSE, TRUE);
+			continue;
+		}
+		if(run == 0) {
+			continue;
+		}
+
+		int start = page - run, j;
+		if(!backend->readRun(start, run, pages)) {
+			for(j = 0; j < run; j++) {
+				backend->read(start + j, pages[j]);
+			}
+		}
+		for(j = 0; j < run; j++) {
+			storageUnpin(start + j, FALSE);
+		}
+		STAT_ADD(STAT_PAGES_PREFETCHED, run);
+		run = 0;
+	}
+}
+
+/**
+ * Makes every write so far durable before returning, for updates whose
+ * writes must reach the image in order
+ */
+void storageBarrier() {
+	backend->flush();
+	if(fdatasync(storageFd) < 0) {
+		perror("Could not sync filesystem");
+	}
+}
+
+/**
+ * Gives the host space behind count free pages starting at first back to
+ * the host, returns FALSE if the host file system cannot punch holes
+ */
+BOOL storageDiscard(int first, int count) {
+	if(first <= 0 || count <= 0) {
+		return TRUE;
+	}
+	if(first + count > storagePages) {
+		count = storagePages - first;
+	}
+
+	if(backend->map == NULL) {
+		// The image reads back zeros now, cached copies of the pages are stale
+		int i;
+		for(i = first; i < first + count; i++) {
+			if(pageEntry[i] >= 0 && entries[pageEntry[i]].pins == 0) {
+				entryRelease(pageEntry[i]);
+			}
+		}
+	}
+	return backend->discard(first, count);
+}
+
+/**
+ * Bytes the image takes on the host, holes excluded
+ */
+long storageHostBytes() {
+	return hostBytes(storageFd);
+}
+
+/**
+ * Describes the page cache for the stats command
+ */
+void storageCacheReport(FILE * fp) {
+	if(backend->map != NULL) {
+		fprintf(fp, "Page cache\toff (the %s backend maps the image)\n", backend->name);
+		return;
+	}
+
+	unsigned long long lookups = cacheHits + cacheMisses;
+	fprintf(fp, "Page cache\t%d pages, %d recent (target %d), %d frequent, %d + %d ghosts\n",
+		cachePages, listSize[CACHE_RECENT], target, listSize[CACHE_FREQUENT],
+		listSize[CACHE_RECENT_GHOST], listSize[CACHE_FREQUENT_GHOST]);
+	fprintf(fp, "\t\t%llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+		cacheHits, cacheMisses, lookups ? 100.0 * cacheHits / lookups : 0.0, cacheEvictions);
+}
+
+unsigned long storageFlush() {
+	return backend->flush();
+}
+
+void storageClose() {
+	backend->close();
+	if(backend->map == NULL) {
+		cacheClose();
+	}
+	storageFd = -1;
+}
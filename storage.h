@@ -0,0 +1,105 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+/*
+ * Page storage behind getBlock()/saveBlock(). A backend moves whole pages
+ * between memory and the image file.
+ *
+ *   mmap   Maps the image MAP_SHARED and msyncs the mapping on every flush.
+ *   pread  Reads pages with pread() and queues written pages, which are
+ *          submitted as sorted, coalesced pwritev() runs. The fdatasync()
+ *          of a flush runs on a background thread so the next command
+ *          overlaps with it.
+ *
+ * The mmap backend takes mount options: populate prefaults the image,
+ * hugepage asks for transparent huge pages, random or sequential advise
+ * the kernel's own readahead and lock keeps the allocation table and the
+ * root resident.
+ *
+ * Free pages can be discarded: the host blocks behind them are punched out
+ * of the image with fallocate(), so the image shrinks on the host.
+ *
+ * Backends that cannot map pages sit behind a fixed-size page cache with
+ * ARC eviction. Pages read as directory entries get a second chance
+ * before eviction so bulk data does not push the tree out. The cache is
+ * write-through: the backend sees every write.
+ */
+
+/*  Mount options of the mmap backend, in the order storageMountOptions() names them   */
+#define MOUNT_POPULATE   0x01
+#define MOUNT_HUGEPAGE   0x02
+#define MOUNT_RANDOM     0x04
+#define MOUNT_SEQUENTIAL 0x08
+#define MOUNT_LOCK       0x10
+
+/* Pages the pread backend queues before submitting them */
+#define WRITE_BATCH_PAGES 64
+
+/* Most pages read ahead in one request */
+#define MAX_PREFETCH_PAGES 64
+
+/*  Page cache   */
+#define DEFAULT_CACHE_PAGES 1024
+#define MIN_CACHE_PAGES 16
+// ARC lists: resident recent/frequent pages, and the ghosts evicted from each
+#define CACHE_RECENT 0
+#define CACHE_FREQUENT 1
+#define CACHE_RECENT_GHOST 2
+#define CACHE_FREQUENT_GHOST 3
+#define CACHE_LISTS 4
+#define CACHE_FREE -1
+
+struct CacheEntry {
+	int page;
+	// Index into the frames while resident, -1 for a ghost
+	int frame;
+	int list;
+	int pins;
+	// Read as a directory entry, and whether it has used its second chance
+	BOOL metadata;
+	BOOL chance;
+	// Brought in by readahead and not referenced since
+	BOOL prefetched;
+	// Toward the most and least recently used ends of the list
+	int prev;
+	int next;
+};
+
+struct StorageBackend {
+	const char * name;
+	// Takes over the open image, returns FALSE on failure
+	BOOL (*open)(int fd, int size);
+	void (*read)(int pageNumber, void * page);
+	void (*write)(int pageNumber, void * page);
+	// Address of a page the backend can hand out directly, NULL if it cannot
+	char * (*map)(int pageNumber);
+	// Readahead: mapping backends are advised, the others read a run of pages for the cache
+	void (*prefetch)(int first, int count);
+	BOOL (*readRun)(int first, int count, char ** pages);
+	// Starts making every write so far durable, returns the bytes it submitted
+	unsigned long (*flush)();
+	// Releases the host space behind free pages, FALSE if the host cannot
+	BOOL (*discard)(int first, int count);
+	// Flushes and waits for everything to reach the image
+	void (*close)();
+};
+
+BOOL storageSelect(char * name);
+const char * storageName();
+BOOL storageMountOptions(char * options);
+void storageCacheSize(int pages);
+BOOL storageOpen(int fd, int size);
+char * storagePin(int pageNumber, BOOL metadata);
+BOOL storageConcurrent();
+void storageUnpin(int pageNumber, BOOL dirty);
+void storageRead(int pageNumber, void * page, BOOL metadata);
+void storageWrite(int pageNumber, void * page);
+void storagePrefetch(int first, int count);
+BOOL storageDiscard(int first, int count);
+long storageHostBytes();
+void storageCacheReport(FILE * fp);
+unsigned long storageFlush();
+void storageBarrier();
+void storageClose();
+
+#endif
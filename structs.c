@@ -5,3 +5,7 @@
  * Definition of structs in structs.h
  *
  */
+
+// Every directory entry occupies exactly one 512 byte page
+_Static_assert(sizeof (struct Metadata) == 512, "struct Metadata must fill a page");
+_Static_assert(sizeof (struct Block) == 512, "struct Block must fill a page");
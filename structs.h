@@ -5,8 +5,10 @@
 #define TRUE 1
 #define FALSE 0
 
-#define MAX_FILENAME_SIZE 492
+#define MAX_FILENAME_SIZE 256
+#define MAX_INLINE_DATA_SIZE 236
 #define MAX_BLOCK_DATA_SIZE 508
+#define JOURNAL_MAX_PAGES 7
 
 /*
  *
@@ -23,12 +25,40 @@ struct AllocationTable {
 	char * bitmap;
 };
 
-struct RootDir {
-	struct Metadata * metadata;
+/*  Kept in a directory's '.' entry, which has no inline data of its own   */
+struct DirectoryInfo {
+	// Last entry in the chain, so new entries are linked without a walk
+	int tailBlock;
+	// Entries in the directory, not counting '.' and '..'
+	int entries;
+	// Bytes of file data and pages below the directory, its own '.' and '..'
+	// included, so du needs no walk. Snapshots are left out.
+	unsigned int bytes;
+	int pages;
+	// Most bytes of file data allowed below the directory, 0 for no limit
+	unsigned int quota;
+};
+
+/*  Kept in the entry of a file stored in blocks, so appends need no walk   */
+struct FileTail {
+	// Last block of the chain, 0 when unknown
+	int block;
+	// Bytes of data in that block
+	int fill;
+	// Pages in the chain, holes not included
+	int pages;
 };
 
 struct Metadata {
 	char filename[MAX_FILENAME_SIZE];
+	union {
+		// Contents of a small file when INLINE_DATA is set, so it needs no data block
+		char inlineData[MAX_INLINE_DATA_SIZE];
+		// Index of the directory when this is a '.' entry
+		struct DirectoryInfo dir;
+		// End of the chain of a file stored in blocks
+		struct FileTail tail;
+	};
 	unsigned int fileSize;
 	unsigned int lastTimeUpdate;
 	unsigned int lastDateUpdate;
@@ -45,5 +75,51 @@ struct Block {
 	char data[MAX_BLOCK_DATA_SIZE];
 };
 
+/*  First page of the journal, valid while magic is set   */
+struct JournalHeader {
+	unsigned int magic;
+	// Pages whose new contents follow the header, in order
+	int count;
+	int pages[JOURNAL_MAX_PAGES];
+	// Hash of each page image, a torn journal is ignored
+	unsigned long long hashes[JOURNAL_MAX_PAGES];
+};
+
+/*  Page after the generation table   */
+struct GenerationHeader {
+	unsigned int magic;
+	// Picked when the image is created, kept by restore
+	unsigned int image;
+	// Generation writes go to, persisted so a backup never shares one with later writes
+	unsigned int next;
+};
+
+/*  Start of a backup stream, followed by the allocation table and runs of pages   */
+struct BackupHeader {
+	unsigned int magic;
+	// Identifies the image, an incremental backup must be of the same one as its base
+	unsigned int image;
+	// Pages written up to this generation are in this backup or the ones before it
+	unsigned int generation;
+	// Generation of the backup this one holds the changes since, 0 for a full backup
+	unsigned int base;
+	// Pages in the runs that follow
+	int pages;
+};
+
+/*  Consecutive pages of a backup, a run of no pages ends the stream   */
+struct BackupRun {
+	int first;
+	int count;
+};
+
+/*  Precedes every extent in the data of a compressed file   */
+struct ExtentHeader {
+	// Bytes of file data in the extent
+	unsigned short logicalSize;
+	// Bytes that follow the header, equal to logicalSize when the extent is stored raw
+	unsigned short storedSize;
+};
+
 
 #endif
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Incremental backups taken across sessions: a backup followed by quit must
+# not let the next session reuse the backup's generation.
+# Usage: tests/backup.sh path/to/filesystem
+FS=${1:-obj64/filesystem}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+fail() { echo "FAIL: $*"; exit 1; }
+run() { img=$1; shift; printf '%s\n' "$@" quit | "$FS" "$img" 2>&1; }
+
+run "$DIR/a.img" "write f 3 414243" > /dev/null
+run "$DIR/a.img" "backup $DIR/full.bak" | grep -q "Backed up" || fail "full backup"
+run "$DIR/a.img" "write g 3 444546" > /dev/null
+run "$DIR/a.img" "backup $DIR/inc.bak $DIR/full.bak" | grep -q "Backed up [1-9][0-9]* pages" ||
+	fail "incremental backup in a later session holds no pages"
+
+run "$DIR/b.img" "restore $DIR/full.bak $DIR/inc.bak" | grep -q "Restored" || fail "restore"
+run "$DIR/b.img" "cat g" | grep -q "DEF" || fail "restored image lacks the file written after the full backup"
+
+# Same session as the write, on top of the previous incremental
+run "$DIR/a.img" "write h 3 474849" "backup $DIR/inc2.bak $DIR/inc.bak" | grep -q "Backed up [1-9]" ||
+	fail "incremental backup in the session of the write"
+run "$DIR/c.img" "restore $DIR/full.bak $DIR/inc.bak $DIR/inc2.bak" "cat h" | grep -q "GHI" ||
+	fail "second incremental"
+
+# A backup of another image is not accepted as a base
+run "$DIR/d.img" "write x 1 41" "backup $DIR/other.bak" > /dev/null
+run "$DIR/a.img" "backup $DIR/bad.bak $DIR/other.bak" | grep -q "not a backup of this image" ||
+	fail "backup of another image accepted as a base"
+run "$DIR/e.img" "restore $DIR/full.bak $DIR/other.bak" | grep -q "another image" ||
+	fail "restore mixed the backups of two images"
+
+echo "backup: ok"
@@ -0,0 +1,400 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "structs.h"
+#include "filesystem.h"
+#include "stats.h"
+
+/*
+ * Workload tool for the filesystem.
+ *
+ *   generate  Writes a seeded synthetic command mix to stdout: a directory
+ *             tree with bounded fan-out, files drawn from a size
+ *             distribution and a steady stream of overwrites and deletes
+ *             so the image ages the way a long running one does.
+ *   replay    Writes a trace recorded with `filesystem -t` (or any plain
+ *             command script) to stdout, either as fast as possible or at
+ *             the recorded pacing, along with the answers its commands
+ *             read.
+ *
+ * Both are meant to be piped into the filesystem, e.g.
+ *   obj64/workload generate -s 7 | obj64/filesystem -s stats.json fs.img
+ */
+
+/*  Shape of the generated tree   */
+#define MAX_DIRS 256
+#define MAX_FILES 4096
+#define MAX_DEPTH 8
+#define DEFAULT_FANOUT 6
+#define DEFAULT_OPS 2000
+#define DEFAULT_CHURN 15
+
+/* Stop creating once this many percent of the data pages are (estimated) in use */
+#define FILL_PERCENT 75
+
+/* Longest range read by a generated get */
+#define MAX_GET_LENGTH 256
+
+struct GenDir {
+	int parent;
+	int depth;
+	int children;
+};
+
+struct GenFile {
+	int dir;
+	int size;
+	BOOL alive;
+};
+
+struct GenDir dirs[MAX_DIRS];
+struct GenFile files[MAX_FILES];
+int dirCount = 0;
+int fileCount = 0;
+int cwd = 0;
+int pagesUsed = 0;
+
+/**
+ * Uniform integer in [low, high]
+ */
+int randomRange(int low, int high) {
+	return low + rand() % (high - low + 1);
+}
+
+/**
+ * Draws a file size: mostly tiny files, some medium and a few large ones
+ */
+int randomFileSize() {
+	int bucket = rand() % 100;
+	if(bucket < 60) {
+		return randomRange(1, 200);
+	} else if(bucket < 90) {
+		return randomRange(201, 4096);
+	}
+	return randomRange(4097, 32768);
+}
+
+/**
+ * Estimated pages a file takes: its entry plus its data blocks
+ */
+int filePages(int size) {
+	if(size <= MAX_INLINE_DATA_SIZE) {
+		return 1;
+	}
+	int blocks = (size + MAX_BLOCK_DATA_SIZE - 1) / MAX_BLOCK_DATA_SIZE;
+	return 1 + (blocks > 0 ? blocks : 1);
+}
+
+/**
+ * Emits the cd commands needed to move from the current directory to dir
+ */
+void changeDirectory(int dir) {
+	int up = cwd, down = dir;
+	int path[MAX_DEPTH + 1];
+	int depth = 0;
+
+	// Climb both sides until they meet at the common ancestor
+	while(dirs[up].depth > dirs[down].depth) {
+		printf("cd ..\n");
+		up = dirs[up].parent;
+	}
+	while(dirs[down].depth > dirs[up].depth) {
+		path[depth++] = down;
+		down = dirs[down].parent;
+	}
+	while(up != down) {
+		printf("cd ..\n");
+		up = dirs[up].parent;
+		path[depth++] = down;
+		down = dirs[down].parent;
+	}
+
+	while(depth > 0) {
+		printf("cd d%d\n", path[--depth]);
+	}
+	cwd = dir;
+}
+
+/**
+ * Emits a write of size printable bytes
+ */
+void emitWrite(int file) {
+	int i;
+	printf("write f%d %d ", file, files[file].size);
+	for(i = 0; i < files[file].size; i++) {
+		printf("%02x", 'a' + rand() % 26);
+	}
+	printf("\n");
+}
+
+/**
+ * Picks a live file at random, returns -1 if there are none
+ */
+int randomFile() {
+	int tries;
+	for(tries = 0; tries < 16 && fileCount > 0; tries++) {
+		int file = rand() % fileCount;
+		if(files[file].alive) {
+			return file;
+		}
+	}
+
+	int file;
+	for(file = 0; file < fileCount; file++) {
+		if(files[file].alive) {
+			return file;
+		}
+	}
+	return -1;
+}
+
+void genMkdir(int fanout) {
+	int parent = rand() % dirCount;
+	if(dirCount >= MAX_DIRS || dirs[parent].depth >= MAX_DEPTH || dirs[parent].children >= fanout) {
+		return;
+	}
+	if(pagesUsed + 3 > DATA_BLOCKS * FILL_PERCENT / 100) {
+		return;
+	}
+
+	changeDirectory(parent);
+	dirs[dirCount].parent = parent;
+	dirs[dirCount].depth = dirs[parent].depth + 1;
+	dirs[dirCount].children = 0;
+	dirs[parent].children++;
+	printf("mkdir d%d\n", dirCount++);
+	pagesUsed += 3;
+}
+
+void genCreate() {
+	int size = randomFileSize();
+	if(fileCount >= MAX_FILES || pagesUsed + filePages(size) > DATA_BLOCKS * FILL_PERCENT / 100) {
+		return;
+	}
+
+	int file = fileCount++;
+	files[file].dir = rand() % dirCount;
+	files[file].size = size;
+	files[file].alive = TRUE;
+	pagesUsed += filePages(size);
+
+	changeDirectory(files[file].dir);
+	emitWrite(file);
+}
+
+void genOverwrite() {
+	int file = randomFile();
+	if(file < 0) {
+		return;
+	}
+
+	int size = randomFileSize();
+	if(pagesUsed - filePages(files[file].size) + filePages(size) > DATA_BLOCKS * FILL_PERCENT / 100) {
+		return;
+	}
+	pagesUsed += filePages(size) - filePages(files[file].size);
+	files[file].size = size;
+
+	changeDirectory(files[file].dir);
+	emitWrite(file);
+}
+
+void genRemove() {
+	int file = randomFile();
+	if(file < 0) {
+		return;
+	}
+
+	changeDirectory(files[file].dir);
+	printf("rm f%d\n", file);
+	files[file].alive = FALSE;
+	pagesUsed -= filePages(files[file].size);
+}
+
+void genRead() {
+	int file = randomFile();
+	if(file < 0) {
+		return;
+	}
+
+	changeDirectory(files[file].dir);
+	if(rand() % 2) {
+		printf("cat f%d\n", file);
+	} else {
+		int start = rand() % files[file].size;
+		printf("get f%d %d %d\n", file, start, start + randomRange(1, MAX_GET_LENGTH));
+	}
+}
+
+void genList() {
+	changeDirectory(rand() % dirCount);
+	printf("ls\n");
+}
+
+/**
+ * Writes a synthetic command mix to stdout
+ */
+void generate(unsigned int seed, int ops, int fanout, int churn) {
+	srand(seed);
+
+	// Age a subdirectory so the debug entries in the root stay out of the way
+	printf("mkdir work\ncd work\n");
+	dirs[0].parent = 0;
+	dirs[0].depth = 0;
+	dirCount = 1;
+
+	int i;
+	for(i = 0; i < ops; i++) {
+		int roll = rand() % 100;
+
+		// Deletes get more likely as the image fills up
+		int removes = churn + (pagesUsed * 100 / DATA_BLOCKS > FILL_PERCENT - 10 ? 20 : 0);
+		if(roll < removes) {
+			genRemove();
+		} else if(roll < removes + 5) {
+			genMkdir(fanout);
+		} else if(roll < removes + 35) {
+			genCreate();
+		} else if(roll < removes + 45) {
+			genOverwrite();
+		} else if(roll < removes + 85) {
+			genRead();
+		} else {
+			genList();
+		}
+	}
+}
+
+/**
+ * Writes a recorded trace to stdout, sleeping to match the recorded start
+ * times when paced. speed scales the recorded gaps (2 replays twice as fast).
+ */
+void replay(FILE * trace, BOOL paced, double speed) {
+	char * line = NULL;
+	size_t size = 0;
+	unsigned long long begin = statsNow();
+	while(getline(&line, &size, trace) != -1) {
+		if(line[0] == '#') {
+			continue;
+		}
+
+		// Answers a command read follow it and are fed to its prompt as they are
+		if(line[0] == TRACE_ANSWER && line[1] == '\t') {
+			fputs(line + 2, stdout);
+			continue;
+		}
+
+		// Trace lines are <start ns> <tab> <duration ns> <tab> <result> <tab> <command>, anything else is a bare command
+		char * command = line;
+		unsigned long long start, duration, digest;
+		unsigned long bytes;
+		int consumed = 0;
+		if(sscanf(line, "%llu\t%llu\t%lu:%llx\t%n", &start, &duration, &bytes, &digest, &consumed) == 4 && consumed > 0) {
+			command = line + consumed;
+
+			unsigned long long due = begin + (unsigned long long)(start / speed);
+			unsigned long long now = statsNow();
+			if(paced && due > now) {
+				struct timespec ts;
+				ts.tv_sec = (due - now) / 1000000000ULL;
+				ts.tv_nsec = (due - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		fputs(command, stdout);
+		if(paced) {
+			fflush(stdout);
+		}
+	}
+	free(line);
+}
+
+/*
+ * help() - Print a help message.
+ */
+void help(char *progname)
+{
+	printf("Usage: %s generate [-s SEED] [-n OPS] [-f FANOUT] [-c CHURN]\n", progname);
+	printf("       %s replay [-p] [-x SPEED] [TRACE]\n", progname);
+	printf("Writes filesystem commands to stdout\n");
+	printf("  -s SEED    Seed for the synthetic mix (default 1)\n");
+	printf("  -n OPS     Number of operations to generate (default %d)\n", DEFAULT_OPS);
+	printf("  -f FANOUT  Most subdirectories per directory (default %d)\n", DEFAULT_FANOUT);
+	printf("  -c CHURN   Percentage of operations that delete a file (default %d)\n", DEFAULT_CHURN);
+	printf("  -p         Replay at the recorded pacing instead of as fast as possible\n");
+	printf("  -x SPEED   Speed up (or slow down) paced replay by SPEED\n");
+	exit(0);
+}
+
+/*
+ * main() - Dispatches to the generator or the replayer
+ */
+int main(int argc, char **argv)
+{
+	long opt;
+	unsigned int seed = 1;
+	int ops = DEFAULT_OPS, fanout = DEFAULT_FANOUT, churn = DEFAULT_CHURN;
+	BOOL paced = FALSE;
+	double speed = 1.0;
+
+	if(argc < 2 || (strcmp(argv[1], "generate") && strcmp(argv[1], "replay")))
+	{
+		help(argv[0]);
+	}
+	char * mode = argv[1];
+
+	optind = 2;
+	while((opt = getopt(argc, argv, "hs:n:f:c:px:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'h':
+			help(argv[0]);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			ops = atoi(optarg);
+			break;
+		case 'f':
+			fanout = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'c':
+			churn = atoi(optarg);
+			break;
+		case 'p':
+			paced = TRUE;
+			break;
+		case 'x':
+			speed = atof(optarg) > 0 ? atof(optarg) : 1.0;
+			break;
+		}
+	}
+
+	if(!strcmp(mode, "generate"))
+	{
+		generate(seed, ops, fanout, churn);
+		return 0;
+	}
+
+	FILE * trace = stdin;
+	if(argv[optind] != NULL)
+	{
+		trace = fopen(argv[optind], "r");
+		if(trace == NULL)
+		{
+			perror("Error opening trace");
+			return 1;
+		}
+	}
+	replay(trace, paced, speed);
+	if(trace != stdin)
+	{
+		fclose(trace);
+	}
+	return 0;
+}